@@ -0,0 +1,145 @@
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+/*
+ * Atomic operations on ints and pointers.
+ *
+ *    atomic_cas       - if *P equals OLD, set it to NEW. Returns nonzero
+ *                       if the swap happened.
+ *    atomic_casptr    - same, on a pointer.
+ *    atomic_fetch_add - add DELTA to *P and return the old value.
+ *    atomic_swap      - store V in *P and return the old value.
+ *    atomic_swapptr   - same, on a pointer.
+ *    membar           - full memory barrier: no load or store moves
+ *                       across it in either direction.
+ *
+ * All of these imply a full barrier.
+ *
+ * Where the compiler knows the cpu has a compare-and-swap (it defines
+ * __GCC_HAVE_SYNC_COMPARE_AND_SWAP_4) these compile to the native
+ * instructions. Otherwise we are on a uniprocessor without one (the
+ * MIPS-I in System/161 has no ll/sc) and they are made atomic by
+ * turning interrupts off for the couple of instructions involved.
+ * Callers get the same semantics either way.
+ */
+
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4)
+
+static inline int
+atomic_cas(volatile int *p, int old, int new)
+{
+	return __sync_bool_compare_and_swap(p, old, new);
+}
+
+static inline int
+atomic_casptr(void *volatile *p, void *old, void *new)
+{
+	return __sync_bool_compare_and_swap(p, old, new);
+}
+
+static inline int
+atomic_fetch_add(volatile int *p, int delta)
+{
+	return __sync_fetch_and_add(p, delta);
+}
+
+static inline void
+membar(void)
+{
+	__sync_synchronize();
+}
+
+static inline int
+atomic_swap(volatile int *p, int v)
+{
+	/* test_and_set is only an acquire barrier; make it a full one. */
+	membar();
+	return __sync_lock_test_and_set(p, v);
+}
+
+static inline void *
+atomic_swapptr(void *volatile *p, void *v)
+{
+	membar();
+	return __sync_lock_test_and_set(p, v);
+}
+
+#else /* no native compare-and-swap: uniprocessor */
+
+#include <machine/spl.h>
+
+static inline void
+membar(void)
+{
+	/* One cpu: only the compiler can reorder. */
+	__asm volatile("" ::: "memory");
+}
+
+static inline int
+atomic_cas(volatile int *p, int old, int new)
+{
+	int spl, result = 0;
+
+	spl = splhigh();
+	if (*p == old) {
+		*p = new;
+		result = 1;
+	}
+	splx(spl);
+	return result;
+}
+
+static inline int
+atomic_casptr(void *volatile *p, void *old, void *new)
+{
+	int spl, result = 0;
+
+	spl = splhigh();
+	if (*p == old) {
+		*p = new;
+		result = 1;
+	}
+	splx(spl);
+	return result;
+}
+
+static inline int
+atomic_fetch_add(volatile int *p, int delta)
+{
+	int spl, old;
+
+	spl = splhigh();
+	old = *p;
+	*p = old + delta;
+	splx(spl);
+	return old;
+}
+
+static inline int
+atomic_swap(volatile int *p, int v)
+{
+	int spl, old;
+
+	spl = splhigh();
+	old = *p;
+	*p = v;
+	splx(spl);
+	return old;
+}
+
+static inline void *
+atomic_swapptr(void *volatile *p, void *v)
+{
+	int spl;
+	void *old;
+
+	spl = splhigh();
+	old = *p;
+	*p = v;
+	splx(spl);
+	return old;
+}
+
+#endif
+
+#endif /* _ATOMIC_H_ */
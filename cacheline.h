@@ -0,0 +1,22 @@
+#ifndef _CACHELINE_H_
+#define _CACHELINE_H_
+
+/*
+ * Cache line size, for laying out data that different threads write
+ * so that it doesn't share a line (false sharing). 64 bytes is at
+ * least as large as the line size of every cpu we run on; erring
+ * large only costs padding.
+ *
+ * CACHELINE_ALIGNED on a struct makes its size and alignment a
+ * multiple of the line size. Note that this only controls layout
+ * relative to the start of the enclosing object: a kmalloc'd object
+ * of 64 bytes or more is aligned to at least 64 bytes because the
+ * subpage allocator hands out power-of-two blocks on their natural
+ * boundary, but statically allocated objects get the attribute's
+ * alignment from the linker.
+ */
+
+#define CACHELINE_SIZE		64
+#define CACHELINE_ALIGNED	__attribute__((__aligned__(CACHELINE_SIZE)))
+
+#endif /* _CACHELINE_H_ */
@@ -0,0 +1,83 @@
+/*
+ * Sharded statistics counters.
+ * See counter.h for specifications of the functions.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <atomic.h>
+#include <thread.h>
+#include <curthread.h>
+#include <counter.h>
+
+struct counter *
+counter_create(const char *name)
+{
+	struct counter *c;
+
+	c = kmalloc(sizeof(struct counter));
+	if (c == NULL) {
+		return NULL;
+	}
+
+	c->c_name = kstrdup(name);
+	if (c->c_name == NULL) {
+		kfree(c);
+		return NULL;
+	}
+
+	counter_reset(c);
+	return c;
+}
+
+void
+counter_add(struct counter *c, int delta)
+{
+	struct counterslot *slot;
+
+	assert(c != NULL);
+
+	/*
+	 * Cast so that a pid of -1 (process table full) still picks a
+	 * valid slot.
+	 */
+	slot = &c->c_slots[(unsigned)curthread->pid % COUNTER_SLOTS];
+
+	/* Two threads can share a slot, so the add must be atomic. */
+	atomic_fetch_add(&slot->cs_value, delta);
+}
+
+long
+counter_read(struct counter *c)
+{
+	long total = 0;
+	int i;
+
+	assert(c != NULL);
+
+	for (i=0; i<COUNTER_SLOTS; i++) {
+		total += c->c_slots[i].cs_value;
+	}
+	return total;
+}
+
+void
+counter_reset(struct counter *c)
+{
+	int i;
+
+	assert(c != NULL);
+
+	for (i=0; i<COUNTER_SLOTS; i++) {
+		c->c_slots[i].cs_value = 0;
+	}
+}
+
+void
+counter_destroy(struct counter *c)
+{
+	assert(c != NULL);
+
+	kfree(c->c_name);
+	kfree(c);
+}
@@ -0,0 +1,49 @@
+#ifndef _COUNTER_H_
+#define _COUNTER_H_
+
+#include <cacheline.h>
+
+/*
+ * Sharded statistics counter.
+ *
+ * A counter is split into COUNTER_SLOTS slots, each on its own cache
+ * line. A thread always adds to the slot picked by its pid, so
+ * threads incrementing the same counter mostly hit different lines,
+ * and reading the counter sums the slots. Totals are exact: no update
+ * is ever lost, and adding is one atomic_fetch_add on a line that is
+ * usually not shared.
+ *
+ * Meant for statistics that are bumped often and read rarely. Reading
+ * while others are adding gives a value that was correct at some
+ * point during the read.
+ *
+ * Operations:
+ *    counter_create  - make a counter starting at zero.
+ *    counter_add     - add DELTA (which may be negative).
+ *    counter_inc     - add 1.
+ *    counter_read    - return the current total.
+ *    counter_reset   - set the total back to zero. Not atomic with
+ *                      respect to concurrent counter_add calls.
+ *    counter_destroy - free the counter.
+ */
+
+#define COUNTER_SLOTS 8
+
+struct counterslot {
+	volatile int cs_value;
+} CACHELINE_ALIGNED;
+
+struct counter {
+	struct counterslot c_slots[COUNTER_SLOTS];
+	char *c_name;
+};
+
+struct counter *counter_create(const char *name);
+void counter_add(struct counter *c, int delta);
+long counter_read(struct counter *c);
+void counter_reset(struct counter *c);
+void counter_destroy(struct counter *c);
+
+#define counter_inc(c) counter_add((c), 1)
+
+#endif /* _COUNTER_H_ */
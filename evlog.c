@@ -0,0 +1,285 @@
+/*
+ * Binary event log. See evlog.h for the specification.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <kern/unistd.h>
+#include <thread.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <uio.h>
+#include <atomic.h>
+#include <evlog.h>
+
+/* Records written to the file at a time. */
+#define EVLOG_CHUNK 256
+
+struct evlog {
+	struct evrec *el_ring;
+	volatile int *el_ready;		/* slot holds record n once it is n+1 */
+	unsigned el_mask;		/* ring size - 1 */
+	volatile int el_head;		/* records reserved */
+	volatile int el_tail;		/* records flushed; flusher only */
+	volatile int el_stalls;
+	volatile int el_stop;
+	struct semaphore *el_done;
+
+	struct vnode *el_vn;
+	off_t el_offset;
+	int el_error;
+	u_int32_t el_count;
+	u_int32_t el_nways;
+	u_int32_t el_nintersections;
+	u_int8_t el_buf[EVLOG_CHUNK * EVLOG_RECLEN];
+};
+
+/* The running log, or NULL. */
+static struct evlog *evlog;
+
+static
+void
+put32(u_int8_t *p, u_int32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static
+void
+evrec_encode(u_int8_t *p, const struct evrec *er)
+{
+	put32(p, er->er_time);
+	put32(p + 4, er->er_vehicle);
+	p[8] = er->er_intersection >> 8;
+	p[9] = er->er_intersection;
+	p[10] = er->er_code;
+	p[11] = er->er_seg;
+	p[12] = er->er_type;
+	p[13] = er->er_lane;
+	p[14] = er->er_turn;
+	p[15] = er->er_step;
+}
+
+/*
+ * Write LEN bytes at file offset POS. After the first error, nothing
+ * more is written, but the ring is still drained so nobody stalls.
+ */
+static
+void
+evlog_write(struct evlog *el, const u_int8_t *p, int len, off_t pos)
+{
+	struct uio u;
+	int result;
+
+	while (len > 0 && el->el_error == 0) {
+		mk_kuio(&u, (void *)p, len, pos, UIO_WRITE);
+		result = VOP_WRITE(el->el_vn, &u);
+		if (result == 0 && u.uio_offset == pos) {
+			result = EIO;
+		}
+		if (result) {
+			el->el_error = result;
+			break;
+		}
+		p += u.uio_offset - pos;
+		len -= u.uio_offset - pos;
+		pos = u.uio_offset;
+	}
+}
+
+static
+void
+evlog_header(struct evlog *el, u_int32_t count)
+{
+	u_int8_t hdr[EVLOG_HDRLEN];
+
+	put32(hdr, EVLOG_MAGIC);
+	put32(hdr + 4, EVLOG_VERSION);
+	put32(hdr + 8, EVLOG_RECLEN);
+	put32(hdr + 12, count);
+	put32(hdr + 16, el->el_nways);
+	put32(hdr + 20, el->el_nintersections);
+	put32(hdr + 24, el->el_stalls);
+	put32(hdr + 28, 0);
+	evlog_write(el, hdr, EVLOG_HDRLEN, 0);
+}
+
+/*
+ * Flusher thread. Copies finished records out of the ring a chunk at
+ * a time, frees their slots, and writes them, until told to stop and
+ * there is nothing left.
+ */
+static
+void
+evlog_flusher(void *data, unsigned long unused)
+{
+	struct evlog *el = data;
+	unsigned tail, slot;
+	int n;
+
+	(void)unused;
+
+	for (;;) {
+		tail = el->el_tail;
+		for (n = 0; n < EVLOG_CHUNK; n++) {
+			slot = (tail + n) & el->el_mask;
+			if (el->el_ready[slot] != (int)(tail + n + 1)) {
+				break;
+			}
+			membar();	/* the ready mark before the record */
+			evrec_encode(el->el_buf + n * EVLOG_RECLEN,
+				     &el->el_ring[slot]);
+		}
+		if (n > 0) {
+			membar();	/* done with the slots: give them back */
+			el->el_tail = tail + n;
+			evlog_write(el, el->el_buf, n * EVLOG_RECLEN, el->el_offset);
+			el->el_offset += n * EVLOG_RECLEN;
+			el->el_count += n;
+			continue;
+		}
+		if (el->el_stop && (int)tail == el->el_head) {
+			break;
+		}
+		thread_yield();
+	}
+	V(el->el_done);
+}
+
+int
+evlog_start(const char *path, int nrecords, int nways, int nintersections)
+{
+	struct evlog *el;
+	char *copy;
+	unsigned size;
+	int result;
+
+	assert(evlog == NULL);
+	assert(nrecords > 0);
+
+	for (size = 1; size < (unsigned)nrecords; size <<= 1)
+		;
+
+	el = kmalloc(sizeof(struct evlog));
+	if (el == NULL) {
+		return ENOMEM;
+	}
+	el->el_ring = kmalloc(size * sizeof(struct evrec));
+	el->el_ready = kmalloc(size * sizeof(int));
+	el->el_done = sem_create("evlog done", 0);
+	copy = kstrdup(path);	/* vfs_open may scribble on it */
+	if (el->el_ring == NULL || el->el_ready == NULL ||
+	    el->el_done == NULL || copy == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	result = vfs_open(copy, O_WRONLY | O_CREAT | O_TRUNC, &el->el_vn);
+	if (result) {
+		goto fail;
+	}
+	kfree(copy);
+	copy = NULL;
+
+	el->el_mask = size - 1;
+	/* Slot i first holds record i, so nothing in it is ready yet. */
+	for (size = 0; size <= el->el_mask; size++) {
+		el->el_ready[size] = 0;
+	}
+	el->el_head = 0;
+	el->el_tail = 0;
+	el->el_stalls = 0;
+	el->el_stop = 0;
+	el->el_offset = EVLOG_HDRLEN;
+	el->el_error = 0;
+	el->el_count = 0;
+	el->el_nways = nways;
+	el->el_nintersections = nintersections;
+
+	/* Count 0 until evlog_stop knows better. */
+	evlog_header(el, 0);
+	if (el->el_error) {
+		result = el->el_error;
+		vfs_close(el->el_vn);
+		goto fail;
+	}
+
+	result = thread_fork("evlog flusher", el, 0, evlog_flusher, NULL);
+	if (result) {
+		vfs_close(el->el_vn);
+		goto fail;
+	}
+	evlog = el;
+	return 0;
+
+ fail:
+	if (el->el_done != NULL) {
+		sem_destroy(el->el_done);
+	}
+	kfree(copy);
+	kfree((void *)el->el_ready);
+	kfree(el->el_ring);
+	kfree(el);
+	return result;
+}
+
+void
+evlog_add(const struct evrec *er)
+{
+	struct evlog *el = evlog;
+	int n, stalled = 0;
+
+	if (el == NULL) {
+		return;
+	}
+
+	/* Reserve the next record, waiting for the flusher if the ring is full. */
+	for (;;) {
+		n = el->el_head;
+		if ((unsigned)(n - el->el_tail) > el->el_mask) {
+			if (!stalled) {
+				atomic_fetch_add(&el->el_stalls, 1);
+				stalled = 1;
+			}
+			thread_yield();
+			continue;
+		}
+		if (atomic_cas(&el->el_head, n, n + 1)) {
+			break;
+		}
+	}
+
+	el->el_ring[n & el->el_mask] = *er;
+	membar();	/* the record before the mark that says it's ready */
+	el->el_ready[n & el->el_mask] = n + 1;
+}
+
+int
+evlog_stop(u_int32_t *records, u_int32_t *stalls)
+{
+	struct evlog *el = evlog;
+	int result;
+
+	assert(el != NULL);
+
+	el->el_stop = 1;
+	P(el->el_done);
+	evlog = NULL;
+
+	evlog_header(el, el->el_count);
+	result = el->el_error;
+	vfs_close(el->el_vn);
+
+	*records = el->el_count;
+	*stalls = el->el_stalls;
+	sem_destroy(el->el_done);
+	kfree((void *)el->el_ready);
+	kfree(el->el_ring);
+	kfree(el);
+	return result;
+}
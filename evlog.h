@@ -0,0 +1,78 @@
+#ifndef _EVLOG_H_
+#define _EVLOG_H_
+
+/*
+ * Binary event log: a compact record of what every vehicle did, for
+ * analysis after the run instead of reading kprintf output.
+ *
+ * Each event is a fixed-width record. Vehicles add them to a ring
+ * buffer allocated up front, with one atomic operation and no locks,
+ * and a flusher thread writes the ring out to a file as it fills. If
+ * the flusher falls a whole ring behind, vehicles yield until it
+ * catches up (counted as stalls), so no event is ever lost. There is
+ * one event log at a time.
+ *
+ * Events (el_code), each for vehicle er_vehicle at er_intersection:
+ *    EV_ARRIVE - joined lane er_lane meaning to turn er_turn.
+ *    EV_ENTER  - drove onto segment er_seg, the first of its route.
+ *    EV_MOVE   - moved on to segment er_seg, step er_step of its
+ *                route, leaving the one before.
+ *    EV_LEAVE  - left the intersection from segment er_seg.
+ * Times are microseconds; from timestamp_us() for threads and tasks,
+ * virtual for the simulation.
+ *
+ * The file is big-endian: a 32-byte header, then 16-byte records.
+ *
+ *    header: "SLEV", version (1), record length (16), record count,
+ *            lanes per intersection, intersections, stalls, 0
+ *    record: time (u_int32_t), vehicle (u_int32_t), intersection
+ *            (u_int16_t), then a byte each: code, segment, type,
+ *            lane, turn, step.
+ *
+ * The record count is filled in when the log is stopped; 0 means the
+ * run didn't finish, and the records go to the end of the file.
+ * evlogtool.c is a host program that reads the file back.
+ *
+ * Operations:
+ *    evlog_start - start logging to a new file at PATH, through a
+ *                  ring of at least NRECORDS records, for NINTERSECTIONS
+ *                  intersections of NWAYS lanes. Returns 0 or an error
+ *                  code.
+ *    evlog_add   - log event ER, if a log is running. Not from an
+ *                  interrupt handler: it may yield.
+ *    evlog_stop  - write out what is left and close the file. Nobody
+ *                  may still be adding events. Returns 0 or the first
+ *                  write error, and the numbers of records and stalls.
+ */
+
+#define EV_ARRIVE 1
+#define EV_ENTER  2
+#define EV_MOVE   3
+#define EV_LEAVE  4
+
+#define EV_NOSEG  0xff
+
+#define EVLOG_MAGIC   0x534c4556	/* "SLEV" */
+#define EVLOG_VERSION 1
+#define EVLOG_HDRLEN  32
+#define EVLOG_RECLEN  16
+#define EVLOG_RECORDS 4096		/* default ring size */
+
+struct evrec {
+	u_int32_t er_time;
+	u_int32_t er_vehicle;
+	u_int16_t er_intersection;
+	u_int8_t er_code;
+	u_int8_t er_seg;
+	u_int8_t er_type;
+	u_int8_t er_lane;
+	u_int8_t er_turn;
+	u_int8_t er_step;
+};
+
+int evlog_start(const char *path, int nrecords, int nways,
+		int nintersections);
+void evlog_add(const struct evrec *er);
+int evlog_stop(u_int32_t *records, u_int32_t *stalls);
+
+#endif /* _EVLOG_H_ */
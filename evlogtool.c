@@ -0,0 +1,381 @@
+/*
+ * evlogtool: read back a stoplight event log (see evlog.h).
+ *
+ * This is a host program, not part of the kernel:
+ *
+ *      cc -o evlogtool evlogtool.c
+ *      evlogtool [-v VEHICLE] [-g COLUMNS] FILE
+ *
+ * It prints a summary of the run, latency statistics by vehicle type,
+ * and a graph of how busy each segment was over time, COLUMNS wide
+ * (default 64; 0 for none). With -v it also prints the timeline of
+ * vehicle VEHICLE, in microseconds from the first event.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "evlog.h"
+
+struct event {
+	struct evrec ev_rec;
+	u_int32_t ev_order;	/* position in the file */
+};
+
+/* Per vehicle, while replaying. */
+struct vehicle {
+	u_int32_t vh_arrive;	/* arrived at its current intersection */
+	int vh_seg;		/* segment it is on, or -1 */
+	u_int32_t vh_since;	/* ... since when */
+};
+
+struct samples {
+	u_int32_t *sa_values;
+	size_t sa_count;
+	size_t sa_size;
+};
+
+static const char *codename[] = { "?", "arrive", "enter", "move", "leave" };
+static const char *typename[] = { "Car", "Truck" };
+static const char *turnname[] = { "Right", "Left", "Straight", "Around" };
+
+static
+u_int32_t
+get32(const unsigned char *p)
+{
+	return ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) |
+		((u_int32_t)p[2] << 8) | p[3];
+}
+
+static
+void
+evrec_decode(struct evrec *er, const unsigned char *p)
+{
+	er->er_time = get32(p);
+	er->er_vehicle = get32(p + 4);
+	er->er_intersection = (p[8] << 8) | p[9];
+	er->er_code = p[10];
+	er->er_seg = p[11];
+	er->er_type = p[12];
+	er->er_lane = p[13];
+	er->er_turn = p[14];
+	er->er_step = p[15];
+}
+
+/* Events in time order; those at the same time in the order logged. */
+static
+int
+event_compare(const void *a, const void *b)
+{
+	const struct event *x = a, *y = b;
+
+	if (x->ev_rec.er_time != y->ev_rec.er_time) {
+		return x->ev_rec.er_time < y->ev_rec.er_time ? -1 : 1;
+	}
+	return x->ev_order < y->ev_order ? -1 : x->ev_order > y->ev_order;
+}
+
+static
+int
+u32_compare(const void *a, const void *b)
+{
+	u_int32_t x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static
+void *
+xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL) {
+		fprintf(stderr, "evlogtool: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static
+void
+samples_add(struct samples *sa, u_int32_t value)
+{
+	if (sa->sa_count == sa->sa_size) {
+		sa->sa_size = sa->sa_size ? 2 * sa->sa_size : 1024;
+		sa->sa_values = xrealloc(sa->sa_values,
+					 sa->sa_size * sizeof(u_int32_t));
+	}
+	sa->sa_values[sa->sa_count++] = value;
+}
+
+static
+void
+samples_print(const char *name, struct samples *sa)
+{
+	u_int32_t *v = sa->sa_values;
+	size_t n = sa->sa_count;
+	unsigned long long sum = 0;
+	size_t i;
+
+	if (n == 0) {
+		printf("%-18s n=0\n", name);
+		return;
+	}
+	qsort(v, n, sizeof(u_int32_t), u32_compare);
+	for (i = 0; i < n; i++) {
+		sum += v[i];
+	}
+	printf("%-18s n=%zu mean %llu p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+	       name, n, sum / n, v[n / 2], v[n * 90 / 100], v[n * 99 / 100],
+	       v[n * 999 / 1000], v[n - 1]);
+}
+
+/* "AB", "BC", ...: segment SEG of an intersection of NWAYS lanes. */
+static
+const char *
+segname(int seg, int nways)
+{
+	static char name[3];
+
+	if (seg < 0 || seg >= nways) {
+		return "--";
+	}
+	name[0] = 'A' + seg;
+	name[1] = 'A' + (seg + 1) % nways;
+	name[2] = 0;
+	return name;
+}
+
+static
+void
+print_event(const struct evrec *er, u_int32_t t0, int nways)
+{
+	printf("%10u  %-6s %-5s at %u ", er->er_time - t0,
+	       er->er_code <= EV_LEAVE ? codename[er->er_code] : "?",
+	       er->er_type ? typename[1] : typename[0], er->er_intersection);
+	if (er->er_code == EV_ARRIVE) {
+		printf("lane %c, turning %s\n", 'A' + er->er_lane,
+		       er->er_turn < 4 ? turnname[er->er_turn] : "?");
+	}
+	else {
+		printf("segment %s (step %u)\n", segname(er->er_seg, nways),
+		       er->er_step);
+	}
+}
+
+/*
+ * Add the time from START to END that a segment was occupied to its
+ * row of BUSY, NCOLS buckets of WIDTH microseconds from T0.
+ */
+static
+void
+occupy(double *busy, int ncols, u_int32_t t0, double width,
+       u_int32_t start, u_int32_t end)
+{
+	double s = start - t0, e = end - t0, lo, hi;
+	int c;
+
+	for (c = (int)(s / width); c < ncols && c * width < e; c++) {
+		lo = (c * width > s) ? c * width : s;
+		hi = ((c + 1) * width < e) ? (c + 1) * width : e;
+		if (hi > lo) {
+			busy[c] += hi - lo;
+		}
+	}
+}
+
+static
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: evlogtool [-v VEHICLE] [-g COLUMNS] FILE\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char hdr[EVLOG_HDRLEN], buf[EVLOG_RECLEN];
+	struct event *events = NULL;
+	struct vehicle *vehicles;
+	struct samples wait[2], transit[2];
+	double *busy, width;
+	size_t nevents = 0, size = 0, i;
+	u_int32_t count, nways, nints, stalls, nveh = 0, t0, t1, total;
+	unsigned long ncodes[EV_LEAVE + 1];
+	long watch = -1;
+	int ncols = 64, c, seg, s;
+	const char *path = NULL;
+	FILE *f;
+
+	for (c = 1; c < argc; c++) {
+		if (strcmp(argv[c], "-v") == 0 && c + 1 < argc) {
+			watch = atol(argv[++c]);
+		}
+		else if (strcmp(argv[c], "-g") == 0 && c + 1 < argc) {
+			ncols = atoi(argv[++c]);
+			if (ncols < 0) {
+				usage();
+			}
+		}
+		else if (argv[c][0] != '-' && path == NULL) {
+			path = argv[c];
+		}
+		else {
+			usage();
+		}
+	}
+	if (path == NULL) {
+		usage();
+	}
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "evlogtool: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (fread(hdr, EVLOG_HDRLEN, 1, f) != 1 ||
+	    get32(hdr) != EVLOG_MAGIC || get32(hdr + 4) != EVLOG_VERSION ||
+	    get32(hdr + 8) != EVLOG_RECLEN) {
+		fprintf(stderr, "evlogtool: %s: not an event log\n", path);
+		return 1;
+	}
+	count = get32(hdr + 12);
+	nways = get32(hdr + 16);
+	nints = get32(hdr + 20);
+	stalls = get32(hdr + 24);
+	if (nways == 0 || nways > 26 || nints == 0) {
+		fprintf(stderr, "evlogtool: %s: bad header\n", path);
+		return 1;
+	}
+
+	while ((count == 0 || nevents < count) &&
+	       fread(buf, EVLOG_RECLEN, 1, f) == 1) {
+		if (nevents == size) {
+			size = size ? 2 * size : 65536;
+			events = xrealloc(events, size * sizeof(struct event));
+		}
+		evrec_decode(&events[nevents].ev_rec, buf);
+		events[nevents].ev_order = nevents;
+		if (events[nevents].ev_rec.er_vehicle >= nveh) {
+			nveh = events[nevents].ev_rec.er_vehicle + 1;
+		}
+		nevents++;
+	}
+	fclose(f);
+	if (count != 0 && nevents < count) {
+		fprintf(stderr, "evlogtool: %s: %zu of %u records\n", path,
+			nevents, count);
+	}
+	if (nevents == 0) {
+		printf("No events.\n");
+		return 0;
+	}
+
+	/* Shards and threads log out of order; put it back in order. */
+	qsort(events, nevents, sizeof(struct event), event_compare);
+	t0 = events[0].ev_rec.er_time;
+	t1 = events[nevents - 1].ev_rec.er_time;
+
+	vehicles = xrealloc(NULL, nveh * sizeof(struct vehicle));
+	for (i = 0; i < nveh; i++) {
+		vehicles[i].vh_arrive = 0;
+		vehicles[i].vh_seg = -1;
+		vehicles[i].vh_since = 0;
+	}
+	busy = xrealloc(NULL, (nints * nways * (ncols ? ncols : 1)) *
+			sizeof(double));
+	memset(busy, 0, (nints * nways * (ncols ? ncols : 1)) * sizeof(double));
+	width = (t1 > t0 && ncols > 0) ? (double)(t1 - t0) / ncols : 1;
+	memset(wait, 0, sizeof(wait));
+	memset(transit, 0, sizeof(transit));
+	memset(ncodes, 0, sizeof(ncodes));
+
+	if (watch >= 0) {
+		printf("Vehicle %ld:\n", watch);
+	}
+	for (i = 0; i < nevents; i++) {
+		const struct evrec *er = &events[i].ev_rec;
+		struct vehicle *vh = &vehicles[er->er_vehicle];
+		int type = er->er_type ? 1 : 0;
+		int row = er->er_intersection % nints * nways;
+
+		if (er->er_code <= EV_LEAVE) {
+			ncodes[er->er_code]++;
+		}
+		if ((long)er->er_vehicle == watch) {
+			print_event(er, t0, nways);
+		}
+
+		/* Off the segment it was on. */
+		if ((er->er_code == EV_MOVE || er->er_code == EV_LEAVE) &&
+		    vh->vh_seg >= 0 && ncols > 0) {
+			occupy(&busy[(row + vh->vh_seg) * ncols], ncols, t0,
+			       width, vh->vh_since, er->er_time);
+		}
+
+		switch (er->er_code) {
+		    case EV_ARRIVE:
+			vh->vh_arrive = er->er_time;
+			vh->vh_seg = -1;
+			break;
+		    case EV_ENTER:
+			samples_add(&wait[type], er->er_time - vh->vh_arrive);
+			/* FALLTHROUGH */
+		    case EV_MOVE:
+			vh->vh_seg = (er->er_seg < nways) ? er->er_seg : -1;
+			vh->vh_since = er->er_time;
+			break;
+		    case EV_LEAVE:
+			samples_add(&transit[type], er->er_time - vh->vh_arrive);
+			vh->vh_seg = -1;
+			break;
+		}
+	}
+
+	printf("%zu events from %u vehicles over %u us: %lu arrivals, "
+	       "%lu entries, %lu moves, %lu exits\n", nevents, nveh, t1 - t0,
+	       ncodes[EV_ARRIVE], ncodes[EV_ENTER], ncodes[EV_MOVE],
+	       ncodes[EV_LEAVE]);
+	printf("%u intersections of %u lanes; the log stalled %u times\n",
+	       nints, nways, stalls);
+
+	printf("\nLatency (us):\n");
+	samples_print("Car wait:", &wait[0]);
+	samples_print("Truck wait:", &wait[1]);
+	samples_print("Car transit:", &transit[0]);
+	samples_print("Truck transit:", &transit[1]);
+
+	if (ncols > 0) {
+		printf("\nSegment occupancy, %.0f us a column "
+		       "(' ' idle, '.' <25%%, ':' <50%%, '+' <75%%, '#' busier):\n",
+		       width);
+		for (c = 0; c < (int)nints; c++) {
+			for (seg = 0; seg < (int)nways; seg++) {
+				double *row = &busy[(c * nways + seg) * ncols];
+				double sum = 0, frac;
+
+				printf("%4d %s |", c, segname(seg, nways));
+				for (s = 0; s < ncols; s++) {
+					frac = row[s] / width;
+					sum += row[s];
+					putchar(frac <= 0 ? ' ' : frac < 0.25 ? '.' :
+						frac < 0.5 ? ':' : frac < 0.75 ? '+' : '#');
+				}
+				total = (t1 > t0) ? (u_int32_t)(100 * sum / (t1 - t0)) : 0;
+				printf("| %3u%%\n", total);
+			}
+		}
+	}
+
+	free(busy);
+	free(vehicles);
+	free(events);
+	for (c = 0; c < 2; c++) {
+		free(wait[c].sa_values);
+		free(transit[c].sa_values);
+	}
+	return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Latency histograms.
+ * See histogram.h for the specification.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <histogram.h>
+
+/*
+ * Bucket for VALUE. Values below HIST_SUB map to themselves. Above
+ * that, SHIFT is chosen so that VALUE >> SHIFT lands in
+ * [HIST_SUB, 2*HIST_SUB), and the bucket is that, offset by one block
+ * of HIST_SUB per shift.
+ */
+static
+unsigned
+histogram_bucket(u_int32_t value)
+{
+	unsigned shift = 0;
+
+	if (value < HIST_SUB) {
+		return value;
+	}
+	while ((value >> shift) >= 2 * HIST_SUB) {
+		shift++;
+	}
+	return (shift + 1) * HIST_SUB + (value >> shift) - HIST_SUB;
+}
+
+/*
+ * Largest value that falls in bucket B.
+ */
+static
+u_int32_t
+histogram_bucketmax(unsigned b)
+{
+	unsigned shift;
+
+	if (b < HIST_SUB) {
+		return b;
+	}
+	shift = b / HIST_SUB - 1;
+	return ((u_int32_t)(HIST_SUB + b % HIST_SUB) << shift) +
+		(((u_int32_t)1 << shift) - 1);
+}
+
+void
+histogram_init(struct histogram *h)
+{
+	assert(h != NULL);
+	bzero(h, sizeof(*h));
+}
+
+void
+histogram_add(struct histogram *h, u_int32_t value)
+{
+	h->h_buckets[histogram_bucket(value)]++;
+	h->h_count++;
+	if (value > h->h_max) {
+		h->h_max = value;
+	}
+}
+
+void
+histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+	unsigned b;
+
+	for (b = 0; b < HIST_NBUCKETS; b++) {
+		dst->h_buckets[b] += src->h_buckets[b];
+	}
+	dst->h_count += src->h_count;
+	if (src->h_max > dst->h_max) {
+		dst->h_max = src->h_max;
+	}
+}
+
+u_int32_t
+histogram_permille(const struct histogram *h, unsigned permille)
+{
+	u_int32_t rank, seen, v;
+	unsigned b;
+
+	assert(permille <= 1000);
+
+	if (h->h_count == 0) {
+		return 0;
+	}
+
+	/*
+	 * The ceil(count * permille / 1000)'th smallest value, done in
+	 * two steps so that count * permille can't overflow.
+	 */
+	rank = h->h_count / 1000 * permille +
+		(h->h_count % 1000 * permille + 999) / 1000;
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	seen = 0;
+	for (b = 0; b < HIST_NBUCKETS; b++) {
+		seen += h->h_buckets[b];
+		if (seen >= rank) {
+			v = histogram_bucketmax(b);
+			return v < h->h_max ? v : h->h_max;
+		}
+	}
+	return h->h_max;
+}
+
+void
+histogram_print(const struct histogram *h, const char *label)
+{
+	kprintf("%s: n=%u p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+		label, h->h_count,
+		histogram_permille(h, 500), histogram_permille(h, 900),
+		histogram_permille(h, 990), histogram_permille(h, 999),
+		h->h_max);
+}
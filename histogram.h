@@ -0,0 +1,48 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+/*
+ * Latency histogram.
+ *
+ * Fixed memory, log-linear buckets in the style of HdrHistogram:
+ * values below HIST_SUB each get their own bucket, and every power of
+ * two above that is split into HIST_SUB equal buckets. Any 32-bit
+ * value can be recorded and quantiles come out within 1/HIST_SUB
+ * (about 6%) of the true value. The exact maximum is kept as well.
+ *
+ * Values are whatever the caller measures in; the kernel uses
+ * microseconds from timestamp_us.
+ *
+ * A histogram does no locking of its own. Each one should either be
+ * updated by a single thread or protected by something the updaters
+ * already hold; per-thread or per-object histograms can then be
+ * combined with histogram_merge for reporting.
+ *
+ * Operations:
+ *    histogram_init     - empty the histogram.
+ *    histogram_add      - record one VALUE.
+ *    histogram_merge    - add everything recorded in SRC to DST.
+ *    histogram_permille - the value below which PERMILLE thousandths
+ *                         of the recorded values fall (500 is the
+ *                         median, 999 is p99.9). 0 if empty.
+ *    histogram_print    - print the count, p50, p90, p99, p99.9 and
+ *                         max on one line, after LABEL.
+ */
+
+#define HIST_SUBBITS	4
+#define HIST_SUB	(1 << HIST_SUBBITS)
+#define HIST_NBUCKETS	((32 - HIST_SUBBITS + 1) * HIST_SUB)
+
+struct histogram {
+	u_int32_t h_count;
+	u_int32_t h_max;
+	u_int32_t h_buckets[HIST_NBUCKETS];
+};
+
+void histogram_init(struct histogram *h);
+void histogram_add(struct histogram *h, u_int32_t value);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+u_int32_t histogram_permille(const struct histogram *h, unsigned permille);
+void histogram_print(const struct histogram *h, const char *label);
+
+#endif /* _HISTOGRAM_H_ */
@@ -0,0 +1,124 @@
+/*
+ * Binary min-heap of timed events.
+ * See minheap.h for the specification.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <minheap.h>
+
+/* Nonzero if A must come out before B. */
+static
+int
+heapnode_before(const struct heapnode *a, const struct heapnode *b)
+{
+	if (a->hn_key != b->hn_key) {
+		return a->hn_key < b->hn_key;
+	}
+	/* Differences, so that the push counter may wrap. */
+	return (int)(a->hn_seq - b->hn_seq) < 0;
+}
+
+int
+minheap_init(struct minheap *h, int size)
+{
+	assert(h != NULL);
+	assert(size > 0);
+
+	h->mh_nodes = kmalloc(size * sizeof(struct heapnode *));
+	if (h->mh_nodes == NULL) {
+		return ENOMEM;
+	}
+	h->mh_count = 0;
+	h->mh_size = size;
+	h->mh_seq = 0;
+	return 0;
+}
+
+void
+minheap_cleanup(struct minheap *h)
+{
+	assert(h->mh_count == 0);
+
+	kfree(h->mh_nodes);
+	h->mh_nodes = NULL;
+	h->mh_size = 0;
+}
+
+void
+minheap_push(struct minheap *h, struct heapnode *n, u_int32_t key)
+{
+	minheap_push_ordered(h, n, key, h->mh_seq++);
+}
+
+void
+minheap_push_ordered(struct minheap *h, struct heapnode *n,
+		     u_int32_t key, u_int32_t tie)
+{
+	struct heapnode **nodes = h->mh_nodes;
+	int i, parent;
+
+	assert(h->mh_count < h->mh_size);
+
+	n->hn_key = key;
+	n->hn_seq = tie;
+
+	/* Sift up from the new last slot. */
+	i = h->mh_count++;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!heapnode_before(n, nodes[parent])) {
+			break;
+		}
+		nodes[i] = nodes[parent];
+		i = parent;
+	}
+	nodes[i] = n;
+}
+
+struct heapnode *
+minheap_pop(struct minheap *h)
+{
+	struct heapnode **nodes = h->mh_nodes;
+	struct heapnode *top, *last;
+	int i, child;
+
+	if (h->mh_count == 0) {
+		return NULL;
+	}
+	top = nodes[0];
+	last = nodes[--h->mh_count];
+
+	/* Sift the old last node down from the root. */
+	i = 0;
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= h->mh_count) {
+			break;
+		}
+		if (child + 1 < h->mh_count &&
+		    heapnode_before(nodes[child + 1], nodes[child])) {
+			child++;
+		}
+		if (!heapnode_before(nodes[child], last)) {
+			break;
+		}
+		nodes[i] = nodes[child];
+		i = child;
+	}
+	nodes[i] = last;
+	return top;
+}
+
+struct heapnode *
+minheap_peek(struct minheap *h)
+{
+	return h->mh_count > 0 ? h->mh_nodes[0] : NULL;
+}
+
+int
+minheap_count(struct minheap *h)
+{
+	return h->mh_count;
+}
@@ -0,0 +1,56 @@
+#ifndef _MINHEAP_H_
+#define _MINHEAP_H_
+
+/*
+ * Binary min-heap of timed events, for discrete-event simulation.
+ *
+ * The heap is intrusive: embed a struct heapnode in whatever is being
+ * scheduled and get back to the enclosing structure from the node pop
+ * returns (put the node first and cast, as with struct mpscnode).
+ * Nodes come out in order of their keys, and nodes with equal keys in
+ * the order they were pushed, so a simulation driven from the heap is
+ * deterministic.
+ *
+ * The array of node pointers is allocated once, by minheap_init, with
+ * room for SIZE nodes; pushing and popping never allocate. The heap
+ * does no locking.
+ *
+ * Operations:
+ *    minheap_init    - set up an empty heap with room for SIZE nodes.
+ *                      Returns 0 or ENOMEM.
+ *    minheap_cleanup - free the heap's array. It must be empty.
+ *    minheap_push    - schedule node N at KEY. The heap must not be
+ *                      full.
+ *    minheap_push_ordered - like minheap_push, but nodes with equal
+ *                      keys come out in order of TIE, which the caller
+ *                      picks, instead of push order. Use one or the
+ *                      other for a given heap, not both.
+ *    minheap_pop     - take the node with the smallest key, or NULL
+ *                      if the heap is empty.
+ *    minheap_peek    - the node minheap_pop would return, left in
+ *                      place.
+ *    minheap_count   - how many nodes are in the heap.
+ */
+
+struct heapnode {
+	u_int32_t hn_key;
+	u_int32_t hn_seq;	/* push order (or caller's), to break ties */
+};
+
+struct minheap {
+	struct heapnode **mh_nodes;
+	int mh_count;
+	int mh_size;
+	u_int32_t mh_seq;
+};
+
+int minheap_init(struct minheap *h, int size);
+void minheap_cleanup(struct minheap *h);
+void minheap_push(struct minheap *h, struct heapnode *n, u_int32_t key);
+void minheap_push_ordered(struct minheap *h, struct heapnode *n,
+			  u_int32_t key, u_int32_t tie);
+struct heapnode *minheap_pop(struct minheap *h);
+struct heapnode *minheap_peek(struct minheap *h);
+int minheap_count(struct minheap *h);
+
+#endif /* _MINHEAP_H_ */
@@ -0,0 +1,85 @@
+/*
+ * Lock-free multi-producer, single-consumer queue.
+ * See mpscq.h for the specification.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <atomic.h>
+#include <mpscq.h>
+
+void
+mpscq_init(struct mpscq *q)
+{
+	assert(q != NULL);
+
+	q->mq_stub.mn_next = NULL;
+	q->mq_head = &q->mq_stub;
+	q->mq_tail = &q->mq_stub;
+}
+
+void
+mpscq_push(struct mpscq *q, struct mpscnode *n)
+{
+	struct mpscnode *prev;
+
+	n->mn_next = NULL;
+	prev = atomic_swapptr((void *volatile *)&q->mq_head, n);
+
+	/*
+	 * Between the swap and this store the queue is briefly cut in
+	 * two: the consumer can't see past PREV until we link it.
+	 */
+	prev->mn_next = n;
+}
+
+struct mpscnode *
+mpscq_pop(struct mpscq *q)
+{
+	struct mpscnode *tail = q->mq_tail;
+	struct mpscnode *next = tail->mn_next;
+
+	/* Step over the stub if it's at the front. */
+	if (tail == &q->mq_stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		q->mq_tail = next;
+		tail = next;
+		next = next->mn_next;
+	}
+
+	if (next != NULL) {
+		q->mq_tail = next;
+		return tail;
+	}
+
+	/*
+	 * TAIL looks like the last node. If it isn't the newest, a push
+	 * is still linking itself in behind it; come back later.
+	 */
+	if (tail != q->mq_head) {
+		return NULL;
+	}
+
+	/*
+	 * TAIL is the only node. We can't hand it out while it might be
+	 * the node the next producer links to, so put the stub back
+	 * behind it first.
+	 */
+	mpscq_push(q, &q->mq_stub);
+	next = tail->mn_next;
+	if (next != NULL) {
+		q->mq_tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+int
+mpscq_isempty(struct mpscq *q)
+{
+	struct mpscnode *tail = q->mq_tail;
+
+	return (tail == &q->mq_stub && tail->mn_next == NULL);
+}
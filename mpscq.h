@@ -0,0 +1,50 @@
+#ifndef _MPSCQ_H_
+#define _MPSCQ_H_
+
+/*
+ * Lock-free multi-producer, single-consumer FIFO.
+ *
+ * Any number of threads (or interrupt handlers) may push at once;
+ * only one thread at a time may pop. Pushing is one atomic swap and
+ * one store, with no locks (and, where the cpu has a native swap, no
+ * change of interrupt level; see atomic.h), so it is cheap enough to
+ * use from code whose contention is being measured.
+ *
+ * The queue is intrusive: embed a struct mpscnode in whatever is being
+ * queued and get back to the enclosing structure from the node pop
+ * returns (put the node first and cast, as with struct task). Nothing
+ * is allocated and nothing is freed; a popped node belongs to the
+ * consumer again.
+ *
+ * Operations:
+ *    mpscq_init    - set up an empty queue.
+ *    mpscq_push    - add a node at the back. Safe from any context.
+ *    mpscq_pop     - take the node at the front, or NULL. Consumer
+ *                    only. May return NULL while a push is halfway
+ *                    done even though the queue is not empty; the
+ *                    node appears as soon as that push finishes.
+ *    mpscq_isempty - nonzero if there is nothing to pop. Consumer
+ *                    only; the same caveat applies.
+ *
+ * This is Vyukov's queue: producers swap themselves in as the newest
+ * node and then link the previous newest to themselves, while the
+ * consumer walks from the oldest node, using a stub node so the list
+ * is never empty.
+ */
+
+struct mpscnode {
+	struct mpscnode *volatile mn_next;
+};
+
+struct mpscq {
+	struct mpscnode *volatile mq_head;	/* newest; producers */
+	struct mpscnode *mq_tail;		/* oldest; consumer */
+	struct mpscnode mq_stub;
+};
+
+void mpscq_init(struct mpscq *q);
+void mpscq_push(struct mpscq *q, struct mpscnode *n);
+struct mpscnode *mpscq_pop(struct mpscq *q);
+int mpscq_isempty(struct mpscq *q);
+
+#endif /* _MPSCQ_H_ */
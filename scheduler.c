@@ -0,0 +1,273 @@
+/*
+ * Scheduler.
+ *
+ * The default scheduler is very simple, just round-robin. Each CPU
+ * has its own run queue, so CPUs don't contend with each other on
+ * every context switch; a CPU whose queue runs dry steals from the
+ * fullest other queue before it goes idle. The queues are intrusive
+ * lists threaded through struct thread, so enqueue and dequeue are
+ * O(1) and never allocate.
+ *
+ * A thread goes back on the queue of the CPU named by its t_cpu hint:
+ * the CPU it last ran on, or for a thread being woken up, the CPU
+ * that woke it (see thread_wakeup).
+ *
+ * Each queue is really one list per scheduling class (TPRI_*). A
+ * low-priority thread runs when no normal one is ready, and otherwise
+ * once every LOWPRI_EVERY picks, so a CPU that is never idle still
+ * gets its background work done.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <scheduler.h>
+#include <thread.h>
+#include <threadlist.h>
+#include <spinlock.h>
+#include <cacheline.h>
+#include <machine/spl.h>
+
+/*
+ *  Scheduler data
+ */
+
+// One CPU's queue of runnable threads, a list per TPRI_* class.
+// Padded so that CPUs working their own queues don't share cache lines.
+struct runqueue {
+	struct spinlock rq_lock;
+	struct threadlist rq_threads[NTPRIS];
+	unsigned rq_picks;	// picks since the last low-priority one
+} CACHELINE_ALIGNED;
+
+static struct runqueue runqueues[NCPUS];
+
+#define LOWPRI_EVERY 16
+
+/*
+ * Setup function
+ */
+void
+scheduler_bootstrap(void)
+{
+	int i, pri;
+
+	for (i=0; i<NCPUS; i++) {
+		spinlock_init(&runqueues[i].rq_lock);
+		for (pri=0; pri<NTPRIS; pri++) {
+			threadlist_init(&runqueues[i].rq_threads[pri]);
+		}
+		runqueues[i].rq_picks = 0;
+	}
+}
+
+/*
+ * This is called during panic shutdown to dispose of threads other
+ * than the one invoking panic. We drop them on the floor instead of
+ * cleaning them up properly; since we're about to go down it doesn't
+ * really matter, and freeing everything might cause further panics.
+ */
+void
+scheduler_killall(void)
+{
+	struct thread *t;
+	int i, pri;
+
+	assert(curspl>0);
+	for (i=0; i<NCPUS; i++) {
+		for (pri=0; pri<NTPRIS; pri++) {
+			while ((t = threadlist_remhead(
+					&runqueues[i].rq_threads[pri])) != NULL) {
+				kprintf("scheduler: Dropping thread %s.\n",
+					t->t_name);
+			}
+		}
+	}
+}
+
+/*
+ * Cleanup function.
+ *
+ * The list objects to being cleaned up if it's got stuff in it.
+ * Use scheduler_killall to make sure this is the case. During
+ * ordinary shutdown, normally it should be.
+ */
+void
+scheduler_shutdown(void)
+{
+	int i, pri;
+
+	scheduler_killall();
+
+	assert(curspl>0);
+	for (i=0; i<NCPUS; i++) {
+		for (pri=0; pri<NTPRIS; pri++) {
+			threadlist_cleanup(&runqueues[i].rq_threads[pri]);
+		}
+	}
+}
+
+/*
+ * Take the next thread from CPU's run queue, or NULL: the front normal
+ * thread, unless it's the low-priority queue's turn or nothing normal
+ * is ready.
+ */
+static
+struct thread *
+runqueue_take(int cpu)
+{
+	struct runqueue *rq = &runqueues[cpu];
+	struct thread *t = NULL;
+
+	spinlock_acquire(&rq->rq_lock);
+	if (rq->rq_picks >= LOWPRI_EVERY) {
+		t = threadlist_remhead(&rq->rq_threads[TPRI_LOW]);
+	}
+	if (t == NULL) {
+		t = threadlist_remhead(&rq->rq_threads[TPRI_NORMAL]);
+	}
+	if (t == NULL) {
+		t = threadlist_remhead(&rq->rq_threads[TPRI_LOW]);
+	}
+	if (t != NULL && t->t_priority == TPRI_LOW) {
+		rq->rq_picks = 0;
+	}
+	else {
+		rq->rq_picks++;
+	}
+	spinlock_release(&rq->rq_lock);
+	return t;
+}
+
+/*
+ * Number of threads on run queue RQ. Read unlocked, so only a guess.
+ */
+static
+unsigned
+runqueue_length(struct runqueue *rq)
+{
+	return rq->rq_threads[TPRI_NORMAL].tl_count +
+		rq->rq_threads[TPRI_LOW].tl_count;
+}
+
+/*
+ * Steal a thread for CPU ME from the longest other run queue. Takes
+ * from the back, where the threads least likely to still have warm
+ * caches on their old CPU are. The lengths are read unlocked; a stale
+ * guess just means a failed or suboptimal steal.
+ */
+static
+struct thread *
+runqueue_steal(int me)
+{
+	struct runqueue *rq;
+	struct thread *t;
+	unsigned most = 0;
+	int i, victim = -1;
+
+	for (i=0; i<NCPUS; i++) {
+		if (i != me && runqueue_length(&runqueues[i]) > most) {
+			most = runqueue_length(&runqueues[i]);
+			victim = i;
+		}
+	}
+	if (victim < 0) {
+		return NULL;
+	}
+
+	rq = &runqueues[victim];
+	spinlock_acquire(&rq->rq_lock);
+	t = threadlist_remtail(&rq->rq_threads[TPRI_NORMAL]);
+	if (t == NULL) {
+		t = threadlist_remtail(&rq->rq_threads[TPRI_LOW]);
+	}
+	spinlock_release(&rq->rq_lock);
+	if (t != NULL) {
+		t->t_cpu = me;
+	}
+	return t;
+}
+
+/*
+ * Actual scheduler. Returns the next thread to run.  Calls cpu_idle()
+ * if there's nothing ready. (Note: cpu_idle must be called in a loop
+ * until something's ready - it doesn't know whether the things that
+ * wake it up are going to make a thread runnable or not.) 
+ */
+struct thread *
+scheduler(void)
+{
+	struct thread *t;
+	int me = curcpu_id();
+
+	// meant to be called with interrupts off
+	assert(curspl>0);
+
+	// You can actually uncomment this to see what the scheduler's
+	// doing - even this deep inside thread code, the console
+	// still works. However, the amount of text printed is
+	// prohibitive.
+	// 
+	//print_run_queue();
+
+	for (;;) {
+		t = runqueue_take(me);
+		if (t == NULL) {
+			t = runqueue_steal(me);
+		}
+		if (t != NULL) {
+			return t;
+		}
+		cpu_idle();
+	}
+}
+
+/* 
+ * Make a thread runnable.
+ * Add it to the end of the run queue of the CPU it prefers.
+ * This cannot fail; the return value is kept for callers that check.
+ */
+int
+make_runnable(struct thread *t)
+{
+	struct runqueue *rq;
+
+	// meant to be called with interrupts off
+	assert(curspl>0);
+	assert(t->t_cpu >= 0 && t->t_cpu < NCPUS);
+
+	assert(t->t_priority >= 0 && t->t_priority < NTPRIS);
+
+	rq = &runqueues[t->t_cpu];
+	spinlock_acquire(&rq->rq_lock);
+	threadlist_addtail(&rq->rq_threads[t->t_priority], t);
+	spinlock_release(&rq->rq_lock);
+	return 0;
+}
+
+/*
+ * Debugging function to dump the run queues.
+ */
+void
+print_run_queue(void)
+{
+	/* Turn interrupts off so the whole list prints atomically. */
+	int spl = splhigh();
+	struct threadlistnode *tln;
+	int i, pri, k;
+
+	for (i=0; i<NCPUS; i++) {
+		kprintf(" cpu%d:\n", i);
+		k = 0;
+		for (pri=0; pri<NTPRIS; pri++) {
+			THREADLIST_FORALL(tln, &runqueues[i].rq_threads[pri]) {
+				struct thread *t = tln->tln_self;
+				kprintf("  %2d: %s %p%s\n", k, t->t_name,
+					t->t_sleepaddr,
+					pri == TPRI_LOW ? " (low)" : "");
+				k++;
+			}
+		}
+	}
+	
+	splx(spl);
+}
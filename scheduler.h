@@ -0,0 +1,47 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+/*
+ * Scheduler-related function calls.
+ *
+ *     scheduler     - run the scheduler and choose the next thread to run.
+ *     make_runnable - add the specified thread to a run queue. If it's
+ *                     already on the run queue or sleeping, weird things
+ *                     may happen. Returns an error code.
+ *
+ *     print_run_queue - dump the run queues to the console for debugging.
+ *
+ *     scheduler_bootstrap - initialize scheduler data 
+ *                           (must happen early in boot)
+ *     scheduler_killall   - drop every runnable thread (panic only).
+ *     scheduler_shutdown  - clean up scheduler data
+ *
+ * Each CPU has its own run queue; an idle CPU steals from the others.
+ * make_runnable queues a thread on the CPU named by its t_cpu hint,
+ * behind the other threads of its t_priority class.
+ *
+ * The run queues link threads through their t_listnode, so
+ * make_runnable never allocates and there is nothing to preallocate
+ * in thread_fork.
+ */
+
+/*
+ * Processors. System/161 as OS/161 1.x drives it has exactly one, so
+ * curcpu_id() is always 0. The scheduler keeps a run queue per CPU
+ * regardless; a multiprocessor port changes these two definitions.
+ */
+#define NCPUS		1
+#define curcpu_id()	0
+
+struct thread;
+
+struct thread *scheduler(void);
+int make_runnable(struct thread *t);
+
+void print_run_queue(void);
+
+void scheduler_bootstrap(void);
+void scheduler_killall(void);
+void scheduler_shutdown(void);
+
+#endif /* _SCHEDULER_H_ */
@@ -0,0 +1,65 @@
+/*
+ * Sequence lock. See seqlock.h for the specification.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <thread.h>
+#include <machine/spl.h>
+#include <atomic.h>
+#include <seqlock.h>
+
+void
+seqlock_init(struct seqlock *sq)
+{
+	assert(sq != NULL);
+
+	sq->sq_writers = 0;
+	sq->sq_seq = 0;
+}
+
+void
+seqlock_write_begin(struct seqlock *sq)
+{
+	/* The atomics are full barriers: the count goes up first. */
+	atomic_fetch_add(&sq->sq_writers, 1);
+}
+
+void
+seqlock_write_end(struct seqlock *sq)
+{
+	/*
+	 * Bump the sequence before dropping out of sq_writers, so a
+	 * reader that sees no writers also sees that one finished.
+	 */
+	atomic_fetch_add(&sq->sq_seq, 1);
+	atomic_fetch_add(&sq->sq_writers, -1);
+}
+
+int
+seqlock_read_begin(struct seqlock *sq)
+{
+	int ticket;
+
+	assert(in_interrupt == 0);
+
+	for (;;) {
+		ticket = sq->sq_seq;
+		membar();
+		if (sq->sq_writers == 0) {
+			break;
+		}
+		/* Let the writer finish; on one CPU it can't while we spin. */
+		thread_yield();
+	}
+	membar();
+	return ticket;
+}
+
+int
+seqlock_read_retry(struct seqlock *sq, int ticket)
+{
+	/* Our reads must be done before we look at the seqlock again. */
+	membar();
+	return sq->sq_writers != 0 || sq->sq_seq != ticket;
+}
@@ -0,0 +1,46 @@
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+/*
+ * Sequence lock, for taking consistent snapshots of state that many
+ * threads update and a monitor only reads.
+ *
+ * Writers bracket each update with seqlock_write_begin/end; readers
+ * copy what they want between seqlock_read_begin and
+ * seqlock_read_retry, and copy it again if retry says a write got in
+ * the way. Readers never write to the seqlock, so however often a
+ * monitor samples, the writers it is watching don't slow down.
+ *
+ * Unlike the usual seqlock, writers need not be serialized against
+ * each other: each must only make its own update safe on its own
+ * (atomic words, or state nobody else writes). sq_writers counts the
+ * writers inside a section and sq_seq counts finished sections, so a
+ * read is good if there was no writer when it started and no writer
+ * started or finished while it ran.
+ *
+ * Operations:
+ *    seqlock_init        - set up a seqlock.
+ *    seqlock_write_begin - start an update.
+ *    seqlock_write_end   - finish it.
+ *    seqlock_read_begin  - wait (yielding) until no update is in
+ *                          progress, and return a ticket.
+ *    seqlock_read_retry  - nonzero if what was read since
+ *                          seqlock_read_begin returned TICKET may be
+ *                          inconsistent and must be read again.
+ *
+ * Readers may not run in an interrupt handler, since they may yield.
+ * Writers may run anywhere.
+ */
+
+struct seqlock {
+	volatile int sq_writers;	/* writers inside a section */
+	volatile int sq_seq;		/* sections finished */
+};
+
+void seqlock_init(struct seqlock *sq);
+void seqlock_write_begin(struct seqlock *sq);
+void seqlock_write_end(struct seqlock *sq);
+int seqlock_read_begin(struct seqlock *sq);
+int seqlock_read_retry(struct seqlock *sq, int ticket);
+
+#endif /* _SEQLOCK_H_ */
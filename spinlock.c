@@ -0,0 +1,133 @@
+/*
+ * Spinlocks.
+ * See spinlock.h for specifications of the functions.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <machine/spl.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <curthread.h>
+
+void
+spinlock_init(struct spinlock *sl)
+{
+	assert(sl != NULL);
+
+	sl->sl_locked = 0;
+	sl->sl_spl = 0;
+	sl->sl_holder = NULL;
+}
+
+void
+spinlock_acquire(struct spinlock *sl)
+{
+	int spl;
+
+	assert(sl != NULL);
+
+	spl = splhigh();
+
+	/* Not recursive. (curthread is NULL inside the scheduler.) */
+	assert(curthread == NULL || sl->sl_holder != curthread);
+
+	while (!atomic_cas(&sl->sl_locked, 0, 1)) {
+		/* Spin on plain reads until it looks free. */
+		while (sl->sl_locked) {
+			;
+		}
+	}
+
+	sl->sl_spl = spl;
+	sl->sl_holder = curthread;
+}
+
+int
+spinlock_tryacquire(struct spinlock *sl)
+{
+	int spl;
+
+	assert(sl != NULL);
+
+	spl = splhigh();
+	if (!atomic_cas(&sl->sl_locked, 0, 1)) {
+		splx(spl);
+		return 0;
+	}
+
+	sl->sl_spl = spl;
+	sl->sl_holder = curthread;
+	return 1;
+}
+
+void
+spinlock_release(struct spinlock *sl)
+{
+	int spl;
+
+	assert(sl != NULL);
+	assert(sl->sl_locked);
+	assert(sl->sl_holder == curthread);
+
+	spl = sl->sl_spl;
+	sl->sl_holder = NULL;
+	membar();
+	sl->sl_locked = 0;
+	splx(spl);
+}
+
+int
+spinlock_do_i_hold(struct spinlock *sl)
+{
+	assert(sl != NULL);
+
+	return (sl->sl_locked && sl->sl_holder == curthread);
+}
+
+void
+spinlock_sleep(struct spinlock *sl, struct threadlist *wq)
+{
+	int spl;
+
+	assert(spinlock_do_i_hold(sl));
+
+	/*
+	 * The scheduler drops the lock word once we're on WQ, leaving
+	 * interrupts off; it's up to us to restore them afterwards.
+	 */
+	spl = sl->sl_spl;
+	thread_sleep_on(wq, sl);
+
+	spinlock_acquire(sl);
+	sl->sl_spl = spl;
+}
+
+int
+spinlock_sleep_timeout(struct spinlock *sl, struct threadlist *wq,
+		       u_int32_t deadline)
+{
+	int spl, timedout;
+
+	assert(spinlock_do_i_hold(sl));
+
+	spl = sl->sl_spl;
+	timedout = thread_sleep_on_timeout(wq, sl, deadline);
+
+	spinlock_acquire(sl);
+	sl->sl_spl = spl;
+	return timedout;
+}
+
+void
+spinlock_unlock(struct spinlock *sl)
+{
+	assert(sl != NULL);
+	assert(sl->sl_locked);
+	assert(curspl>0);
+
+	sl->sl_holder = NULL;
+	membar();
+	sl->sl_locked = 0;
+}
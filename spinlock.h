@@ -0,0 +1,58 @@
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+/*
+ * Spinlock.
+ *
+ * Protects short critical sections that must not sleep. Acquiring a
+ * spinlock turns interrupts off (so the holder can't be preempted by
+ * a thread that would then spin forever) and then takes the lock word
+ * with atomic_cas. Releasing restores the interrupt level that was in
+ * effect at acquire time.
+ *
+ * Operations:
+ *    spinlock_init       - initialize an unheld spinlock.
+ *    spinlock_acquire    - take the lock, spinning while someone else
+ *                          has it. Not recursive.
+ *    spinlock_tryacquire - take the lock if it is free right now.
+ *                          Returns 1 if we now hold it, 0 (without
+ *                          spinning) if not.
+ *    spinlock_release    - release the lock. Must be the holder.
+ *    spinlock_do_i_hold  - return nonzero if the current thread holds
+ *                          the lock.
+ *    spinlock_sleep      - go to sleep on wait queue WQ (as
+ *                          thread_sleep_on), dropping the spinlock
+ *                          once this thread is on WQ, and take it
+ *                          again on wakeup. Whoever wakes WQ while
+ *                          holding the spinlock therefore cannot miss
+ *                          us.
+ *    spinlock_sleep_timeout - as spinlock_sleep, but give up waiting
+ *                          at DEADLINE (see thread_sleep_on_timeout).
+ *                          Returns nonzero if it timed out.
+ *    spinlock_unlock     - release the lock word only, leaving
+ *                          interrupts off. For the scheduler, which
+ *                          drops a sleeper's spinlock on its behalf.
+ */
+
+struct thread;
+struct threadlist;
+
+struct spinlock {
+	volatile int sl_locked;
+	int sl_spl;			/* spl to restore on release */
+	struct thread *sl_holder;	/* for spinlock_do_i_hold */
+};
+
+#define SPINLOCK_INITIALIZER	{ 0, 0, NULL }
+
+void spinlock_init(struct spinlock *sl);
+void spinlock_acquire(struct spinlock *sl);
+int spinlock_tryacquire(struct spinlock *sl);
+void spinlock_release(struct spinlock *sl);
+int spinlock_do_i_hold(struct spinlock *sl);
+void spinlock_sleep(struct spinlock *sl, struct threadlist *wq);
+int spinlock_sleep_timeout(struct spinlock *sl, struct threadlist *wq,
+			   u_int32_t deadline);
+void spinlock_unlock(struct spinlock *sl);
+
+#endif /* _SPINLOCK_H_ */
@@ -14,33 +14,82 @@
 
 #include <types.h>
 #include <lib.h>
+#include <kern/errno.h>
 #include <test.h>
 #include <thread.h>
 #include <synch.h>
+#include <spinlock.h>
+#include <threadlist.h>
+#include <task.h>
+#include <cacheline.h>
+#include <counter.h>
+#include <mpscq.h>
+#include <timestamp.h>
+#include <histogram.h>
+#include <atomic.h>
+#include <seqlock.h>
+#include <minheap.h>
+#include <workload.h>
+#include <evlog.h>
 
 /*
  * Constants
  */
 
-//Number of vehicles created.
+//Number of vehicles created, by default, as threads.
 #define NVEHICLES 20
 
-//Creates an integer representation of each lane.
+//Most vehicle threads a run may ask for. Every thread takes a
+//process table slot, so stay well under TABLESIZE.
+#define MAXVEHICLETHREADS (TABLESIZE / 2)
+
+//Number of carrier threads running vehicle tasks.
+#define NCARRIERS 4
+
+//How long a vehicle waits on a segment before the watchdog complains.
+#define STALL_USECS 2000000
+
+//Rounds of trying for a route's segments before waiting for them in
+//order; see acquireSegments().
+#define SEGMENT_TRIES 3
+
+//Default for how long a truck waits for its lane's cars before it
+//goes first anyway; see lane_truck_wait().
+#define TRUCK_MAXWAIT 50000
+
+//Arrivals per second for "truckbench", unless "rate" says otherwise:
+//enough to keep a single intersection's lanes queued up.
+#define TRUCKBENCH_RATE 1200
+
+//Creates an integer representation of each lane. An intersection
+//has numWays lanes, lettered from A; the grid links through A, B and C.
 #define A 0
 #define B 1 
 #define C 2
+#define MAXWAYS 6
 
 //Declaring a turn direction with an integer.
 #define RIGHT 0
 #define LEFT 1
+#define STRAIGHT 2
+#define UTURN 3
+#define NUMTURNS 4
 
 // Direction string corresponding to index
-char stringDirection[2][6] = {"Right", "Left"};
+char stringDirection[NUMTURNS][9] = {"Right", "Left", "Straight", "Around"};
 
 // Lanes as strings corresponding to index
-char charLane[] = {'A', 'B', 'C'};
+char charLane[MAXWAYS] = {'A', 'B', 'C', 'D', 'E', 'F'};
+
+// Number of lanes (and segments) at each intersection; 3 is the classic.
+static int numWays = 3;
+
+// Whether vehicles may go all the way around and leave the way they came.
+static int uTurns = 0;
 
-#define NUMROUTES 3 //Number of Routes
+// Whether events go to the binary log (see evlog.h) instead of being
+// printed one line at a time.
+static int evlogOn = 0;
 
 //Integer representation of vehicle types.
 #define CAR 0
@@ -51,409 +100,2776 @@ char type[2][6] = {"Car", "Truck"};
 
 //Static Variables Declaration.
 
-// Locks used for program.
-static struct lock *AB;
-static struct lock *BC; 
-static struct lock *CA;
-// Locks for printing.
-static struct lock *printAB;
-static struct lock *printBC;
-static struct lock *printCA;
-// Locks for requirements of deadlocks from left turns
-static struct lock *left1;
-static struct lock *left2;
-
-char intersection[NUMROUTES][3] = {"AB", "BC", "CA"};
-
-// Counts to keep track of certain variables
-static int countVehicles; 
-static int countLeft;
-static int countRight;
-static int countLeft1;
-static int countLeft2;
-
-//Number of cars in a lane
-static int waitingCarsCountA = 0;
-static int waitingCarsCountB = 0;
-static int waitingCarsCountC = 0;
+// Segment names ("AB", "BC", ...), filled in by routes_init().
+char intersection[MAXWAYS][3];
 
-// Function Definitions
 /*
- * Prints the  initial vehicle information when it arrives at an intersection. 
+ * A road segment (AB, BC, ...) and its status word. Vehicles from two
+ * lanes fight over each segment, so every segment gets a cache line to
+ * itself instead of sharing one with the next segment's lock.
+ *
+ * sg_status says who is on the segment: SEG_OPEN, or SEG_CLOSED with
+ * the vehicle's number and SEG_TRUCK if it's a truck. Only the holder
+ * of sg_lock writes it, and does so before printing the move, so the
+ * printed Open/Closed status always agrees with it. Monitors read it
+ * without taking any lock.
  */
-static void printInfo(unsigned long vehicleDirection,
-			unsigned long vehicleNumber,
-			unsigned long vehicleType,
-			unsigned long direction){
-	//Calculates the final destination of the vehicle.
-	int destination;
+#define SEG_OPEN    0
+#define SEG_CLOSED  0x40000000
+#define SEG_TRUCK   0x20000000
+#define SEG_VEHICLE 0x0000ffff
 
-	if (direction == RIGHT){ //Turning Right
-		destination = (vehicleDirection + 1) % NUMROUTES;
-	} else { //Turning LEFT
-		destination = (vehicleDirection + 2) % NUMROUTES;
-	}
+struct segment {
+	struct lock sg_lock;
+	volatile int sg_status;
+	// How long vehicles waited for sg_lock; updated under sg_lock.
+	struct histogram sg_waithist;
+} CACHELINE_ALIGNED;
 
-	kprintf("%s %lu waiting at Route %c wants to turn %s to Route %c.\n",
-			type[vehicleType], vehicleNumber, charLane[vehicleDirection],
-			stringDirection[direction], charLane[destination]
-			);
-}
+/*
+ * Per-lane state. Only vehicles arriving on this lane write it, so
+ * padding it out to its own line keeps lane A's traffic from
+ * invalidating lane B's.
+ */
+struct lane {
+	int ln_waitingcars; // Number of cars waiting in the lane.
+	int ln_agedtrucks;  // Trucks going ahead of the cars (see lane_truck_wait()).
+	struct spinlock ln_spin;     // protects the counts and the queues
+	struct threadlist ln_trucks; // trucks asleep until the cars clear
+	struct threadlist ln_cars;   // cars asleep until aged trucks clear
+	struct semaphore *ln_room;   // laneCap units; NULL for no limit (see lane_room_take())
+} CACHELINE_ALIGNED;
 
 /*
- * Handles whether a truck should be yielded and manages counts of cars 
- * sleeping/waiting in lanes.
- */
-void handleVehicle(unsigned long vehicletype, unsigned long lane){
-  // Get the waitingCarCount for the specified lane.
-  int *waitingCarsCountLane;
-  switch(lane){
-    case A:
-      waitingCarsCountLane = &waitingCarsCountA;
-      break;
-    case B:
-      waitingCarsCountLane = &waitingCarsCountB;
-      break;
-    case C:
-      waitingCarsCountLane = &waitingCarsCountC;
-      break;
-  }
-  // If vehicle type is truck, yield to other car threads until cars have finished.
-  switch(vehicletype){
-    case TRUCK:
-      while(*waitingCarsCountLane > 0){
-        thread_yield();
-      }
-      break;
-     case CAR:
-      *waitingCarsCountLane += 1;
-  }
+ * One intersection. Everything a vehicle touches while crossing an
+ * intersection lives in here, so vehicles at different intersections
+ * of a grid never share locks or counters.
+ *
+ * Segments are indexed by the lane that enters them first: is_seg[A]
+ * is AB, is_seg[B] is BC and so on round to the last lane's, which
+ * leads back to A.
+ */
+struct intersection {
+	struct segment *is_seg; // numWays of them
+	struct lane is_lane[MAXWAYS];
+	// numWays-1 units; every route through more than one segment
+	// holds one (see the route table).
+	struct semaphore *is_admit;
+
+	// Turns executed at this intersection, by turn (sharded; see
+	// counter.h).
+	struct counter *is_turns[NUMTURNS];
+
+	// Bracketed around every change a snapshot can see: segment
+	// status words and the states of vehicles here.
+	struct seqlock is_seq;
+
+	// Read-only once the grid is built.
+	int is_id;
+	char is_tag[8]; // Printed before each message; empty when alone.
+
+	// Where each exit route leads: the next intersection and the lane
+	// a vehicle arrives on there. NULL if the route leaves the grid.
+	struct intersection *is_next[MAXWAYS];
+	int is_nextlane[MAXWAYS];
+} CACHELINE_ALIGNED;
+
+/*
+ * The grid. Intersections are numbered row by row. Route C leads east
+ * into lane A of the next intersection in the row and Route B leads
+ * south into lane B of the intersection below; Route A, and any route
+ * off the edge, leaves the grid. A single row is a corridor and a 1x1
+ * grid is the classic single intersection.
+ */
+static struct intersection **grid;
+static int gridRows;
+static int gridCols;
+static int numIntersections;
+
+// Number of vehicles that have left the grid.
+static struct counter *countVehicles;
+
+/*
+ * Completion records. Each time a vehicle thread gets through an
+ * intersection it fills in one of these and pushes it onto a lock-free
+ * queue (see mpscq.h) for the aggregator thread, so measuring latency
+ * doesn't add a shared lock for the vehicles to fight over. Records
+ * are preallocated, maxCrossings per vehicle.
+ */
+struct crossing {
+	struct mpscnode cr_node; // must be first
+	int cr_vehicle;          // -1 marks the end of the run
+	int cr_intersection;
+	int cr_lane;
+	int cr_turn;
+	int cr_type;
+	u_int32_t cr_arrive;     // reached the intersection
+	u_int32_t cr_enter;      // got onto its first segment
+	u_int32_t cr_exit;       // left the intersection
+};
+
+static struct crossing *crossings;
+static int maxCrossings;
+static struct mpscq crossingQueue;
+static struct semaphore *crossingsReady; // one V per record pushed
+static struct semaphore *aggregatorDone;
+
+/*
+ * What each vehicle is doing, for snapshots (see snapshot_take()). A
+ * vehicle only ever writes its own entry, and only inside a write
+ * section of the intersection it is at. That alone doesn't stop a
+ * snapshot of the intersection it just left from copying the entry
+ * while it is half rewritten for the next one, so each entry also has
+ * its own seqlock, written inside the intersection's.
+ */
+#define VS_NONE    0 // not at any intersection
+#define VS_ARRIVED 1 // in its lane, waiting its turn
+#define VS_ADMIT   2 // waiting to be admitted (is_admit)
+#define VS_WAITSEG 3 // waiting for step vs_step of its route
+#define VS_ONSEG   4 // on step vs_step of its route
+
+struct vehiclestate {
+	struct seqlock vs_seq;
+	int vs_number;
+	int vs_type;
+	int vs_intersection;
+	int vs_lane;
+	int vs_turn;
+	int vs_state;
+	int vs_step;
+};
+
+static struct vehiclestate *vehicleStates;
+static int numVehicleStates;
+
+// Latencies built by the aggregator, in microseconds.
+static struct histogram waitHist[2];                   // arrive to enter, by type
+static struct histogram *transitHist;                  // arrive to exit, by lane/turn/type
+
+static struct histogram *transitHistFor(int lane, int turn, int type){
+	return &transitHist[(lane * NUMTURNS + turn) * 2 + type];
 }
 
 /*
- * turnleft()
+ * The route table: for each lane and turn, the segments a vehicle
+ * drives through, in order, and the route it leaves by. Every turn is
+ * carried out by traverse() (or vehicletask_step()) from this table.
  *
- * Arguments:
- *      unsigned long vehicledirection: the direction from which the vehicle
- *              approaches the intersection.
- *      unsigned long vehiclenumber: the vehicle id number for printing purposes.
+ * Vehicles drive round the ring of segments, so a route from lane L
+ * through K segments uses L, L+1, ... L+K-1 (mod numWays) and exits
+ * at lane L+K. A right turn is one segment and a left turn numWays-1;
+ * going straight is half way round and only exists from four ways up,
+ * and a U-turn goes all the way round. A turn that doesn't exist has
+ * rt_nsegs 0.
  *
- * Returns:
- *      nothing.
+ * A vehicle waits for a segment holding at most the one before it, so
+ * a cycle of vehicles each waiting on the next one's segment would
+ * have to hold every segment of the ring: numWays vehicles, all on
+ * routes of more than one segment. Admitting at most numWays-1 of
+ * those at a time (is_admit) rules that out, whatever the turns.
  *
- * Notes:
- *      This function should implement making a left turn through the 
- *      intersection from any direction.
- *      Write and comment this function.
+ * routeMsg holds each route's status messages, built from the segment
+ * names by routes_init(): message i is printed on getting onto segment
+ * i, and message rt_nsegs on leaving.
  */
+#define ROUTEMSGLEN 64
 
-static
-void
-turnleft(unsigned long vehicledirection,
-		unsigned long vehiclenumber,
-		unsigned long vehicletype)
-{
-  /*
-   *  Uses two locks to ensure only two vehicles can perform left turns inside
-   *  the intersection. This is to avoid deadlocks of having 3 vehicles left turn.
-   *  The locks will keep track of a queue, and a counter will be used that 
-   *  the queue is evenly distributed.
-   */
-  if(countLeft1 <= countLeft2){
-    countLeft1++;
-    lock_acquire(left1);
-  }
-  else{
-    countLeft2++;
-    lock_acquire(left2);
-  }
-  /*
-   * Vehicle will try to acquire intersection locks. Once acquired, it'll 
-   * acquire the lock to have exclusive access to printing. The vechicle will
-   * print on its current status.
-   */
-	switch(vehicledirection){ //Create 2 do, while loops for mutex locks.
-		case A: //Check AB, then check BC.
-      lock_acquire(AB);
-      lock_acquire(printAB);
-      if(vehicletype == CAR){
-        waitingCarsCountA--;
-      }
-      kprintf("%-5s %-2lu is entering AB and waiting for BC.\t\t\t\t\tAB Closed\n", type[vehicletype], vehiclenumber);
-      lock_acquire(BC);
-      lock_acquire(printBC);
-      lock_release(AB);
-      kprintf("%-5s %-2lu is entering BC from AB.\t\t\t\t\tAB Open BC Closed\n", type[vehicletype], vehiclenumber);
-      lock_release(printAB);
-      lock_release(BC);
-      kprintf("%-5s %-2lu is leaving BC and exited at Route C.\t\t\t\tBC Open\n", type[vehicletype], vehiclenumber);
-      lock_release(printBC);
-			break; 
-		case B: //Check BC, then CA.
-      lock_acquire(BC);
-      lock_acquire(printBC);
-      if(vehicletype == CAR){
-        waitingCarsCountB--;
-      }
-      kprintf("%-5s %-2lu is entering BC and waiting for CA.\t\t\t\t\tBC Closed\n", type[vehicletype], vehiclenumber);
-      lock_acquire(CA);
-      lock_acquire(printCA);
-      lock_release(BC);
-      kprintf("%-5s %-2lu is entering CA from BC.\t\t\t\t\tBC Open CA Closed\n",type[vehicletype], vehiclenumber);
-      lock_release(printBC);
-      lock_release(CA);
-      kprintf("%-5s %-2lu is leaving CA and exited at Route A.\t\t\t\tCA Open\n", type[vehicletype], vehiclenumber);
-      lock_release(printCA);
-			break; 
-		case C: //Check CA, then AB.
-      lock_acquire(CA);
-      lock_acquire(printCA);
-      if(vehicletype == CAR){
-        waitingCarsCountC--;
-      }
-      kprintf("%-5s %-2lu is entering CA and waiting for AB.\t\t\t\t\tCA Closed\n", type[vehicletype], vehiclenumber);
-      lock_acquire(AB);
-      lock_acquire(printAB);
-      lock_release(CA);
-      kprintf("%-5s %-2lu is entering AB from CA.\t\t\t\t\tCA Open AB Closed\n", type[vehicletype], vehiclenumber);
-      lock_release(printCA);
-      lock_release(AB);
-      kprintf("%-5s %-2lu is leaving AB and exited at Route B.\t\t\t\tAB Open\n", type[vehicletype], vehiclenumber);
-      lock_release(printAB);
-			break; 
-	}
-  if(lock_do_i_hold(left1) == 1){
-    countLeft1--;
-    lock_release(left1);
-  }
-  else{
-    countLeft2--;
-    lock_release(left2);
-  }
+struct route {
+	int rt_nsegs;
+	int rt_segs[MAXWAYS];
+	int rt_exit;
+	int rt_admit; // takes a unit of is_admit
+};
+
+static struct route routes[MAXWAYS][NUMTURNS];
+
+static char routeMsg[MAXWAYS][NUMTURNS][MAXWAYS + 1][ROUTEMSGLEN];
+
+/*
+ * Number of segments a turn drives through at a numWays intersection,
+ * or 0 if the turn isn't possible.
+ */
+static int turn_segments(int turn){
+	switch (turn) {
+	    case RIGHT:
+		return 1;
+	    case LEFT:
+		return numWays - 1;
+	    case STRAIGHT:
+		return numWays >= 4 ? numWays / 2 : 0;
+	    case UTURN:
+		return uTurns ? numWays : 0;
+	}
+	return 0;
 }
 
+/*
+ * Picks a random turn that exists at a numWays intersection.
+ */
+static int pickTurn(void){
+	int turn;
+
+	do {
+		turn = random() % NUMTURNS;
+	} while (turn_segments(turn) == 0);
+	return turn;
+}
 
 /*
- * turnright()
- *
- * Arguments:
- *      unsigned long vehicledirection: the direction from which the vehicle
- *              approaches the intersection.
- *      unsigned long vehiclenumber: the vehicle id number for printing purposes.
- *
- * Returns:
- *      nothing.
- *
- * Notes:
- *      This function should implement making a right turn through the 
- *      intersection from any direction.
- *      Write and comment this function.
+ * Arrivals (see workload.h). A trace may come from a bigger grid or
+ * intersection, so anything out of range is folded back into it, and
+ * a turn that doesn't exist here is left to the vehicle.
  */
+static void arrival_fold(struct arrival *ar){
+	ar->ar_intersection %= numIntersections;
+	ar->ar_lane %= numWays;
+	if (ar->ar_turn < 0 || ar->ar_turn >= NUMTURNS ||
+	    turn_segments(ar->ar_turn) == 0) {
+		ar->ar_turn = WL_ANYTURN;
+	}
+}
 
-static
-void
-turnright(unsigned long vehicledirection,
-		unsigned long vehiclenumber,
-		unsigned long vehicletype)
-{
-  /*
-   * Vehicle will try to acquire intersection locks. Once acquired, it'll 
-   * acquire the lock to have exclusive access to printing. The vechicle will
-   * print on its current status.
-   */
-	switch(vehicledirection){
-		case A:
-			//Check AB, increment number of vehicles in intersection.
-			lock_acquire(AB);
-      lock_acquire(printAB);
-      if(vehicletype == CAR){
-        waitingCarsCountA--;
-      }
-			kprintf("%-5s %-2lu is entering AB.\t\t\t\t\t\t\tAB Closed\n", type[vehicletype], vehiclenumber);
-			lock_release(AB);
-			kprintf("%-5s %-2lu is leaving AB and exited at Route B.\t\t\t\tAB Open\n",
-					type[vehicletype], vehiclenumber);
-      lock_release(printAB);
-			break; 
-		case B: //Check BC.
-			lock_acquire(BC);
-      lock_acquire(printBC);
-      if(vehicletype == CAR){
-        waitingCarsCountB--;
-      }
-			kprintf("%-5s %-2lu is entering BC.\t\t\t\t\t\t\tBC Closed\n", type[vehicletype], vehiclenumber);
-			lock_release(BC);
-			kprintf("%-5s %-2lu is leaving BC and exited at Route C.\t\t\t\tBC Open\n",
-					type[vehicletype], vehiclenumber);
-      lock_release(printBC);
-			break; 
-		case C: //Check CA.
-			lock_acquire(CA);
-      lock_acquire(printCA);
-      if(vehicletype == CAR){
-        waitingCarsCountC--;
-      }
-			kprintf("%-5s %-2lu is entering CA.\t\t\t\t\t\t\tCA Closed\n", type[vehicletype], vehiclenumber);
-			lock_release(CA);
-			kprintf("%-5s %-2lu is leaving CA and exited at Route A.\t\t\t\tCA Open\n",
-					type[vehicletype], vehiclenumber);
-      lock_release(printCA);
+/*
+ * Takes up to N arrivals from WL into ARS. Returns how many; fewer
+ * than N if a trace ends or can't be read.
+ */
+static int arrivals_take(struct workload *wl, struct arrival *ars, int n){
+	int i, result;
+
+	for (i = 0; i < n; i++) {
+		result = workload_next(wl, &ars[i]);
+		if (result) {
+			if (result != ENOENT) {
+				kprintf("workload: %s\n", strerror(result));
+			}
 			break;
+		}
+		arrival_fold(&ars[i]);
+	}
+	return i;
+}
+
+// When the run started; arrival times count from here.
+static u_int32_t runStart;
+
+// The vehicle threads' arrivals, one each.
+static struct arrival *arrivals;
+
+/*
+ * Builds the segment names, the route table for numWays lanes, and
+ * the routes' messages. The first message is "entering" and the last
+ * "leaving"; ones in between are moves between segments. The tabs
+ * line the segment status up in a column.
+ */
+static void routes_init(void){
+	int lane, turn, i;
+
+	for (i = 0; i < numWays; i++) {
+		intersection[i][0] = charLane[i];
+		intersection[i][1] = charLane[(i + 1) % numWays];
+		intersection[i][2] = 0;
 	}
 
+	for (lane = 0; lane < numWays; lane++) {
+		for (turn = 0; turn < NUMTURNS; turn++) {
+			struct route *rt = &routes[lane][turn];
+			char (*msg)[ROUTEMSGLEN] = routeMsg[lane][turn];
+			const char *first, *last;
+
+			rt->rt_nsegs = turn_segments(turn);
+			if (rt->rt_nsegs == 0) {
+				continue;
+			}
+			for (i = 0; i < rt->rt_nsegs; i++) {
+				rt->rt_segs[i] = (lane + i) % numWays;
+			}
+			rt->rt_exit = (lane + rt->rt_nsegs) % numWays;
+			rt->rt_admit = rt->rt_nsegs > 1;
+
+			first = intersection[rt->rt_segs[0]];
+			last = intersection[rt->rt_segs[rt->rt_nsegs - 1]];
+
+			if (rt->rt_nsegs == 1) {
+				snprintf(msg[0], ROUTEMSGLEN,
+					"is entering %s.\t\t\t\t\t\t\t%s Closed\n",
+					first, first);
+			}
+			else {
+				snprintf(msg[0], ROUTEMSGLEN,
+					"is entering %s, bound for %s.\t\t\t\t\t\t%s Closed\n",
+					first, intersection[rt->rt_segs[1]], first);
+			}
+			for (i = 1; i < rt->rt_nsegs; i++) {
+				const char *from = intersection[rt->rt_segs[i - 1]];
+				const char *to = intersection[rt->rt_segs[i]];
+				snprintf(msg[i], ROUTEMSGLEN,
+					"is entering %s from %s.\t\t\t\t\t%s Open %s Closed\n",
+					to, from, from, to);
+			}
+			snprintf(msg[rt->rt_nsegs], ROUTEMSGLEN,
+				"is leaving %s and exited at Route %c.\t\t\t\t%s Open\n",
+				last, charLane[rt->rt_exit], last);
+		}
+	}
 }
 
+// Function Definitions
 /*
- * approachintersection()
- *
- * Arguments: 
- *      void * unusedpointer: currently unused.
- *      unsigned long vehiclenumber: holds vehicle id number.
- *
- * Returns:
- *      nothing.
- *
- * Notes:
- *      Change this function as necessary to implement your solution. These
- *      threads are created by createvehicles().  Each one must choose a direction
- *      randomly, approach the intersection, choose a turn randomly, and then
- *      complete that turn.  The code to choose a direction randomly is
- *      provided, the rest is left to you to implement.  Making a turn
- *      or going straight should be done by calling one of the functions
- *      above.
+ * Prints the  initial vehicle information when it arrives at an intersection. 
  */
+static void printInfo(struct intersection *is,
+			unsigned long vehicleDirection,
+			unsigned long vehicleNumber,
+			unsigned long vehicleType,
+			unsigned long direction){
+	//Calculates the final destination of the vehicle.
+	int destination = routes[vehicleDirection][direction].rt_exit;
 
-static
-void
-approachintersection(void * unusedpointer,
-		unsigned long vehiclenumber) {
-	int vehicledirection, turndirection, vehicletype;
+	if (evlogOn) {
+		return;
+	}
+	kprintf("%s%s %lu waiting at Route %c wants to turn %s to Route %c.\n",
+			is->is_tag, type[vehicleType], vehicleNumber,
+			charLane[vehicleDirection], stringDirection[direction],
+			charLane[destination]
+			);
+}
 
-	(void) unusedpointer;
+/*
+ * Truck priority with aging.
+ *
+ * Cars in a lane go before the lane's trucks, but a truck's priority
+ * rises the longer it waits: once it has waited truckMaxWait it
+ * outranks the cars, and cars arriving behind it hold back until it
+ * is through. So a truck waits no more than truckMaxWait plus the
+ * time the cars already ahead of it take to clear, however heavy the
+ * car traffic. truckMaxWait 0 means trucks never age, and wait for as
+ * long as there are cars.
+ *
+ * Waiting vehicles sleep on the lane's queues, trucks with a timeout
+ * for when they age; the last car out wakes the trucks and the last
+ * aged truck through wakes the cars. Tasks can't sleep, so they pass
+ * BLOCK 0 and yield instead when told to wait.
+ */
+#define TRUCK_WAIT 0 // not yet
+#define TRUCK_GO   1 // no cars left
+#define TRUCK_AGED 2 // ahead of the cars; call lane_truck_done() once through
 
-	// Randomly sets vehicle variables.
+static u_int32_t truckMaxWait = TRUCK_MAXWAIT;
+static struct counter *countAged; // trucks that went by age
 
-	vehicledirection = random() % 3;
-	turndirection = random() % 2;
-	vehicletype = random() % 2;
+/*
+ * A car joins lane LN. Returns 1, or 0 if it must hold back for an
+ * aged truck and may not BLOCK.
+ */
+static int lane_car_arrive(struct lane *ln, int block){
+	spinlock_acquire(&ln->ln_spin);
+	while (ln->ln_agedtrucks > 0) {
+		if (!block) {
+			spinlock_release(&ln->ln_spin);
+			return 0;
+		}
+		spinlock_sleep(&ln->ln_spin, &ln->ln_cars);
+	}
+	ln->ln_waitingcars++;
+	spinlock_release(&ln->ln_spin);
+	return 1;
+}
 
+// A car in lane LN has got onto its first segment.
+static void lane_car_go(struct lane *ln){
+	spinlock_acquire(&ln->ln_spin);
+	if (--ln->ln_waitingcars == 0) {
+		thread_wake_all(&ln->ln_trucks);
+	}
+	spinlock_release(&ln->ln_spin);
+}
 
-  printInfo(vehicledirection, vehiclenumber, vehicletype, turndirection);
-	// If vehicle is a truck, yield to cars. Else add to waitingCarsCount for lane.
-  handleVehicle(vehicletype, vehicledirection);
+/*
+ * A truck that arrived in lane LN at ARRIVED waits for the lane's
+ * cars or until it has aged. Returns TRUCK_GO or TRUCK_AGED, or
+ * TRUCK_WAIT if it may not BLOCK.
+ */
+static int lane_truck_wait(struct lane *ln, u_int32_t arrived, int block){
+	int result = TRUCK_GO;
 
-	// Turns left or right depening on turndirection.
-	switch(turndirection){
-		case LEFT:
-			turnleft(vehicledirection, vehiclenumber, vehicletype);
-      countLeft++;
+	spinlock_acquire(&ln->ln_spin);
+	while (ln->ln_waitingcars > 0) {
+		if (truckMaxWait > 0 && timestamp_us() - arrived >= truckMaxWait) {
+			ln->ln_agedtrucks++;
+			counter_inc(countAged);
+			result = TRUCK_AGED;
 			break;
-		case RIGHT: 
-			turnright(vehicledirection, vehiclenumber, vehicletype);
-      countRight++;
+		}
+		if (!block) {
+			result = TRUCK_WAIT;
 			break;
+		}
+		if (truckMaxWait > 0) {
+			spinlock_sleep_timeout(&ln->ln_spin, &ln->ln_trucks,
+				arrived + truckMaxWait);
+		}
+		else {
+			spinlock_sleep(&ln->ln_spin, &ln->ln_trucks);
+		}
 	}
-
-  // Increments count of executed vehicles
-	countVehicles++;
+	spinlock_release(&ln->ln_spin);
+	return result;
 }
 
+// An aged truck from lane LN is through the intersection.
+static void lane_truck_done(struct lane *ln){
+	spinlock_acquire(&ln->ln_spin);
+	if (--ln->ln_agedtrucks == 0) {
+		thread_wake_all(&ln->ln_cars);
+	}
+	spinlock_release(&ln->ln_spin);
+}
 
+/*
+ * Handles whether a truck should be yielded and manages counts of cars 
+ * sleeping/waiting in lanes. ARRIVED is when the vehicle got here.
+ * Returns nonzero for a truck that went by age; it must call
+ * lane_truck_done() once through.
+ */
+static int handleVehicle(struct intersection *is,
+			unsigned long vehicletype, unsigned long lane,
+			u_int32_t arrived){
+  struct lane *ln = &is->is_lane[lane];
+  // If vehicle type is truck, sleep until the cars have finished or it has aged.
+  if(vehicletype == TRUCK){
+    return lane_truck_wait(ln, arrived, 1) == TRUCK_AGED;
+  }
+  lane_car_arrive(ln, 1);
+  return 0;
+}
 
 /*
- * createvehicles()
- *
- * Arguments:
- *      int nargs: unused.
- *      char ** args: unused.
+ * Lane admission.
  *
- * Returns:
- *      0 on success.
+ * With laneCap set, no more than laneCap vehicles are in flight on any
+ * lane of any intersection, counting from when they join the lane
+ * until they have left the intersection; each holds a unit of the
+ * lane's ln_room. The generator takes a unit for each new arrival
+ * before it starts the vehicle, and if there is none either waits for
+ * one (ADMIT_BLOCK) or turns the arrival away and counts it
+ * (ADMIT_DROP). A vehicle going on to another intersection takes a
+ * unit of the lane it joins there before giving back the one it has.
+ * Routes only lead east and south, so holding one while waiting for
+ * the other can't deadlock.
  *
- * Notes:
- *      Driver code to start up the approachintersection() threads.  You are
- *      free to modiy this code as necessary for your solution.
+ * So under overload the vehicles on the road, and the sleepers on any
+ * lock or lane queue, stay bounded by the caps, and the backlog waits
+ * in the generator (or is dropped) instead.
  */
+#define ADMIT_BLOCK 0
+#define ADMIT_DROP  1
 
-int
-createvehicles(int nargs,
-		char ** args)
-{
-	int index, error;
+static int laneCap;         // 0 for no limit
+static int admitPolicy = ADMIT_BLOCK;
+static struct counter *countBlocked; // arrivals that waited for room
+static struct counter *countDropped; // ... or were turned away
+static struct histogram admitHist;   // how late arrivals got in
 
-	/*
-	 * Avoid unused variable warnings.
-	 */
+// The generator sleeps here until the next arrival is due. Nothing
+// ever wakes it; the sleep just times out.
+static struct spinlock admitSpin = SPINLOCK_INITIALIZER;
+static struct threadlist admitWait;
 
-	(void) nargs;
-	(void) args;
-
-	// Creates the lock for the intersection. 
-	AB = lock_create("AB"); 
-	BC = lock_create("BC"); 
-	CA = lock_create("CA");
-  // Prevent deadlocks from having 3 left turns
-  left1 = lock_create("left1");
-  left2 = lock_create("left2");
-  printAB = lock_create("printAB");
-  printBC = lock_create("printBC");
-  printCA = lock_create("printCA");
-  //print = lock_create("print");// Used to avoid accident prints
+/*
+ * Takes a unit of room in lane LANE of IS. Returns 1, or 0 if there
+ * is none and it may not BLOCK.
+ */
+static int lane_room_take(struct intersection *is, int lane, int block){
+	struct semaphore *room = is->is_lane[lane].ln_room;
 
-	//Initialize countVehicles, a counter to check if all the
-	//Threads has been executed.
-	countVehicles = 0;
-
-  countLeft = 0;
-  countRight = 0;
-  countLeft1 = 0;
-  countLeft2 = 0;
-	//Ensures that a deadlock isn't present by maximizing
-	// Num of current locks being used.
- 	//lock_acquire(menu);
-  /*
-	 * Start NVEHICLES approachintersection() threads.
-	 */
+	if (room == NULL || tryP(room)) {
+		return 1;
+	}
+	if (!block) {
+		return 0;
+	}
+	P(room);
+	return 1;
+}
 
-	for (index = 0; index < NVEHICLES; index++) {
+// Gives back a unit of room in lane LANE of IS.
+static void lane_room_give(struct intersection *is, int lane){
+	if (is->is_lane[lane].ln_room != NULL) {
+		V(is->is_lane[lane].ln_room);
+	}
+}
 
-		error = thread_fork("approachintersection thread",
-				NULL,
-				index,
-				approachintersection,
-				NULL
-				);
+/*
+ * The generator's side: waits until arrival AR is due and there is
+ * room for it. Returns 1, or 0 if it was turned away. The wait is a
+ * timed sleep, so it may run over by up to a clock tick.
+ */
+static int arrival_admit(const struct arrival *ar){
+	struct intersection *is = grid[ar->ar_intersection];
+	u_int32_t due = runStart + ar->ar_time;
 
-		/*
-		 * panic() on error.
-		 */
+	if ((int32_t)(due - timestamp_us()) > 0) {
+		spinlock_acquire(&admitSpin);
+		spinlock_sleep_timeout(&admitSpin, &admitWait, due);
+		spinlock_release(&admitSpin);
+	}
+	if (laneCap == 0) {
+		return 1;
+	}
+	if (!lane_room_take(is, ar->ar_lane, 0)) {
+		if (admitPolicy == ADMIT_DROP) {
+			counter_inc(countDropped);
+			return 0;
+		}
+		counter_inc(countBlocked);
+		lane_room_take(is, ar->ar_lane, 1);
+	}
+	histogram_add(&admitHist, timestamp_us() - runStart - ar->ar_time);
+	return 1;
+}
 
-		if (error) {
+/*
+ * Creates intersection ID with its locks and no neighbours. TAGGED
+ * says whether its messages carry the intersection number. Returns
+ * NULL if out of memory.
+ */
+static struct intersection *intersection_create(int id, int tagged){
+	struct intersection *is;
+	char name[16];
+	int i;
 
-			panic("approachintersection: thread_fork failed: %s\n",
-					strerror(error)
-				 );
+	is = kmalloc(sizeof(struct intersection));
+	if (is == NULL) {
+		return NULL;
+	}
+	is->is_id = id;
+	is->is_tag[0] = 0;
+	if (tagged) {
+		snprintf(is->is_tag, sizeof(is->is_tag), "[%d] ", id);
+	}
+
+	is->is_seg = kmalloc(numWays * sizeof(struct segment));
+	if (is->is_seg == NULL) {
+		kfree(is);
+		return NULL;
+	}
+	for (i = 0; i < numWays; i++) {
+		if (lock_init(&is->is_seg[i].sg_lock, intersection[i])) {
+			panic("intersection_create: out of memory\n");
+		}
+		is->is_seg[i].sg_status = SEG_OPEN;
+		histogram_init(&is->is_seg[i].sg_waithist);
+		lock_setwaithist(&is->is_seg[i].sg_lock, &is->is_seg[i].sg_waithist);
+		is->is_lane[i].ln_waitingcars = 0;
+		is->is_lane[i].ln_agedtrucks = 0;
+		spinlock_init(&is->is_lane[i].ln_spin);
+		threadlist_init(&is->is_lane[i].ln_trucks);
+		threadlist_init(&is->is_lane[i].ln_cars);
+		is->is_lane[i].ln_room = NULL;
+		if (laneCap > 0) {
+			is->is_lane[i].ln_room = sem_create("lane room", laneCap);
+			if (is->is_lane[i].ln_room == NULL) {
+				panic("intersection_create: out of memory\n");
+			}
+		}
+		is->is_next[i] = NULL;
+		is->is_nextlane[i] = 0;
+	}
+	// Prevent deadlocks from multi-segment routes (see the route table)
+	is->is_admit = sem_create("admit", numWays - 1);
+	if (is->is_admit == NULL) {
+		panic("intersection_create: out of memory\n");
+	}
+	for (i = 0; i < NUMTURNS; i++) {
+		snprintf(name, sizeof(name), "%s turns", stringDirection[i]);
+		is->is_turns[i] = counter_create(name);
+		if (is->is_turns[i] == NULL) {
+			panic("intersection_create: out of memory\n");
 		}
 	}
+	seqlock_init(&is->is_seq);
 
-	//BUSY WAIT SOLUTION
-	//Waits until all of the threads are executed.
-	while(countVehicles < NVEHICLES){
-    thread_yield();
+	return is;
+}
+
+static void intersection_destroy(struct intersection *is){
+	int i;
+
+	for (i = 0; i < numWays; i++) {
+		lock_cleanup(&is->is_seg[i].sg_lock);
+		threadlist_cleanup(&is->is_lane[i].ln_trucks);
+		threadlist_cleanup(&is->is_lane[i].ln_cars);
+		if (is->is_lane[i].ln_room != NULL) {
+			sem_destroy(is->is_lane[i].ln_room);
+		}
 	}
-  kprintf("Right turns executed: %d \n", countRight);
-  kprintf("Left turns executed: %d \n", countLeft);
-  // Destroy locks
-	lock_destroy(AB);
-	lock_destroy(BC);
-	lock_destroy(CA);
-  lock_destroy(left1);
-  lock_destroy(left2);
-  lock_destroy(printAB);
-  lock_destroy(printBC);
-  lock_destroy(printCA);
+	kfree(is->is_seg);
+	sem_destroy(is->is_admit);
+	for (i = 0; i < NUMTURNS; i++) {
+		counter_destroy(is->is_turns[i]);
+	}
+	kfree(is);
+}
 
-	return 0;
+/*
+ * Builds a ROWS x COLS grid and links the intersections together.
+ */
+static void grid_create(int rows, int cols){
+	int row, col, id;
+
+	gridRows = rows;
+	gridCols = cols;
+	numIntersections = rows * cols;
+	grid = kmalloc(numIntersections * sizeof(struct intersection *));
+	if (grid == NULL) {
+		panic("grid_create: out of memory\n");
+	}
+
+	for (id = 0; id < numIntersections; id++) {
+		// Each intersection is its own allocation: no shared state.
+		grid[id] = intersection_create(id, numIntersections > 1);
+		if (grid[id] == NULL) {
+			panic("grid_create: out of memory\n");
+		}
+	}
+
+	for (row = 0; row < rows; row++) {
+		for (col = 0; col < cols; col++) {
+			struct intersection *is = grid[row * cols + col];
+			if (col + 1 < cols) {
+				is->is_next[C] = grid[row * cols + col + 1];
+				is->is_nextlane[C] = A;
+			}
+			if (row + 1 < rows) {
+				is->is_next[B] = grid[(row + 1) * cols + col];
+				is->is_nextlane[B] = B;
+			}
+		}
+	}
+}
+
+static void grid_destroy(void){
+	int id;
+
+	for (id = 0; id < numIntersections; id++) {
+		intersection_destroy(grid[id]);
+	}
+	kfree(grid);
+	grid = NULL;
+	numIntersections = 0;
+}
+
+/*
+ * Mark SEG as occupied by the given vehicle, or as open again. The
+ * caller holds its sg_lock.
+ */
+static void segment_enter(struct segment *seg,
+		unsigned long vehiclenumber, unsigned long vehicletype){
+	int status = SEG_CLOSED | (vehiclenumber & SEG_VEHICLE);
+
+	if (vehicletype == TRUCK) {
+		status |= SEG_TRUCK;
+	}
+	atomic_swap(&seg->sg_status, status);
 }
 
+static void segment_leave(struct segment *seg){
+	atomic_swap(&seg->sg_status, SEG_OPEN);
+}
 
+/*
+ * Add an event to the binary log, if there is one (see evlog.h). TIME
+ * is virtual for the simulation.
+ */
+static void vehicle_log(int code, u_int32_t time, unsigned long vehiclenumber,
+		int vehicletype, int id, int lane, int turn, int seg, int step){
+	struct evrec er;
+
+	if (!evlogOn) {
+		return;
+	}
+	er.er_time = time;
+	er.er_vehicle = vehiclenumber;
+	er.er_intersection = id;
+	er.er_code = code;
+	er.er_seg = seg;
+	er.er_type = vehicletype;
+	er.er_lane = lane;
+	er.er_turn = turn;
+	er.er_step = step;
+	evlog_add(&er);
+}
+
+/*
+ * Vehicle state changes. Each is one write section of IS's seqlock and
+ * of the vehicle's own, so a snapshot sees all or none of it.
+ */
+static void vehicle_arrive(struct intersection *is,
+		unsigned long vehiclenumber, unsigned long vehicletype,
+		unsigned long lane, unsigned long turn){
+	struct vehiclestate *vs = &vehicleStates[vehiclenumber];
+
+	seqlock_write_begin(&is->is_seq);
+	seqlock_write_begin(&vs->vs_seq);
+	vs->vs_type = vehicletype;
+	vs->vs_intersection = is->is_id;
+	vs->vs_lane = lane;
+	vs->vs_turn = turn;
+	vs->vs_step = 0;
+	vs->vs_state = VS_ARRIVED;
+	seqlock_write_end(&vs->vs_seq);
+	seqlock_write_end(&is->is_seq);
+	if (evlogOn) {
+		vehicle_log(EV_ARRIVE, timestamp_us(), vehiclenumber, vehicletype,
+			is->is_id, lane, turn, EV_NOSEG, 0);
+	}
+}
+
+static void vehicle_setstate(struct intersection *is,
+		unsigned long vehiclenumber, int state, int step){
+	struct vehiclestate *vs = &vehicleStates[vehiclenumber];
+
+	seqlock_write_begin(&is->is_seq);
+	seqlock_write_begin(&vs->vs_seq);
+	vs->vs_state = state;
+	vs->vs_step = step;
+	seqlock_write_end(&vs->vs_seq);
+	seqlock_write_end(&is->is_seq);
+}
+
+/*
+ * Move a vehicle holding the segments involved onto step STEP of route
+ * RT, off the one before it if any. Step rt_nsegs takes it out of the
+ * intersection.
+ */
+static void vehicle_move(struct intersection *is, const struct route *rt,
+		int step, unsigned long vehiclenumber, unsigned long vehicletype){
+	struct vehiclestate *vs = &vehicleStates[vehiclenumber];
+
+	seqlock_write_begin(&is->is_seq);
+	if (step > 0) {
+		segment_leave(&is->is_seg[rt->rt_segs[step - 1]]);
+	}
+	if (step < rt->rt_nsegs) {
+		segment_enter(&is->is_seg[rt->rt_segs[step]],
+			vehiclenumber, vehicletype);
+	}
+	seqlock_write_begin(&vs->vs_seq);
+	if (step < rt->rt_nsegs) {
+		vs->vs_state = VS_ONSEG;
+		vs->vs_step = step;
+	}
+	else {
+		vs->vs_state = VS_NONE;
+	}
+	seqlock_write_end(&vs->vs_seq);
+	seqlock_write_end(&is->is_seq);
+	if (evlogOn) {
+		vehicle_log(step == 0 ? EV_ENTER : step < rt->rt_nsegs ? EV_MOVE : EV_LEAVE,
+			timestamp_us(), vehiclenumber, vehicletype, is->is_id,
+			vs->vs_lane, vs->vs_turn,
+			rt->rt_segs[step < rt->rt_nsegs ? step : step - 1], step);
+	}
+}
+
+/*
+ * Take a segment lock, warning every STALL_USECS that the vehicle is
+ * still stuck so that a stall shows up in the output instead of the
+ * run just hanging. Keeps waiting after each warning, and says who is
+ * on the segment, if anyone has got onto it yet.
+ */
+static void acquireSegment(struct intersection *is, int seg,
+		unsigned long vehiclenumber, unsigned long vehicletype){
+	struct lock *lk = &is->is_seg[seg].sg_lock;
+	int status;
+
+	while (!lock_acquire_timeout(lk, STALL_USECS)) {
+		status = is->is_seg[seg].sg_status;
+		if (status & SEG_CLOSED) {
+			kprintf("%sWARNING: %s %lu stalled waiting for %s (%s %d on it)\n",
+				is->is_tag, type[vehicletype], vehiclenumber,
+				intersection[seg],
+				type[(status & SEG_TRUCK) ? TRUCK : CAR],
+				status & SEG_VEHICLE);
+		}
+		else {
+			kprintf("%sWARNING: %s %lu stalled waiting for %s\n",
+				is->is_tag, type[vehicletype], vehiclenumber,
+				intersection[seg]);
+		}
+	}
+}
+
+/*
+ * Take the segment locks for route RT. For the first SEGMENT_TRIES
+ * rounds, only the first one is waited for and the rest are only
+ * tried: if one is busy, let go of everything, yield, and try again,
+ * so the vehicle doesn't sit on one segment blocking others while it
+ * waits for the next. After that it stops retrying and waits for each
+ * segment in turn, lowest numbered first. Anyone waiting while holding
+ * segments then holds only lower-numbered ones than the one it wants,
+ * so the waits can't form a cycle and the vehicle gets through once
+ * the vehicles ahead of it do.
+ */
+static void acquireSegments(struct intersection *is, const struct route *rt,
+		unsigned long vehiclenumber, unsigned long vehicletype){
+	int segs[MAXWAYS];
+	int i, j, held, tries, seg;
+
+	for (tries = 0; tries < SEGMENT_TRIES; tries++) {
+		acquireSegment(is, rt->rt_segs[0], vehiclenumber, vehicletype);
+		for (held = 1; held < rt->rt_nsegs; held++) {
+			if (!lock_tryacquire(&is->is_seg[rt->rt_segs[held]].sg_lock)) {
+				break;
+			}
+		}
+		if (held == rt->rt_nsegs) {
+			return;
+		}
+		for (i = 0; i < held; i++) {
+			lock_release(&is->is_seg[rt->rt_segs[i]].sg_lock);
+		}
+		thread_yield();
+	}
+
+	// Still busy: wait for each, in ascending order.
+	for (i = 0; i < rt->rt_nsegs; i++) {
+		seg = rt->rt_segs[i];
+		for (j = i; j > 0 && segs[j - 1] > seg; j--) {
+			segs[j] = segs[j - 1];
+		}
+		segs[j] = seg;
+	}
+	for (i = 0; i < rt->rt_nsegs; i++) {
+		acquireSegment(is, segs[i], vehiclenumber, vehicletype);
+	}
+}
+
+/*
+ * traverse()
+ *
+ * Arguments:
+ *      struct intersection *is: the intersection being crossed.
+ *      unsigned long vehicledirection: the direction from which the vehicle
+ *              approaches the intersection.
+ *      unsigned long turndirection: the turn it makes.
+ *      unsigned long vehiclenumber: the vehicle id number for printing purposes.
+ *      unsigned long vehicletype: CAR or TRUCK.
+ *
+ * Returns:
+ *      the time (timestamp_us) the vehicle got onto its first segment.
+ *
+ * Notes:
+ *      Drives the vehicle through the segments of its route (see the
+ *      route table). It holds all of them from the start, marks and
+ *      announces each one as it moves onto it, and frees the one it
+ *      left only after announcing that, so no other vehicle's status
+ *      line for a segment can come out ahead of it.
+ */
+
+static
+u_int32_t
+traverse(struct intersection *is,
+		unsigned long vehicledirection,
+		unsigned long turndirection,
+		unsigned long vehiclenumber,
+		unsigned long vehicletype)
+{
+  const struct route *rt = &routes[vehicledirection][turndirection];
+  char (*msg)[ROUTEMSGLEN] = routeMsg[vehicledirection][turndirection];
+  const char *tag = is->is_tag;
+  struct segment *seg, *prev;
+  u_int32_t entered;
+  int i;
+
+  /*
+   *  Only numWays-1 vehicles on routes through more than one segment
+   *  may be inside the intersection at once, so they can't all end up
+   *  waiting on each other round the ring.
+   */
+  if(rt->rt_admit){
+    vehicle_setstate(is, vehiclenumber, VS_ADMIT, 0);
+    P(is->is_admit);
+  }
+
+  vehicle_setstate(is, vehiclenumber, VS_WAITSEG, 0);
+  acquireSegments(is, rt, vehiclenumber, vehicletype);
+  entered = timestamp_us();
+
+  // Once it has its segments, the vehicle moves through them in turn.
+  seg = &is->is_seg[rt->rt_segs[0]];
+  if(vehicletype == CAR){
+    lane_car_go(&is->is_lane[vehicledirection]);
+  }
+  vehicle_move(is, rt, 0, vehiclenumber, vehicletype);
+  if(!evlogOn){
+    kprintf("%s%-5s %-2lu %s", tag, type[vehicletype], vehiclenumber, msg[0]);
+  }
+  for(i = 1; i < rt->rt_nsegs; i++){
+    prev = seg;
+    seg = &is->is_seg[rt->rt_segs[i]];
+    vehicle_move(is, rt, i, vehiclenumber, vehicletype);
+    if(!evlogOn){
+      kprintf("%s%-5s %-2lu %s", tag, type[vehicletype], vehiclenumber, msg[i]);
+    }
+    lock_release(&prev->sg_lock);
+  }
+  vehicle_move(is, rt, rt->rt_nsegs, vehiclenumber, vehicletype);
+  if(!evlogOn){
+    kprintf("%s%-5s %-2lu %s", tag, type[vehicletype], vehiclenumber, msg[rt->rt_nsegs]);
+  }
+  lock_release(&seg->sg_lock);
+
+  if(rt->rt_admit){
+    V(is->is_admit);
+  }
+  return entered;
+}
+
+/*
+ * approachintersection()
+ *
+ * Arguments: 
+ *      void * unusedpointer: currently unused.
+ *      unsigned long vehiclenumber: holds vehicle id number.
+ *
+ * Returns:
+ *      nothing.
+ *
+ * Notes:
+ *      Change this function as necessary to implement your solution. These
+ *      threads are created by createvehicles().  Each one must choose a direction
+ *      randomly, approach the intersection, choose a turn randomly, and then
+ *      complete that turn.  The code to choose a direction randomly is
+ *      provided, the rest is left to you to implement.  Making a turn
+ *      or going straight is done by traverse().
+ *
+ *      The vehicle turns up where and as what its arrival says (see
+ *      workload.h); runvehiclethreads() starts it when the arrival is
+ *      due and there is room in its lane. Whenever its exit route leads to another
+ *      intersection it carries on there, arriving on the lane that route
+ *      feeds, until it leaves the grid.
+ */
+
+static
+void
+approachintersection(void * unusedpointer,
+		unsigned long vehiclenumber) {
+	int vehicledirection, turndirection, vehicletype, aged;
+	unsigned long route;
+	struct intersection *is;
+	struct crossing *cr;
+	struct arrival *ar = &arrivals[vehiclenumber];
+
+	(void) unusedpointer;
+
+	// This vehicle's completion records.
+	cr = &crossings[vehiclenumber * maxCrossings];
+
+	// Sets vehicle variables from its arrival.
+
+	is = grid[ar->ar_intersection];
+	vehicledirection = ar->ar_lane;
+	vehicletype = ar->ar_type;
+	turndirection = ar->ar_turn;
+
+	// Forked once due and admitted to its lane (see arrival_admit()).
+	while (is != NULL) {
+		if (turndirection == WL_ANYTURN) {
+			turndirection = pickTurn();
+		}
+
+		printInfo(is, vehicledirection, vehiclenumber, vehicletype, turndirection);
+		vehicle_arrive(is, vehiclenumber, vehicletype, vehicledirection, turndirection);
+		assert(cr < &crossings[(vehiclenumber + 1) * maxCrossings]);
+		cr->cr_arrive = timestamp_us();
+		// If vehicle is a truck, wait for cars. Else add to waitingCarsCount for lane.
+		aged = handleVehicle(is, vehicletype, vehicledirection, cr->cr_arrive);
+
+		// Turns left or right depening on turndirection.
+		cr->cr_enter = traverse(is, vehicledirection, turndirection, vehiclenumber, vehicletype);
+		counter_inc(is->is_turns[turndirection]);
+		if (aged) {
+			lane_truck_done(&is->is_lane[vehicledirection]);
+		}
+
+		// Report the crossing to the aggregator.
+		cr->cr_exit = timestamp_us();
+		cr->cr_vehicle = vehiclenumber;
+		cr->cr_intersection = is->is_id;
+		cr->cr_lane = vehicledirection;
+		cr->cr_turn = turndirection;
+		cr->cr_type = vehicletype;
+		mpscq_push(&crossingQueue, &cr->cr_node);
+		V(crossingsReady);
+		cr++;
+
+		// Move on to wherever the exit route leads, once there's room.
+		route = routes[vehicledirection][turndirection].rt_exit;
+		if (is->is_next[route] != NULL) {
+			lane_room_take(is->is_next[route], is->is_nextlane[route], 1);
+		}
+		lane_room_give(is, vehicledirection);
+		vehicledirection = is->is_nextlane[route];
+		is = is->is_next[route];
+		turndirection = WL_ANYTURN;
+	}
+
+	// Increments count of executed vehicles
+	counter_inc(countVehicles);
+}
+
+
+
+/*
+ * Stackless vehicles.
+ *
+ * "sp1 tasks N" runs N vehicles as tasks (see task.h) on NCARRIERS
+ * carrier threads instead of one thread per vehicle. A vehicle is a
+ * state machine that follows the same route table and takes the same
+ * locks in the same order as traverse(); where that would block
+ * in lock_acquire, the task parks itself on the lock and its carrier
+ * moves on to another vehicle.
+ */
+
+// Vehicle task states, in the order a vehicle goes through them.
+#define VT_ARRIVE    0 // Not yet at the intersection.
+#define VT_TRUCKWAIT 1 // Trucks wait here for the lane's cars.
+#define VT_ADMIT     2 // Waiting for a unit of is_admit, if the route needs one.
+#define VT_SEG       3 // Taking segment vt_seg of the route.
+#define VT_ENTERED   4 // Holding it.
+#define VT_EXIT      5 // Through, waiting for room in the next lane.
+
+struct vehicletask {
+	struct task vt_task;
+	struct intersection *vt_is;
+	unsigned long vt_number;
+	unsigned long vt_lane;
+	unsigned long vt_turn;
+	unsigned long vt_type;
+	int vt_state;
+	int vt_seg;  // index into the route's segments
+	u_int32_t vt_due; // arrival time, until it first arrives
+	u_int32_t vt_arrived; // when it got to this intersection
+	int vt_aged; // a truck going ahead of the cars (see lane_truck_wait())
+};
+
+/*
+ * Called when a vehicle task has cleared its intersection. Moves it on
+ * to the next intersection if its exit route leads to one, as soon as
+ * there's room in the lane it joins there (see lane_room_take());
+ * otherwise the vehicle is done.
+ */
+static int vehicletask_exit(struct vehicletask *vt){
+  struct intersection *is = vt->vt_is;
+  unsigned long route = routes[vt->vt_lane][vt->vt_turn].rt_exit;
+
+  if(vt->vt_aged){
+    lane_truck_done(&is->is_lane[vt->vt_lane]);
+    vt->vt_aged = 0;
+  }
+  if(is->is_next[route] == NULL){
+    lane_room_give(is, vt->vt_lane);
+    counter_inc(countVehicles);
+    return TASK_DONE;
+  }
+  if(!lane_room_take(is->is_next[route], is->is_nextlane[route], 0)){
+    vt->vt_state = VT_EXIT;
+    return TASK_YIELD;
+  }
+  lane_room_give(is, vt->vt_lane);
+  vt->vt_lane = is->is_nextlane[route];
+  vt->vt_is = is->is_next[route];
+  vt->vt_turn = pickTurn();
+  vt->vt_state = VT_ARRIVE;
+  vt->vt_due = 0;
+  return TASK_YIELD;
+}
+
+/*
+ * Advance a vehicle task as far as it can go without blocking. Before
+ * each lock_acquire_task the state is set to the one that follows, so
+ * a parked vehicle resumes there already holding the lock.
+ */
+static int vehicletask_step(struct task *tk){
+  struct vehicletask *vt = tk->tk_data;
+  struct intersection *is = vt->vt_is;
+  unsigned long lane = vt->vt_lane;
+  const struct route *rt = &routes[lane][vt->vt_turn];
+  char (*msg)[ROUTEMSGLEN] = routeMsg[lane][vt->vt_turn];
+  const char *name = type[vt->vt_type];
+  struct segment *seg, *prev;
+
+  for(;;){
+    switch(vt->vt_state){
+      case VT_ARRIVE:
+        // Not due yet: let the others run.
+        if(timestamp_us() - runStart < vt->vt_due){
+          return TASK_YIELD;
+        }
+        // Cars hold back while an aged truck is going, as in handleVehicle().
+        if(vt->vt_type == CAR && !lane_car_arrive(&is->is_lane[lane], 0)){
+          return TASK_YIELD;
+        }
+        printInfo(is, lane, vt->vt_number, vt->vt_type, vt->vt_turn);
+        vehicle_arrive(is, vt->vt_number, vt->vt_type, lane, vt->vt_turn);
+        vt->vt_arrived = timestamp_us();
+        vt->vt_state = VT_TRUCKWAIT;
+        /* FALLTHROUGH */
+      case VT_TRUCKWAIT:
+        // Trucks let the lane's cars go first until they age.
+        if(vt->vt_type == TRUCK){
+          switch(lane_truck_wait(&is->is_lane[lane], vt->vt_arrived, 0)){
+            case TRUCK_WAIT:
+              return TASK_YIELD;
+            case TRUCK_AGED:
+              vt->vt_aged = 1;
+              break;
+          }
+        }
+        vt->vt_state = VT_ADMIT;
+        if(rt->rt_admit){
+          vehicle_setstate(is, vt->vt_number, VS_ADMIT, 0);
+        }
+        /* FALLTHROUGH */
+      case VT_ADMIT:
+        // Same admission as traverse(), but never sleeps the carrier.
+        if(rt->rt_admit && !tryP(is->is_admit)){
+          return TASK_YIELD;
+        }
+        vt->vt_seg = 0;
+        vt->vt_state = VT_SEG;
+        /* FALLTHROUGH */
+      case VT_SEG:
+        vt->vt_state = VT_ENTERED;
+        vehicle_setstate(is, vt->vt_number, VS_WAITSEG, vt->vt_seg);
+        if(!lock_acquire_task(&is->is_seg[rt->rt_segs[vt->vt_seg]].sg_lock, tk)){
+          return TASK_BLOCKED;
+        }
+        /* FALLTHROUGH */
+      case VT_ENTERED:
+        seg = &is->is_seg[rt->rt_segs[vt->vt_seg]];
+        vehicle_move(is, rt, vt->vt_seg, vt->vt_number, vt->vt_type);
+        if(vt->vt_seg == 0){
+          if(vt->vt_type == CAR){
+            lane_car_go(&is->is_lane[lane]);
+          }
+          if(!evlogOn){
+            kprintf("%s%-5s %-2lu %s", is->is_tag, name, vt->vt_number, msg[0]);
+          }
+        }
+        else{
+          prev = &is->is_seg[rt->rt_segs[vt->vt_seg - 1]];
+          if(!evlogOn){
+            kprintf("%s%-5s %-2lu %s", is->is_tag, name, vt->vt_number,
+                msg[vt->vt_seg]);
+          }
+          lock_release_task(&prev->sg_lock, tk);
+        }
+        if(++vt->vt_seg < rt->rt_nsegs){
+          // On to the next segment, still holding this one.
+          vt->vt_state = VT_SEG;
+          continue;
+        }
+        vehicle_move(is, rt, rt->rt_nsegs, vt->vt_number, vt->vt_type);
+        if(!evlogOn){
+          kprintf("%s%-5s %-2lu %s", is->is_tag, name, vt->vt_number,
+              msg[rt->rt_nsegs]);
+        }
+        lock_release_task(&seg->sg_lock, tk);
+        if(rt->rt_admit){
+          V(is->is_admit);
+        }
+        counter_inc(is->is_turns[vt->vt_turn]);
+        return vehicletask_exit(vt);
+      case VT_EXIT:
+        return vehicletask_exit(vt);
+    }
+    panic("vehicletask_step: bad state %d\n", vt->vt_state);
+  }
+  return TASK_DONE;
+}
+
+/*
+ * Runs up to NVEHICLETASKS vehicles as tasks, arriving as WL says,
+ * and waits for all of them. The grid must already exist.
+ */
+static void runvehicletasks(struct workload *wl, int nvehicletasks){
+  struct taskrunner *runner;
+  struct vehicletask *vehicles;
+  struct arrival ar;
+  int index;
+
+  vehicles = kmalloc(nvehicletasks * sizeof(struct vehicletask));
+  if(vehicles == NULL){
+    panic("runvehicletasks: out of memory\n");
+  }
+  runner = taskrunner_create("vehicle carrier", NCARRIERS);
+  if(runner == NULL){
+    panic("runvehicletasks: taskrunner_create failed\n");
+  }
+
+  runStart = timestamp_us();
+  for(index = 0; index < nvehicletasks; index++){
+    struct vehicletask *vt = &vehicles[index];
+    if(arrivals_take(wl, &ar, 1) == 0){
+      break;
+    }
+    // With lane caps, hold each one back here until it's due and admitted.
+    if(laneCap > 0 && !arrival_admit(&ar)){
+      continue;
+    }
+    vt->vt_is = grid[ar.ar_intersection];
+    vt->vt_number = index;
+    vt->vt_lane = ar.ar_lane;
+    vt->vt_turn = (ar.ar_turn == WL_ANYTURN) ? pickTurn() : ar.ar_turn;
+    vt->vt_type = ar.ar_type;
+    vt->vt_state = VT_ARRIVE;
+    vt->vt_seg = 0;
+    vt->vt_due = ar.ar_time;
+    vt->vt_aged = 0;
+    task_init(&vt->vt_task, vehicletask_step, vt);
+    taskrunner_submit(runner, &vt->vt_task);
+  }
+
+  taskrunner_wait(runner);
+  taskrunner_destroy(runner);
+  kfree(vehicles);
+}
+
+/*
+ * Aggregator thread. Takes the vehicles' completion records off the
+ * queue and totals them up until it finds the end marker.
+ */
+static void aggregator(void *unusedpointer, unsigned long unusednumber){
+	struct crossing *cr;
+
+	(void) unusedpointer;
+	(void) unusednumber;
+
+	for (;;) {
+		P(crossingsReady);
+		// The push that matched the V may not have finished linking.
+		while ((cr = (struct crossing *)mpscq_pop(&crossingQueue)) == NULL) {
+			thread_yield();
+		}
+		if (cr->cr_vehicle < 0) {
+			break;
+		}
+
+		histogram_add(&waitHist[cr->cr_type], cr->cr_enter - cr->cr_arrive);
+		histogram_add(transitHistFor(cr->cr_lane, cr->cr_turn, cr->cr_type),
+			cr->cr_exit - cr->cr_arrive);
+	}
+	V(aggregatorDone);
+}
+
+/*
+ * Prints the latency percentiles, in microseconds: segment lock waits
+ * over the whole grid, then what the aggregator collected (vehicle
+ * threads only). Empty histograms are skipped.
+ */
+static void printLatency(void){
+	struct histogram *lockHist;
+	char label[40];
+	int id, i, lane, turn, t;
+
+	lockHist = kmalloc(sizeof(struct histogram));
+	if (lockHist == NULL) {
+		panic("printLatency: out of memory\n");
+	}
+	histogram_init(lockHist);
+	for (id = 0; id < numIntersections; id++) {
+		for (i = 0; i < numWays; i++) {
+			histogram_merge(lockHist, &grid[id]->is_seg[i].sg_waithist);
+		}
+	}
+	kprintf("Latency (us):\n");
+	histogram_print(lockHist, "segment lock wait");
+	kfree(lockHist);
+
+	if (admitHist.h_count > 0) {
+		histogram_print(&admitHist, "admission wait");
+	}
+	for (t = CAR; t <= TRUCK; t++) {
+		if (waitHist[t].h_count > 0) {
+			snprintf(label, sizeof(label), "%s wait", type[t]);
+			histogram_print(&waitHist[t], label);
+		}
+	}
+	for (lane = 0; lane < numWays; lane++) {
+		for (turn = 0; turn < NUMTURNS; turn++) {
+			for (t = CAR; t <= TRUCK; t++) {
+				struct histogram *h = transitHistFor(lane, turn, t);
+				if (h->h_count == 0) {
+					continue;
+				}
+				snprintf(label, sizeof(label), "%c %-8s %-5s transit",
+					charLane[lane], stringDirection[turn], type[t]);
+				histogram_print(h, label);
+			}
+		}
+	}
+}
+
+/*
+ * Snapshots.
+ *
+ * A snapshot is a consistent picture of one intersection at some
+ * instant of the run: who is on each segment, how many vehicles are
+ * queued in each lane, and the state of every vehicle there, from
+ * which the waiters for each segment lock and for admission can be
+ * read off. snapshot_take() doesn't take any lock or write anything
+ * the vehicles use, so a monitor can sample as often as it likes; it
+ * just copies again if a vehicle changed something while it copied.
+ */
+struct snapshot {
+	int sn_intersection;
+	int sn_status[MAXWAYS];           // each segment's sg_status
+	int sn_queued[MAXWAYS];           // vehicles waiting in each lane
+	int sn_nvehicles;                 // vehicles at the intersection
+	struct vehiclestate *sn_vehicles; // room for numVehicleStates
+};
+
+/*
+ * Fills in SN for intersection IS. Returns how many times it had to
+ * start over.
+ */
+static int snapshot_take(struct intersection *is, struct snapshot *sn){
+	struct vehiclestate *vs, *copy;
+	int ticket, vticket, retries, i, n;
+
+	sn->sn_intersection = is->is_id;
+	for (retries = 0; ; retries++) {
+		ticket = seqlock_read_begin(&is->is_seq);
+		for (i = 0; i < numWays; i++) {
+			sn->sn_status[i] = is->is_seg[i].sg_status;
+		}
+		// Vehicles at other intersections write their entries
+		// outside is_seq, so copy each under its own seqlock and
+		// only then look at where it is.
+		n = 0;
+		for (i = 0; i < numVehicleStates; i++) {
+			vs = &vehicleStates[i];
+			copy = &sn->sn_vehicles[n];
+			do {
+				vticket = seqlock_read_begin(&vs->vs_seq);
+				*copy = *vs;
+			} while (seqlock_read_retry(&vs->vs_seq, vticket));
+			if (copy->vs_intersection == is->is_id &&
+			    copy->vs_state != VS_NONE) {
+				n++;
+			}
+		}
+		if (!seqlock_read_retry(&is->is_seq, ticket)) {
+			break;
+		}
+	}
+	sn->sn_nvehicles = n;
+
+	// A vehicle is queued until it gets onto its first segment.
+	for (i = 0; i < numWays; i++) {
+		sn->sn_queued[i] = 0;
+	}
+	for (i = 0; i < n; i++) {
+		vs = &sn->sn_vehicles[i];
+		if (vs->vs_state != VS_ONSEG && vs->vs_step == 0) {
+			sn->sn_queued[vs->vs_lane]++;
+		}
+	}
+	return retries;
+}
+
+#define MONITORLINE 160
+
+/*
+ * Appends STR to a monitor line of LEN characters, dropping whatever
+ * doesn't fit. Returns the new length.
+ */
+static int monitor_append(char *line, int len, const char *str){
+	while (len < MONITORLINE - 1 && *str != 0) {
+		line[len++] = *str++;
+	}
+	line[len] = 0;
+	return len;
+}
+
+/*
+ * Prints a snapshot as two lines: each segment with the vehicle on it
+ * ("-" if open) and its waiters after "<", then each lane's queue and
+ * the vehicles waiting for admission. Vehicles are C or T and their
+ * number.
+ */
+static void snapshot_print(const struct snapshot *sn){
+	const struct vehiclestate *vs;
+	char line[MONITORLINE], word[24];
+	int len, i, v, status;
+
+	len = monitor_append(line, 0, grid[sn->sn_intersection]->is_tag);
+	len = monitor_append(line, len, "MONITOR");
+	for (i = 0; i < numWays; i++) {
+		status = sn->sn_status[i];
+		if (status & SEG_CLOSED) {
+			snprintf(word, sizeof(word), " %s:%c%d", intersection[i],
+				(status & SEG_TRUCK) ? 'T' : 'C',
+				status & SEG_VEHICLE);
+		}
+		else {
+			snprintf(word, sizeof(word), " %s:-", intersection[i]);
+		}
+		len = monitor_append(line, len, word);
+		for (v = 0; v < sn->sn_nvehicles; v++) {
+			vs = &sn->sn_vehicles[v];
+			if (vs->vs_state == VS_WAITSEG &&
+			    routes[vs->vs_lane][vs->vs_turn].rt_segs[vs->vs_step] == i) {
+				snprintf(word, sizeof(word), "<%c%d",
+					vs->vs_type == TRUCK ? 'T' : 'C',
+					vs->vs_number);
+				len = monitor_append(line, len, word);
+			}
+		}
+	}
+	kprintf("%s\n", line);
+
+	len = monitor_append(line, 0, grid[sn->sn_intersection]->is_tag);
+	len = monitor_append(line, len, "MONITOR queued");
+	for (i = 0; i < numWays; i++) {
+		snprintf(word, sizeof(word), " %c:%d", charLane[i], sn->sn_queued[i]);
+		len = monitor_append(line, len, word);
+	}
+	len = monitor_append(line, len, " admit");
+	for (v = 0; v < sn->sn_nvehicles; v++) {
+		vs = &sn->sn_vehicles[v];
+		if (vs->vs_state == VS_ADMIT) {
+			snprintf(word, sizeof(word), "<%c%d",
+				vs->vs_type == TRUCK ? 'T' : 'C', vs->vs_number);
+			len = monitor_append(line, len, word);
+		}
+	}
+	kprintf("%s\n", line);
+}
+
+static volatile int monitorStop;
+static struct semaphore *monitorDone;
+
+/*
+ * Monitor thread for "monitor MS". Snapshots every intersection as
+ * fast as it can, yielding in between, and prints the snapshots every
+ * MS milliseconds until monitorStop is set.
+ */
+static void monitor(void *unusedpointer, unsigned long periodms){
+	struct snapshot sn;
+	u_int32_t last, now;
+	unsigned long samples = 0, retries = 0;
+	int id, print;
+
+	(void) unusedpointer;
+
+	sn.sn_vehicles = kmalloc(numVehicleStates * sizeof(struct vehiclestate));
+	if (sn.sn_vehicles == NULL) {
+		panic("monitor: out of memory\n");
+	}
+
+	last = timestamp_us();
+	while (!monitorStop) {
+		now = timestamp_us();
+		print = (now - last >= periodms * 1000);
+		if (print) {
+			last = now;
+		}
+		for (id = 0; id < numIntersections; id++) {
+			retries += snapshot_take(grid[id], &sn);
+			samples++;
+			if (print) {
+				snapshot_print(&sn);
+			}
+		}
+		thread_yield();
+	}
+
+	kprintf("Monitor: %lu snapshots, %lu retried\n", samples, retries);
+	kfree(sn.sn_vehicles);
+	V(monitorDone);
+}
+
+/*
+ * Starts NVEHICLES approachintersection() threads (fewer if a trace
+ * runs out first), each as its arrival from WL comes due (see
+ * arrival_admit()), and waits for all of them, with an aggregator
+ * thread collecting their latencies. The grid must already exist.
+ */
+static void runvehiclethreads(struct workload *wl, int nvehicles){
+	int index, error;
+	struct thread_opts opts;
+	struct crossing endMarker;
+
+	// A route only ever heads east or south, so this bounds a trip.
+	maxCrossings = gridRows + gridCols - 1;
+	arrivals = kmalloc(nvehicles * sizeof(struct arrival));
+	crossings = kmalloc(nvehicles * maxCrossings * sizeof(struct crossing));
+	crossingsReady = sem_create("crossingsReady", 0);
+	aggregatorDone = sem_create("aggregatorDone", 0);
+	if (arrivals == NULL || crossings == NULL || crossingsReady == NULL ||
+	    aggregatorDone == NULL) {
+		panic("runvehiclethreads: out of memory\n");
+	}
+	mpscq_init(&crossingQueue);
+	threadlist_init(&admitWait);
+
+	// Read them all first, so no vehicle waits on the trace file.
+	nvehicles = arrivals_take(wl, arrivals, nvehicles);
+
+	error = thread_fork("aggregator", NULL, 0, aggregator, NULL);
+	if (error) {
+		panic("aggregator: thread_fork failed: %s\n", strerror(error));
+	}
+
+  /*
+	 * Start the approachintersection() threads. Vehicles only
+	 * run a few shallow calls, so they get small stacks.
+	 */
+	opts.to_stackclass = TSTACK_SMALL;
+	opts.to_priority = TPRI_NORMAL;
+
+	runStart = timestamp_us();
+	for (index = 0; index < nvehicles; index++) {
+
+		// Each vehicle starts when it is due, unless it's turned away.
+		if (!arrival_admit(&arrivals[index])) {
+			continue;
+		}
+
+		error = thread_fork_opts("approachintersection thread",
+				NULL,
+				index,
+				approachintersection,
+				&opts,
+				NULL
+				);
+
+		/*
+		 * panic() on error.
+		 */
+
+		if (error) {
+
+			panic("approachintersection: thread_fork failed: %s\n",
+					strerror(error)
+				 );
+		}
+	}
+
+	//BUSY WAIT SOLUTION
+	//Waits until all of the threads are executed.
+	while(counter_read(countVehicles) + counter_read(countDropped) < nvehicles){
+    thread_yield();
+	}
+
+	// Every record is in; tell the aggregator to finish up.
+	endMarker.cr_vehicle = -1;
+	mpscq_push(&crossingQueue, &endMarker.cr_node);
+	V(crossingsReady);
+	P(aggregatorDone);
+
+	sem_destroy(crossingsReady);
+	sem_destroy(aggregatorDone);
+	threadlist_cleanup(&admitWait);
+	kfree(crossings);
+	crossings = NULL;
+	kfree(arrivals);
+	arrivals = NULL;
+}
+
+/*
+ * Discrete-event engine.
+ *
+ * "sp1 sim N" runs N vehicles through the same grid, route table and
+ * rules as the threads, but as a simulation in virtual time, so the
+ * results depend only on the traffic rules and not on the scheduler.
+ * Each vehicle has one pending event at a time, handled in time order:
+ *
+ *      SV_ARRIVE  - it reaches a lane and joins the queue there.
+ *      SV_CROSS   - it comes to the end of step sv_step of its route,
+ *                   freeing that segment; after the last step it
+ *                   leaves the intersection.
+ *
+ * The rules are the threaded ones: a truck waits while there are cars
+ * queued in its lane until it has waited truckMaxWait, and then goes
+ * ahead of them (checked whenever something happens at the
+ * intersection, so it may be a little late), a route through more
+ * than one segment needs a
+ * unit of admission, and a vehicle starts only once every segment of
+ * its route is free (as in acquireSegments()), spending SIM_SEGUSECS
+ * on each. Lanes get the first chance to start in turn. Getting from
+ * one intersection to the next takes SIM_LINKUSECS.
+ *
+ * Vehicles arrive as the workload says (see workload.h); by default
+ * as a Poisson process. At most SIM_POOL vehicles are on the road at
+ * once, in records that are reused as vehicles leave the grid, so
+ * once running the engine allocates nothing. An arrival that finds
+ * every record in use is held back until one comes free, and its wait
+ * counts from when it should have arrived. With lane caps (see
+ * lane_room_take()), the source likewise holds back, or drops, an
+ * arrival whose lane already has laneCap vehicles sent to it and not
+ * yet through; vehicles going on from one intersection to the next
+ * aren't held, since the pool bounds them already. Virtual time is a u_int32_t
+ * count of microseconds, which limits a run to about 71 minutes of
+ * traffic.
+ *
+ * Shards. "shards K" splits the grid into K blocks of intersections,
+ * each simulated by its own thread with its own event heap (see
+ * minheap.h). A vehicle driving into another shard's block is handed
+ * over through a bounded lock-free mailbox. The shards advance in
+ * windows: a window runs from the earliest pending event anywhere, T,
+ * to T + SIM_LINKUSECS, and since a hand-off is never due sooner than
+ * SIM_LINKUSECS after it is sent, nothing sent in a window can be due
+ * in it. Between windows the shards meet at a barrier and empty their
+ * mailboxes, and shard 0 injects the arrivals due in the next window;
+ * a window never runs past the next arrival it hasn't injected yet.
+ *
+ * Runs are deterministic and don't depend on K: each vehicle draws its
+ * random numbers from its own generator, and ties between events at
+ * the same time go by vehicle number, so every intersection sees the
+ * same events in the same order however the grid is split up.
+ */
+
+#define SIM_POOL          256
+#define SIM_SEGUSECS      1000
+#define SIM_LINKUSECS     500 // also the lookahead between shards
+#define SIM_MAXSHARDS     8
+#define SIM_BATCH         64
+#define SIM_NEVER         0xffffffff
+
+#define SV_ARRIVE 0
+#define SV_CROSS  1
+
+struct simvehicle {
+	struct heapnode sv_event;   // must be first
+	struct simvehicle *sv_next; // lane queue, or list of free records
+	u_int32_t sv_rand;          // this vehicle's random number state
+	int sv_number;
+	int sv_intersection;
+	int sv_lane;
+	int sv_turn;
+	int sv_type;
+	int sv_state;
+	int sv_step;
+	u_int32_t sv_arrive;        // when it arrives (or should have) here
+};
+
+// A lane's queues: cars and trucks, each oldest first.
+struct simlane {
+	struct simvehicle *sl_head[2];
+	struct simvehicle *sl_tail[2];
+	volatile int sl_inflight; // sent here and not yet through
+};
+
+struct simintersection {
+	int si_busy[MAXWAYS]; // segments in use
+	int si_free;          // admission units left
+	int si_rotor;         // lane to look at first
+	struct simlane si_lane[MAXWAYS];
+};
+
+/*
+ * Mailbox from one shard to another: a single-producer,
+ * single-consumer ring of the vehicles handed over. There are only
+ * SIM_POOL vehicle records, so it can never fill up.
+ */
+struct simmailbox {
+	volatile unsigned mb_head; // next to take; consumer only
+	volatile unsigned mb_tail; // next to fill; producer only
+	struct simvehicle *mb_slots[SIM_POOL];
+} CACHELINE_ALIGNED;
+
+struct simsample {
+	struct histogram *ss_hist;
+	u_int32_t ss_value;
+};
+
+struct simshard {
+	struct minheap sh_events;
+	int sh_id;
+	u_int32_t sh_next;  // earliest pending event, published between windows
+	u_int32_t sh_now;
+	unsigned long sh_events_done;
+	int sh_crossings;
+	struct simvehicle *sh_free; // records of vehicles that left the grid
+	// Latencies not yet added to the shared histograms.
+	int sh_nsamples;
+	struct simsample sh_samples[SIM_BATCH];
+} CACHELINE_ALIGNED;
+
+struct sim {
+	int sm_nshards;
+	int sm_total;                    // vehicles to run
+	int sm_npool;
+	struct simvehicle *sm_pool;
+	struct workload *sm_wl;          // the source; shard 0 only
+	int sm_arrived;                  // vehicles taken from it
+	int sm_held;                     // ... that had to wait for a record
+	int sm_dropped;                  // ... that were turned away
+	int sm_blocked;                  // sm_next waited for room in its lane
+	int sm_behind;                   // ... and the ones after it are late
+	int sm_pending;                  // sm_next is yet to be injected
+	struct arrival sm_next;
+	u_int32_t sm_srcnext;            // windows end here, at the latest
+	struct simintersection *sm_is;
+	struct simshard *sm_shards;
+	struct simmailbox *sm_mail;      // [from * sm_nshards + to]
+	struct lock sm_statslock;        // for waitHist and transitHist
+	struct lock sm_barrierlock;
+	struct cv *sm_barriercv;
+	int sm_barriercount;
+	int sm_barriergen;
+	struct semaphore *sm_done;
+};
+
+// The shard simulating intersection ID.
+static int sim_shardof(struct sim *sm, int id){
+	return id * sm->sm_nshards / numIntersections;
+}
+
+// xorshift32: the vehicle's next random number.
+static u_int32_t sim_random(struct simvehicle *sv){
+	u_int32_t x = sv->sv_rand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sv->sv_rand = x;
+	return x;
+}
+
+// pickTurn(), from the vehicle's own random numbers.
+static int sim_pickturn(struct simvehicle *sv){
+	int turn;
+
+	do {
+		turn = sim_random(sv) % NUMTURNS;
+	} while (turn_segments(turn) == 0);
+	return turn;
+}
+
+static void mailbox_put(struct simmailbox *mb, struct simvehicle *sv){
+	unsigned tail = mb->mb_tail;
+
+	assert(tail - mb->mb_head < SIM_POOL);
+	mb->mb_slots[tail % SIM_POOL] = sv;
+	membar(); // the slot before the tail that covers it
+	mb->mb_tail = tail + 1;
+}
+
+static struct simvehicle *mailbox_get(struct simmailbox *mb){
+	struct simvehicle *sv;
+	unsigned head = mb->mb_head;
+
+	if (head == mb->mb_tail) {
+		return NULL;
+	}
+	membar(); // the tail before the slot it covers
+	sv = mb->mb_slots[head % SIM_POOL];
+	membar(); // done with the slot before giving it back
+	mb->mb_head = head + 1;
+	return sv;
+}
+
+/*
+ * Schedule SV's arrival at sv_intersection at time WHEN. FROM is the
+ * shard sending it, or -1 for the source, which only runs while no
+ * shard is in a window.
+ */
+static void sim_send(struct sim *sm, int from, struct simvehicle *sv,
+		u_int32_t when){
+	int to = sim_shardof(sm, sv->sv_intersection);
+
+	atomic_fetch_add(&sm->sm_is[sv->sv_intersection].si_lane[sv->sv_lane].sl_inflight, 1);
+	sv->sv_state = SV_ARRIVE;
+	if (from < 0 || from == to) {
+		minheap_push_ordered(&sm->sm_shards[to].sh_events, &sv->sv_event,
+			when, sv->sv_number);
+	}
+	else {
+		sv->sv_event.hn_key = when;
+		mailbox_put(&sm->sm_mail[from * sm->sm_nshards + to], sv);
+	}
+}
+
+/*
+ * Inject the arrivals due before the end of the window after the one
+ * ending at WINDOW, into records of vehicles that have left the grid.
+ * None is due before WINDOW, since that much has been simulated
+ * already. Sets sm_srcnext to where the next window must stop, so the
+ * source can catch up. Shard 0 calls this between windows, and
+ * simulate() before the first.
+ */
+static void sim_inject(struct sim *sm, u_int32_t window){
+	struct simvehicle *sv, *free = NULL;
+	struct arrival *ar = &sm->sm_next;
+	int i, result;
+
+	for (i = 0; i < sm->sm_nshards; i++) {
+		while ((sv = sm->sm_shards[i].sh_free) != NULL) {
+			sm->sm_shards[i].sh_free = sv->sv_next;
+			sv->sv_next = free;
+			free = sv;
+		}
+	}
+
+	for (;;) {
+		if (!sm->sm_pending) {
+			if (sm->sm_arrived == sm->sm_total) {
+				break;
+			}
+			result = workload_next(sm->sm_wl, ar);
+			if (result) {
+				// The trace is done (or bad): so is the run.
+				if (result != ENOENT) {
+					kprintf("workload: %s\n", strerror(result));
+				}
+				sm->sm_total = sm->sm_arrived;
+				break;
+			}
+			arrival_fold(ar);
+			sm->sm_pending = 1;
+		}
+		if (ar->ar_time >= window + SIM_LINKUSECS || free == NULL) {
+			break;
+		}
+		// Lane admission, as the lane stands at the end of this window.
+		if (laneCap > 0 && sm->sm_is[ar->ar_intersection].
+		    si_lane[ar->ar_lane].sl_inflight >= laneCap) {
+			if (admitPolicy == ADMIT_DROP) {
+				counter_inc(countDropped);
+				sm->sm_arrived++;
+				sm->sm_dropped++;
+				sm->sm_pending = 0;
+				continue;
+			}
+			sm->sm_blocked = 1;
+			sm->sm_behind = 1;
+			break;
+		}
+
+		sv = free;
+		free = sv->sv_next;
+		sv->sv_number = sm->sm_arrived++;
+		sv->sv_rand = (sv->sv_number + 1) * 2654435761U;
+		sv->sv_intersection = ar->ar_intersection;
+		sv->sv_lane = ar->ar_lane;
+		sv->sv_turn = ar->ar_turn;
+		sv->sv_type = ar->ar_type;
+		sv->sv_arrive = ar->ar_time;
+		if (sm->sm_blocked) {
+			counter_inc(countBlocked);
+			sm->sm_blocked = 0;
+		}
+		else if (ar->ar_time >= window) {
+			sm->sm_behind = 0;
+		}
+		else if (!sm->sm_behind) {
+			sm->sm_held++;
+		}
+		if (laneCap > 0) {
+			histogram_add(&admitHist,
+				ar->ar_time < window ? window - ar->ar_time : 0);
+		}
+		sim_send(sm, -1, sv, ar->ar_time < window ? window : ar->ar_time);
+		sm->sm_pending = 0;
+	}
+	sm->sm_shards[0].sh_free = free;
+
+	if (!sm->sm_pending) {
+		sm->sm_srcnext = SIM_NEVER;
+	}
+	else if (ar->ar_time < window + SIM_LINKUSECS) {
+		// Held: try again after the next window.
+		sm->sm_srcnext = window + SIM_LINKUSECS;
+	}
+	else {
+		sm->sm_srcnext = ar->ar_time;
+	}
+}
+
+// Add everything in SH's sample batch to the shared histograms.
+static void sim_flush(struct sim *sm, struct simshard *sh){
+	int i;
+
+	if (sh->sh_nsamples == 0) {
+		return;
+	}
+	lock_acquire(&sm->sm_statslock);
+	for (i = 0; i < sh->sh_nsamples; i++) {
+		histogram_add(sh->sh_samples[i].ss_hist, sh->sh_samples[i].ss_value);
+	}
+	lock_release(&sm->sm_statslock);
+	sh->sh_nsamples = 0;
+}
+
+static void sim_record(struct sim *sm, struct simshard *sh,
+		struct histogram *h, u_int32_t value){
+	if (sh->sh_nsamples == SIM_BATCH) {
+		sim_flush(sm, sh);
+	}
+	sh->sh_samples[sh->sh_nsamples].ss_hist = h;
+	sh->sh_samples[sh->sh_nsamples].ss_value = value;
+	sh->sh_nsamples++;
+}
+
+/*
+ * Start whatever vehicles can start at intersection ID, lanes taking
+ * turns at going first, until nothing more can.
+ */
+static void sim_dispatch(struct sim *sm, struct simshard *sh, int id){
+	struct simintersection *si = &sm->sm_is[id];
+	struct simvehicle *sv;
+	struct simlane *sl;
+	const struct route *rt;
+	int started, k, lane, q, i;
+
+	do {
+		started = 0;
+		for (k = 0; k < numWays; k++) {
+			lane = (si->si_rotor + k) % numWays;
+			sl = &si->si_lane[lane];
+			// Trucks yield to the lane's cars, until they age.
+			q = (sl->sl_head[CAR] != NULL) ? CAR : TRUCK;
+			if (q == CAR && sl->sl_head[TRUCK] != NULL && truckMaxWait > 0 &&
+			    sh->sh_now - sl->sl_head[TRUCK]->sv_arrive >= truckMaxWait) {
+				q = TRUCK;
+			}
+			sv = sl->sl_head[q];
+			if (sv == NULL) {
+				continue;
+			}
+			rt = &routes[lane][sv->sv_turn];
+			if (rt->rt_admit && si->si_free == 0) {
+				continue;
+			}
+			for (i = 0; i < rt->rt_nsegs; i++) {
+				if (si->si_busy[rt->rt_segs[i]]) {
+					break;
+				}
+			}
+			if (i < rt->rt_nsegs) {
+				continue;
+			}
+
+			sl->sl_head[q] = sv->sv_next;
+			if (sl->sl_head[q] == NULL) {
+				sl->sl_tail[q] = NULL;
+			}
+			if (rt->rt_admit) {
+				si->si_free--;
+			}
+			for (i = 0; i < rt->rt_nsegs; i++) {
+				si->si_busy[rt->rt_segs[i]] = 1;
+			}
+			sim_record(sm, sh, &waitHist[sv->sv_type],
+				sh->sh_now - sv->sv_arrive);
+			if (q == TRUCK && sl->sl_head[CAR] != NULL) {
+				counter_inc(countAged);
+			}
+			vehicle_log(EV_ENTER, sh->sh_now, sv->sv_number, sv->sv_type, id,
+				lane, sv->sv_turn, rt->rt_segs[0], 0);
+			sv->sv_state = SV_CROSS;
+			sv->sv_step = 0;
+			minheap_push_ordered(&sh->sh_events, &sv->sv_event,
+				sh->sh_now + SIM_SEGUSECS, sv->sv_number);
+			si->si_rotor = (lane + 1) % numWays;
+			started = 1;
+		}
+	} while (started);
+}
+
+/*
+ * Handle vehicle SV's event, on shard SH.
+ */
+static void sim_event(struct sim *sm, struct simshard *sh, struct simvehicle *sv){
+	struct simintersection *si = &sm->sm_is[sv->sv_intersection];
+	struct intersection *is = grid[sv->sv_intersection];
+	const struct route *rt;
+	struct simlane *sl;
+	int id = sv->sv_intersection;
+
+	switch (sv->sv_state) {
+	    case SV_ARRIVE:
+		if (sv->sv_turn == WL_ANYTURN) {
+			sv->sv_turn = sim_pickturn(sv);
+		}
+		vehicle_log(EV_ARRIVE, sh->sh_now, sv->sv_number, sv->sv_type, id,
+			sv->sv_lane, sv->sv_turn, EV_NOSEG, 0);
+		sv->sv_next = NULL;
+		sl = &si->si_lane[sv->sv_lane];
+		if (sl->sl_tail[sv->sv_type] != NULL) {
+			sl->sl_tail[sv->sv_type]->sv_next = sv;
+		}
+		else {
+			sl->sl_head[sv->sv_type] = sv;
+		}
+		sl->sl_tail[sv->sv_type] = sv;
+		break;
+
+	    case SV_CROSS:
+		rt = &routes[sv->sv_lane][sv->sv_turn];
+		si->si_busy[rt->rt_segs[sv->sv_step]] = 0;
+		if (++sv->sv_step < rt->rt_nsegs) {
+			vehicle_log(EV_MOVE, sh->sh_now, sv->sv_number, sv->sv_type, id,
+				sv->sv_lane, sv->sv_turn, rt->rt_segs[sv->sv_step],
+				sv->sv_step);
+			minheap_push_ordered(&sh->sh_events, &sv->sv_event,
+				sh->sh_now + SIM_SEGUSECS, sv->sv_number);
+			break;
+		}
+		vehicle_log(EV_LEAVE, sh->sh_now, sv->sv_number, sv->sv_type, id,
+			sv->sv_lane, sv->sv_turn, rt->rt_segs[sv->sv_step - 1],
+			sv->sv_step);
+
+		// Through the intersection.
+		if (rt->rt_admit) {
+			si->si_free++;
+		}
+		atomic_fetch_add(&si->si_lane[sv->sv_lane].sl_inflight, -1);
+		sim_record(sm, sh, transitHistFor(sv->sv_lane, sv->sv_turn, sv->sv_type),
+			sh->sh_now - sv->sv_arrive);
+		counter_inc(is->is_turns[sv->sv_turn]);
+		sh->sh_crossings++;
+
+		if (is->is_next[rt->rt_exit] != NULL) {
+			sv->sv_lane = is->is_nextlane[rt->rt_exit];
+			sv->sv_intersection = is->is_next[rt->rt_exit]->is_id;
+			sv->sv_turn = WL_ANYTURN;
+			sv->sv_arrive = sh->sh_now + SIM_LINKUSECS;
+			sim_send(sm, sh->sh_id, sv, sv->sv_arrive);
+		}
+		else {
+			// Off the grid: the record is free for the source.
+			sv->sv_next = sh->sh_free;
+			sh->sh_free = sv;
+		}
+		break;
+
+	    default:
+		panic("sim_event: bad state %d\n", sv->sv_state);
+	}
+	sim_dispatch(sm, sh, id);
+}
+
+// Wait until every shard has got here.
+static void sim_barrier(struct sim *sm){
+	int gen;
+
+	lock_acquire(&sm->sm_barrierlock);
+	gen = sm->sm_barriergen;
+	if (++sm->sm_barriercount == sm->sm_nshards) {
+		sm->sm_barriercount = 0;
+		sm->sm_barriergen++;
+		cv_broadcast(sm->sm_barriercv, &sm->sm_barrierlock);
+	}
+	else {
+		while (gen == sm->sm_barriergen) {
+			cv_wait(sm->sm_barriercv, &sm->sm_barrierlock);
+		}
+	}
+	lock_release(&sm->sm_barrierlock);
+}
+
+/*
+ * Shard thread. Runs windows until no shard has anything left to do.
+ */
+static void sim_shard(void *data, unsigned long shardid){
+	struct sim *sm = data;
+	struct simshard *sh = &sm->sm_shards[shardid];
+	struct simvehicle *sv;
+	struct heapnode *ev;
+	u_int32_t window;
+	int from;
+
+	for (;;) {
+		// Take in the hand-offs, in a fixed order.
+		for (from = 0; from < sm->sm_nshards; from++) {
+			struct simmailbox *mb =
+				&sm->sm_mail[from * sm->sm_nshards + sh->sh_id];
+			while ((sv = mailbox_get(mb)) != NULL) {
+				minheap_push_ordered(&sh->sh_events, &sv->sv_event,
+					sv->sv_event.hn_key, sv->sv_number);
+			}
+		}
+		ev = minheap_peek(&sh->sh_events);
+		sh->sh_next = (ev != NULL) ? ev->hn_key : SIM_NEVER;
+		sim_barrier(sm);
+
+		window = sm->sm_srcnext;
+		for (from = 0; from < sm->sm_nshards; from++) {
+			if (sm->sm_shards[from].sh_next < window) {
+				window = sm->sm_shards[from].sh_next;
+			}
+		}
+		if (window == SIM_NEVER) {
+			break;
+		}
+		window += SIM_LINKUSECS;
+		if (window > sm->sm_srcnext) {
+			window = sm->sm_srcnext;
+		}
+
+		while ((ev = minheap_peek(&sh->sh_events)) != NULL &&
+		       ev->hn_key < window) {
+			minheap_pop(&sh->sh_events);
+			sh->sh_now = ev->hn_key;
+			sim_event(sm, sh, (struct simvehicle *)ev);
+			sh->sh_events_done++;
+		}
+		// Everything sent is in a mailbox before anyone empties one.
+		sim_barrier(sm);
+
+		// Nobody touches a heap while shard 0 injects into them.
+		if (sh->sh_id == 0) {
+			sim_inject(sm, window);
+		}
+		sim_barrier(sm);
+	}
+
+	sim_flush(sm, sh);
+	V(sm->sm_done);
+}
+
+// N things in MS milliseconds, per second, without overflowing 32 bits.
+static u_int32_t sim_persecond(u_int32_t n, u_int32_t ms){
+	return n / ms * 1000 + n % ms * 1000 / ms;
+}
+
+/*
+ * Runs up to NVEHICLES simulated vehicles, arriving as WL says,
+ * through the grid, which must already exist, on NSHARDS shard
+ * threads, and prints how long that took in virtual and real time.
+ * Returns the crossings per virtual second.
+ */
+static u_int32_t simulate(struct workload *wl, int nvehicles, int nshards){
+	struct sim *sm;
+	u_int32_t start, elapsed, end, rate;
+	unsigned long events;
+	int crossings, i, lane, error;
+
+	sm = kmalloc(sizeof(struct sim));
+	if (sm == NULL) {
+		panic("simulate: out of memory\n");
+	}
+	sm->sm_nshards = nshards;
+	sm->sm_total = nvehicles;
+	sm->sm_npool = (nvehicles < SIM_POOL) ? nvehicles : SIM_POOL;
+	sm->sm_pool = kmalloc(sm->sm_npool * sizeof(struct simvehicle));
+	sm->sm_wl = wl;
+	sm->sm_arrived = 0;
+	sm->sm_held = 0;
+	sm->sm_dropped = 0;
+	sm->sm_blocked = 0;
+	sm->sm_behind = 0;
+	sm->sm_pending = 0;
+	sm->sm_is = kmalloc(numIntersections * sizeof(struct simintersection));
+	sm->sm_shards = kmalloc(nshards * sizeof(struct simshard));
+	sm->sm_mail = kmalloc(nshards * nshards * sizeof(struct simmailbox));
+	sm->sm_barriercv = cv_create("sim barrier");
+	sm->sm_done = sem_create("sim done", 0);
+	if (sm->sm_pool == NULL || sm->sm_is == NULL || sm->sm_shards == NULL ||
+	    sm->sm_mail == NULL || sm->sm_barriercv == NULL || sm->sm_done == NULL ||
+	    lock_init(&sm->sm_statslock, "sim stats") ||
+	    lock_init(&sm->sm_barrierlock, "sim barrier")) {
+		panic("simulate: out of memory\n");
+	}
+	sm->sm_barriercount = 0;
+	sm->sm_barriergen = 0;
+
+	for (i = 0; i < numIntersections; i++) {
+		struct simintersection *si = &sm->sm_is[i];
+		for (lane = 0; lane < numWays; lane++) {
+			si->si_busy[lane] = 0;
+			si->si_lane[lane].sl_head[CAR] = NULL;
+			si->si_lane[lane].sl_head[TRUCK] = NULL;
+			si->si_lane[lane].sl_tail[CAR] = NULL;
+			si->si_lane[lane].sl_tail[TRUCK] = NULL;
+			si->si_lane[lane].sl_inflight = 0;
+		}
+		si->si_free = numWays - 1;
+		si->si_rotor = 0;
+	}
+	for (i = 0; i < nshards; i++) {
+		struct simshard *sh = &sm->sm_shards[i];
+		// Any shard may end up with every vehicle.
+		if (minheap_init(&sh->sh_events, sm->sm_npool)) {
+			panic("simulate: out of memory\n");
+		}
+		sh->sh_id = i;
+		sh->sh_now = 0;
+		sh->sh_events_done = 0;
+		sh->sh_crossings = 0;
+		sh->sh_free = NULL;
+		sh->sh_nsamples = 0;
+	}
+	for (i = 0; i < nshards * nshards; i++) {
+		sm->sm_mail[i].mb_head = 0;
+		sm->sm_mail[i].mb_tail = 0;
+	}
+	for (i = 0; i < sm->sm_npool; i++) {
+		sm->sm_pool[i].sv_next = sm->sm_shards[0].sh_free;
+		sm->sm_shards[0].sh_free = &sm->sm_pool[i];
+	}
+	sim_inject(sm, 0);
+
+	start = timestamp_us();
+	for (i = 0; i < nshards; i++) {
+		error = thread_fork("sim shard", sm, i, sim_shard, NULL);
+		if (error) {
+			panic("sim_shard: thread_fork failed: %s\n", strerror(error));
+		}
+	}
+	for (i = 0; i < nshards; i++) {
+		P(sm->sm_done);
+	}
+	elapsed = timestamp_us() - start;
+
+	end = 0;
+	events = 0;
+	crossings = 0;
+	for (i = 0; i < nshards; i++) {
+		struct simshard *sh = &sm->sm_shards[i];
+		if (sh->sh_now > end) {
+			end = sh->sh_now;
+		}
+		events += sh->sh_events_done;
+		crossings += sh->sh_crossings;
+		minheap_cleanup(&sh->sh_events);
+	}
+
+	rate = (end >= 1000) ? sim_persecond(crossings, end / 1000) : 0;
+	kprintf("Simulated %d vehicles: %d crossings in %u virtual ms",
+		sm->sm_arrived - sm->sm_dropped, crossings, end / 1000);
+	if (end >= 1000) {
+		kprintf(", %u/s", rate);
+	}
+	if (sm->sm_held > 0) {
+		kprintf("\n%d arrivals held back: already %d vehicles on the road",
+			sm->sm_held, sm->sm_npool);
+	}
+	kprintf("\n%d shard%s: %lu events in %u real ms", nshards,
+		nshards == 1 ? "" : "s", events, elapsed / 1000);
+	if (elapsed >= 1000) {
+		kprintf(", %u/s", sim_persecond(events, elapsed / 1000));
+	}
+	kprintf("\n");
+
+	lock_cleanup(&sm->sm_statslock);
+	lock_cleanup(&sm->sm_barrierlock);
+	cv_destroy(sm->sm_barriercv);
+	sem_destroy(sm->sm_done);
+	kfree(sm->sm_mail);
+	kfree(sm->sm_shards);
+	kfree(sm->sm_is);
+	kfree(sm->sm_pool);
+	kfree(sm);
+	return rate;
+}
+
+/*
+ * "sim N truckbench": the same traffic simulated with trucks never
+ * aging and then with shorter and shorter maximum waits, to show what
+ * bounding truck latency costs in throughput. Prints a table at the
+ * end; the latencies are then the last run's.
+ */
+static const u_int32_t benchWaits[] = { 0, 200000, 50000, 20000, 5000, 1000 };
+#define NBENCHWAITS (sizeof(benchWaits) / sizeof(benchWaits[0]))
+
+static void truckbench(struct workload *wl, int nvehicles, int nshards){
+	struct workload base = *wl;
+	u_int32_t rate[NBENCHWAITS], p99[NBENCHWAITS], max[NBENCHWAITS];
+	u_int32_t carp99[NBENCHWAITS];
+	int aged[NBENCHWAITS], before;
+	unsigned i;
+	int t;
+
+	for (i = 0; i < NBENCHWAITS; i++) {
+		// Same arrivals every time.
+		*wl = base;
+		truckMaxWait = benchWaits[i];
+		for (t = CAR; t <= TRUCK; t++) {
+			histogram_init(&waitHist[t]);
+		}
+		for (t = 0; t < numWays * NUMTURNS * 2; t++) {
+			histogram_init(&transitHist[t]);
+		}
+		histogram_init(&admitHist);
+		before = counter_read(countAged);
+		rate[i] = simulate(wl, nvehicles, nshards);
+		aged[i] = counter_read(countAged) - before;
+		p99[i] = histogram_permille(&waitHist[TRUCK], 990);
+		max[i] = waitHist[TRUCK].h_max;
+		carp99[i] = histogram_permille(&waitHist[CAR], 990);
+	}
+
+	kprintf("Truck aging: %d vehicles, %u/s, %u trucks in 1000\n",
+		nvehicles, base.wl_rate, base.wl_truckpermille);
+	kprintf("%10s %12s %12s %12s %10s %8s\n", "max wait", "truck p99",
+		"truck max", "car p99", "crossings", "aged");
+	for (i = 0; i < NBENCHWAITS; i++) {
+		if (benchWaits[i] == 0) {
+			kprintf("%10s", "never");
+		}
+		else {
+			kprintf("%10u", benchWaits[i]);
+		}
+		kprintf(" %12u %12u %12u %8u/s %8d\n", p99[i], max[i], carp99[i],
+			rate[i], aged[i]);
+	}
+}
+
+/*
+ * createvehicles()
+ *
+ * Arguments:
+ *      int nargs: number of arguments.
+ *      char ** args: options, any of
+ *              threads N        run N vehicle threads (1 to
+ *                               MAXVEHICLETHREADS; default NVEHICLES)
+ *              tasks N          run N stackless vehicles (see above)
+ *              grid ROWS COLS   simulate a ROWS x COLS grid
+ *              ways N           intersections of N lanes (3 to MAXWAYS)
+ *              uturns           let vehicles make U-turns
+ *              monitor MS       print snapshots every MS milliseconds
+ *              evlog FILE       log events to FILE (see evlog.h)
+ *                               instead of printing them
+ *              truckwait USECS  trucks wait at most about USECS for
+ *                               cars (0: for as long as there are any)
+ *              truckbench       with sim: compare truckwait settings
+ *              lanecap N        at most N vehicles in flight per lane
+ *              overload block|drop
+ *                               when a lane is full, hold new arrivals
+ *                               back (the default) or turn them away
+ *              sim N            simulate N vehicles in virtual time
+ *              shards K         ... on K threads (1 to SIM_MAXSHARDS)
+ *            and, for how vehicles arrive (see workload.h),
+ *              arrivals MODEL   burst (all at once; the default for
+ *                               threads and tasks), poisson (the
+ *                               default for sim) or bursty
+ *              rate R           R a second, across the grid
+ *                               (default WL_RATE)
+ *              burst F USECS    bursts F times the rate, USECS long
+ *              rush PEAK USECS  rush hours every USECS, PEAK times
+ *                               the rate at their height
+ *              skew W:W:...     lane weights
+ *              trucks PERMILLE  how many vehicles in 1000 are trucks
+ *              trace FILE       replay the arrivals in FILE
+ *              record FILE N    write N arrivals to FILE and stop
+ *
+ * Returns:
+ *      0 on success.
+ *
+ * Notes:
+ *      Driver code to start up the approachintersection() threads.  You are
+ *      free to modiy this code as necessary for your solution.
+ */
+
+int
+createvehicles(int nargs,
+		char ** args)
+{
+	int nvehiclethreads = 0, nvehicletasks = 0;
+	int simvehicles = 0, simshards = 1;
+	int rows = 1, cols = 1;
+	int monitorms = 0, error;
+	int i, id, turn, t;
+	int countTurns[NUMTURNS], total;
+	u_int32_t start, elapsed;
+	struct workload wl;
+	int model = -1, truckpermille = -1, recordn = 0;
+	u_int32_t rate = 0, burstfactor = 0, burstusecs = 0;
+	u_int32_t rushpeak = 0, rushusecs = 0;
+	const char *skew = NULL, *tracefile = NULL, *recordfile = NULL;
+	const char *evlogfile = NULL;
+	u_int32_t evrecords, evstalls;
+	int bench = 0, overload = -1;
+
+	numWays = 3;
+	uTurns = 0;
+	truckMaxWait = TRUCK_MAXWAIT;
+	laneCap = 0;
+	admitPolicy = ADMIT_BLOCK;
+	for (i = 1; i < nargs; i++) {
+		if (strcmp(args[i], "threads") == 0 && i + 1 < nargs) {
+			nvehiclethreads = atoi(args[++i]);
+			if (nvehiclethreads <= 0 ||
+			    nvehiclethreads > MAXVEHICLETHREADS) {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "tasks") == 0 && i + 1 < nargs) {
+			nvehicletasks = atoi(args[++i]);
+			if (nvehicletasks <= 0) {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "grid") == 0 && i + 2 < nargs) {
+			rows = atoi(args[++i]);
+			cols = atoi(args[++i]);
+			if (rows <= 0 || cols <= 0) {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "ways") == 0 && i + 1 < nargs) {
+			numWays = atoi(args[++i]);
+			if (numWays < 3 || numWays > MAXWAYS) {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "uturns") == 0) {
+			uTurns = 1;
+		}
+		else if (strcmp(args[i], "sim") == 0 && i + 1 < nargs) {
+			simvehicles = atoi(args[++i]);
+			if (simvehicles <= 0) {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "shards") == 0 && i + 1 < nargs) {
+			simshards = atoi(args[++i]);
+			if (simshards <= 0 || simshards > SIM_MAXSHARDS) {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "monitor") == 0 && i + 1 < nargs) {
+			monitorms = atoi(args[++i]);
+			if (monitorms <= 0) {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "truckwait") == 0 && i + 1 < nargs) {
+			t = atoi(args[++i]);
+			if (t < 0) {
+				goto usage;
+			}
+			truckMaxWait = t;
+		}
+		else if (strcmp(args[i], "truckbench") == 0) {
+			bench = 1;
+		}
+		else if (strcmp(args[i], "lanecap") == 0 && i + 1 < nargs) {
+			laneCap = atoi(args[++i]);
+			if (laneCap <= 0) {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "overload") == 0 && i + 1 < nargs) {
+			i++;
+			if (strcmp(args[i], "block") == 0) {
+				overload = ADMIT_BLOCK;
+			}
+			else if (strcmp(args[i], "drop") == 0) {
+				overload = ADMIT_DROP;
+			}
+			else {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "evlog") == 0 && i + 1 < nargs) {
+			evlogfile = args[++i];
+		}
+		else if (strcmp(args[i], "arrivals") == 0 && i + 1 < nargs) {
+			i++;
+			if (strcmp(args[i], "burst") == 0) {
+				model = WL_BURST;
+			}
+			else if (strcmp(args[i], "poisson") == 0) {
+				model = WL_POISSON;
+			}
+			else if (strcmp(args[i], "bursty") == 0) {
+				model = WL_BURSTY;
+			}
+			else {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "rate") == 0 && i + 1 < nargs) {
+			t = atoi(args[++i]);
+			if (t <= 0 || t > WL_MAXRATE) {
+				goto usage;
+			}
+			rate = t;
+		}
+		else if (strcmp(args[i], "burst") == 0 && i + 2 < nargs) {
+			t = atoi(args[++i]);
+			burstusecs = atoi(args[++i]);
+			if (t < 1 || t > WL_MAXFACTOR || burstusecs == 0) {
+				goto usage;
+			}
+			burstfactor = t;
+		}
+		else if (strcmp(args[i], "rush") == 0 && i + 2 < nargs) {
+			t = atoi(args[++i]);
+			rushusecs = atoi(args[++i]);
+			if (t < 1 || t > WL_MAXPEAK || rushusecs < 1000) {
+				goto usage;
+			}
+			rushpeak = t;
+		}
+		else if (strcmp(args[i], "skew") == 0 && i + 1 < nargs) {
+			skew = args[++i];
+		}
+		else if (strcmp(args[i], "trucks") == 0 && i + 1 < nargs) {
+			truckpermille = atoi(args[++i]);
+			if (truckpermille < 0 || truckpermille > 1000) {
+				goto usage;
+			}
+		}
+		else if (strcmp(args[i], "trace") == 0 && i + 1 < nargs) {
+			tracefile = args[++i];
+		}
+		else if (strcmp(args[i], "record") == 0 && i + 2 < nargs) {
+			recordfile = args[++i];
+			recordn = atoi(args[++i]);
+			if (recordn <= 0) {
+				goto usage;
+			}
+		}
+		else {
+			goto usage;
+		}
+	}
+	// The simulation has no threads to run tasks on or to watch.
+	if (simvehicles > 0 && (nvehicletasks > 0 || monitorms > 0)) {
+		goto usage;
+	}
+	// One way of running vehicles at a time.
+	if (nvehiclethreads > 0 && (nvehicletasks > 0 || simvehicles > 0)) {
+		goto usage;
+	}
+	if (nvehiclethreads == 0) {
+		nvehiclethreads = NVEHICLES;
+	}
+	if (simvehicles == 0 && simshards > 1) {
+		goto usage;
+	}
+	if (tracefile != NULL && recordfile != NULL) {
+		goto usage;
+	}
+	// The benchmark replays the same arrivals for each setting.
+	if (bench && (simvehicles == 0 || tracefile != NULL)) {
+		goto usage;
+	}
+	if (overload >= 0) {
+		if (laneCap == 0) {
+			goto usage;
+		}
+		admitPolicy = overload;
+	}
+
+	workload_init(&wl, rows * cols, numWays);
+	if (model >= 0) {
+		wl.wl_model = model;
+	}
+	else if (simvehicles > 0) {
+		wl.wl_model = WL_POISSON;
+	}
+	if (rate > 0) {
+		wl.wl_rate = rate;
+	}
+	if (burstfactor > 0) {
+		wl.wl_burstfactor = burstfactor;
+		wl.wl_burstusecs = burstusecs;
+	}
+	if (rushpeak > 0) {
+		wl.wl_rushpeak = rushpeak;
+		wl.wl_rushusecs = rushusecs;
+	}
+	if (truckpermille >= 0) {
+		wl.wl_truckpermille = truckpermille;
+	}
+	else if (bench) {
+		// Heavy car traffic, a few trucks.
+		wl.wl_truckpermille = 100;
+	}
+	if (bench && rate == 0) {
+		wl.wl_rate = TRUCKBENCH_RATE;
+	}
+	if (skew != NULL && workload_setskew(&wl, skew)) {
+		goto usage;
+	}
+	if (recordfile != NULL) {
+		error = workload_record(&wl, recordfile, recordn);
+		if (error) {
+			kprintf("%s: %s: %s\n", args[0], recordfile, strerror(error));
+			return 1;
+		}
+		kprintf("Recorded %d arrivals in %s\n", recordn, recordfile);
+		return 0;
+	}
+	if (tracefile != NULL) {
+		error = workload_opentrace(&wl, tracefile);
+		if (error) {
+			kprintf("%s: %s: %s\n", args[0], tracefile, strerror(error));
+			return 1;
+		}
+	}
+	if (evlogfile != NULL) {
+		error = evlog_start(evlogfile, EVLOG_RECORDS, numWays, rows * cols);
+		if (error) {
+			kprintf("%s: %s: %s\n", args[0], evlogfile, strerror(error));
+			workload_cleanup(&wl);
+			return 1;
+		}
+		evlogOn = 1;
+	}
+
+	// Creates the intersections and their locks.
+	routes_init();
+	grid_create(rows, cols);
+	for (t = CAR; t <= TRUCK; t++) {
+		histogram_init(&waitHist[t]);
+	}
+	transitHist = kmalloc(numWays * NUMTURNS * 2 * sizeof(struct histogram));
+	if (transitHist == NULL) {
+		panic("createvehicles: out of memory\n");
+	}
+	for (i = 0; i < numWays * NUMTURNS * 2; i++) {
+		histogram_init(&transitHist[i]);
+	}
+	histogram_init(&admitHist);
+
+	//Initialize countVehicles, a counter to check if all the
+	//Threads has been executed.
+	countVehicles = counter_create("vehicles");
+	countAged = counter_create("aged trucks");
+	countBlocked = counter_create("blocked arrivals");
+	countDropped = counter_create("dropped arrivals");
+	if (countVehicles == NULL || countAged == NULL || countBlocked == NULL ||
+	    countDropped == NULL) {
+		panic("createvehicles: out of memory\n");
+	}
+
+	numVehicleStates = (nvehicletasks > 0) ? nvehicletasks : nvehiclethreads;
+	vehicleStates = kmalloc(numVehicleStates * sizeof(struct vehiclestate));
+	if (vehicleStates == NULL) {
+		panic("createvehicles: out of memory\n");
+	}
+	for (i = 0; i < numVehicleStates; i++) {
+		seqlock_init(&vehicleStates[i].vs_seq);
+		vehicleStates[i].vs_number = i;
+		vehicleStates[i].vs_intersection = -1;
+		vehicleStates[i].vs_state = VS_NONE;
+	}
+
+	if (monitorms > 0) {
+		monitorStop = 0;
+		monitorDone = sem_create("monitorDone", 0);
+		if (monitorDone == NULL) {
+			panic("createvehicles: out of memory\n");
+		}
+		error = thread_fork("monitor", NULL, monitorms, monitor, NULL);
+		if (error) {
+			panic("monitor: thread_fork failed: %s\n", strerror(error));
+		}
+	}
+
+	start = timestamp_us();
+	if (bench) {
+		truckbench(&wl, simvehicles, simshards);
+	}
+	else if (simvehicles > 0) {
+		simulate(&wl, simvehicles, simshards);
+	}
+	else if (nvehicletasks > 0) {
+		runvehicletasks(&wl, nvehicletasks);
+	}
+	else {
+		runvehiclethreads(&wl, nvehiclethreads);
+	}
+	elapsed = timestamp_us() - start;
+
+	if (monitorms > 0) {
+		monitorStop = 1;
+		P(monitorDone);
+		sem_destroy(monitorDone);
+	}
+	if (evlogOn) {
+		evlogOn = 0;
+		error = evlog_stop(&evrecords, &evstalls);
+		kprintf("Event log: %u records in %s, %u stalls", evrecords,
+			evlogfile, evstalls);
+		if (error) {
+			kprintf(", write failed: %s", strerror(error));
+		}
+		kprintf("\n");
+	}
+
+	for (turn = 0; turn < NUMTURNS; turn++) {
+		countTurns[turn] = 0;
+	}
+	for (id = 0; id < numIntersections; id++) {
+		struct intersection *is = grid[id];
+		if (numIntersections > 1) {
+			kprintf("Intersection %d:", id);
+		}
+		for (turn = 0; turn < NUMTURNS; turn++) {
+			int n = counter_read(is->is_turns[turn]);
+			if (numIntersections > 1 && turn_segments(turn) > 0) {
+				kprintf(" %d %s", n, stringDirection[turn]);
+			}
+			countTurns[turn] += n;
+		}
+		if (numIntersections > 1) {
+			kprintf("\n");
+		}
+	}
+	total = 0;
+	for (turn = 0; turn < NUMTURNS; turn++) {
+		if (turn_segments(turn) > 0) {
+			kprintf("%s turns executed: %d \n", stringDirection[turn],
+				countTurns[turn]);
+		}
+		total += countTurns[turn];
+	}
+
+	/*
+	 * Crossings per second, to compare intersection sizes: run the
+	 * same load with "ways 3", "ways 4", ...
+	 */
+	if (simvehicles == 0) {
+		kprintf("%d-way: %d crossings in %u ms", numWays, total,
+			elapsed / 1000);
+		if (elapsed >= 1000) {
+			kprintf(", %u/s", (u_int32_t)total * 1000 / (elapsed / 1000));
+		}
+		kprintf("\n");
+	}
+	if (counter_read(countAged) > 0) {
+		kprintf("Trucks that went ahead of cars after %u us: %ld\n",
+			truckMaxWait, counter_read(countAged));
+	}
+	if (laneCap > 0) {
+		kprintf("Lanes capped at %d in flight: %ld arrivals waited for room, "
+			"%ld turned away\n", laneCap, counter_read(countBlocked),
+			counter_read(countDropped));
+	}
+	printLatency();
+  // Destroy locks
+	grid_destroy();
+	workload_cleanup(&wl);
+	counter_destroy(countVehicles);
+	counter_destroy(countAged);
+	counter_destroy(countBlocked);
+	counter_destroy(countDropped);
+	kfree(transitHist);
+	transitHist = NULL;
+	kfree(vehicleStates);
+	vehicleStates = NULL;
+	numVehicleStates = 0;
+
+	return 0;
+
+ usage:
+	kprintf("Usage: %s [threads N | tasks N] [grid ROWS COLS] [ways N] [uturns] [monitor MS] [sim N [shards K] [truckbench]]\n"
+		"\t[arrivals burst|poisson|bursty] [rate R] [burst F USECS] [rush PEAK USECS]\n"
+		"\t[skew W:W:...] [trucks PERMILLE] [trace FILE | record FILE N] [evlog FILE] [truckwait USECS]\n"
+		"\t[lanecap N [overload block|drop]]\n",
+		args[0]);
+	return 1;
+}
@@ -5,10 +5,15 @@
 
 #include <types.h>
 #include <lib.h>
+#include <kern/errno.h>
 #include <synch.h>
 #include <thread.h>
 #include <curthread.h>
+#include <task.h>
+#include <atomic.h>
+#include <spinlock.h>
 #include <machine/spl.h>
+#include <timestamp.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -34,6 +39,9 @@ sem_create(const char *namearg, int initial_count)
 	}
 
 	sem->count = initial_count;
+	sem->waiters = 0;
+	spinlock_init(&sem->spin);
+	threadlist_init(&sem->waitq);
 	return sem;
 }
 
@@ -44,7 +52,8 @@ sem_destroy(struct semaphore *sem)
 	assert(sem != NULL);
 
 	spl = splhigh();
-	assert(thread_hassleepers(sem)==0);
+	assert(sem->waiters==0);
+	assert(thread_hassleepers(&sem->waitq)==0);
 	splx(spl);
 	/*
 	 * Note: while someone could theoretically start sleeping on
@@ -55,6 +64,7 @@ sem_destroy(struct semaphore *sem)
 	 * including the kfrees in the splhigh block, so we don't.
 	 */
 
+	threadlist_cleanup(&sem->waitq);
 	kfree(sem->name);
 	kfree(sem);
 }
@@ -62,7 +72,7 @@ sem_destroy(struct semaphore *sem)
 void 
 P(struct semaphore *sem)
 {
-	int spl;
+	int count;
 	assert(sem != NULL);
 
 	/*
@@ -73,25 +83,71 @@ P(struct semaphore *sem)
 	 */
 	assert(in_interrupt==0);
 
-	spl = splhigh();
-	while (sem->count==0) {
-		thread_sleep(sem);
+	/* Fast path: take a unit if there is one. */
+	count = sem->count;
+	while (count > 0) {
+		if (atomic_cas(&sem->count, count, count-1)) {
+			return;
+		}
+		count = sem->count;
 	}
-	assert(sem->count>0);
-	sem->count--;
-	splx(spl);
+
+	/*
+	 * Slow path. Register as a waiter before looking at the count
+	 * again. V increments the count before checking for waiters, so
+	 * either we see its increment or it sees us and takes the
+	 * spinlock to wake us, which it can't do until we're asleep.
+	 */
+	spinlock_acquire(&sem->spin);
+	sem->waiters++;
+	membar();
+	for (;;) {
+		count = sem->count;
+		if (count == 0) {
+			spinlock_sleep(&sem->spin, &sem->waitq);
+		}
+		else if (atomic_cas(&sem->count, count, count-1)) {
+			break;
+		}
+	}
+	sem->waiters--;
+	spinlock_release(&sem->spin);
 }
 
 void
 V(struct semaphore *sem)
 {
-	int spl;
+	int old;
 	assert(sem != NULL);
-	spl = splhigh();
-	sem->count++;
-	assert(sem->count>0);
-	thread_wakeup(sem);
-	splx(spl);
+
+	old = atomic_fetch_add(&sem->count, 1);
+	assert(old >= 0);
+
+	/* Fast path: nobody is waiting, so there is nobody to wake. */
+	if (sem->waiters == 0) {
+		return;
+	}
+
+	/* One unit, one sleeper. */
+	spinlock_acquire(&sem->spin);
+	thread_wake_one(&sem->waitq);
+	spinlock_release(&sem->spin);
+}
+
+int
+tryP(struct semaphore *sem)
+{
+	int count;
+	assert(sem != NULL);
+
+	count = sem->count;
+	while (count > 0) {
+		if (atomic_cas(&sem->count, count, count-1)) {
+			return 1;
+		}
+		count = sem->count;
+	}
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -109,16 +165,34 @@ lock_create(const char *name)
 		return NULL;
 	}
 
-	lock->name = kstrdup(name);
-	if (lock->name == NULL) {
+	if (lock_init(lock, name)) {
 		kfree(lock);
 		return NULL;
 	}
+	return lock;
+}
+
+int
+lock_init(struct lock *lock, const char *name)
+{
+	assert(lock != NULL);
+
+	lock->name = kstrdup(name);
+	if (lock->name == NULL) {
+		return ENOMEM;
+	}
 	
 	// add stuff here as needed
   	lock->owner = NULL;	
   	lock->locked = UNLOCKED;
-	return lock;
+	lock->waiters = 0;
+	spinlock_init(&lock->spin);
+	threadlist_init(&lock->waitq);
+	taskqueue_init(&lock->taskwaiters);
+	lock->taskowner = NULL;
+	lock->nextwaitseq = 0;
+	lock->waithist = NULL;
+	return 0;
 }
 
 void
@@ -126,30 +200,183 @@ lock_destroy(struct lock *lock)
 {
 	assert(lock != NULL);
 
+	lock_cleanup(lock);
+	kfree(lock);
+}
+
+void
+lock_cleanup(struct lock *lock)
+{
+	assert(lock != NULL);
+
 	// add stuff here as needed
+	assert(lock->locked == UNLOCKED);
+	assert(lock->waiters == 0);
+	assert(threadlist_isempty(&lock->waitq));
+	assert(taskqueue_isempty(&lock->taskwaiters));
+	assert(lock->taskowner == NULL);
+	threadlist_cleanup(&lock->waitq);
 	
 	kfree(lock->name);
-	kfree(lock);
+	lock->name = NULL;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
 	// Write this
+  u_int32_t start;
+
+  assert(lock != NULL);
+  // May not block in an interrupt handler; check even on the fast path.
+  assert(in_interrupt == 0);
+
+  // Fast path: the lock is free; one compare-and-swap takes it.
+  if(atomic_cas(&lock->locked, UNLOCKED, LOCKED)){
+    lock->owner = curthread;
+    if(lock->waithist != NULL){
+      histogram_add(lock->waithist, 0);
+    }
+    return;
+  }
+  start = lock->waithist != NULL ? timestamp_us() : 0;
+
+  /*
+   * Slow path. Announce ourselves as a waiter before trying again, so
+   * that a release that happens after our failed attempt is sure to
+   * see the waiter and come wake us (it must take the spinlock to do
+   * so, which it can't until we're asleep).
+   *
+   * Once asleep we only come back with the lock already ours: the
+   * releaser sets owner to us before waking us.
+   */
+  spinlock_acquire(&lock->spin);
+  lock->waiters++;
+  if(!atomic_cas(&lock->locked, UNLOCKED, LOCKED)){
+    curthread->t_waitseq = lock->nextwaitseq++;
+    do{
+      spinlock_sleep(&lock->spin, &lock->waitq);
+    }while(lock->owner != curthread);
+  }
+  lock->waiters--;
+  spinlock_release(&lock->spin);
+  // Set the owner to current thread
+  lock->owner = curthread;
+  if(lock->waithist != NULL){
+    histogram_add(lock->waithist, timestamp_us() - start);
+  }
+}
+
+int
+lock_tryacquire(struct lock *lock)
+{
   assert(lock != NULL);
 
-  // Prevent context switch by setting priority level to high.
-  int spl = splhigh();
-  // While lock not acquired by current thread(empty or held by another)
-  // sleep until lock is empty to set acquired to curthread. 
-  while(lock->locked == LOCKED){
-    thread_sleep(lock);
+  if(!atomic_cas(&lock->locked, UNLOCKED, LOCKED)){
+    return 0;
   }
-  // Set lock to locked and the owner to current thread
-  lock->locked = LOCKED;
   lock->owner = curthread;
-  // Set priority level back
-  splx(spl);
+  return 1;
+}
+
+int
+lock_acquire_timeout(struct lock *lock, u_int32_t usecs)
+{
+  u_int32_t start, deadline;
+  int got;
+
+  assert(lock != NULL);
+  assert(in_interrupt == 0);
+
+  if(lock_tryacquire(lock)){
+    if(lock->waithist != NULL){
+      histogram_add(lock->waithist, 0);
+    }
+    return 1;
+  }
+
+  // Same protocol as lock_acquire, except that the sleep can expire.
+  start = timestamp_us();
+  deadline = start + usecs;
+  spinlock_acquire(&lock->spin);
+  lock->waiters++;
+  got = atomic_cas(&lock->locked, UNLOCKED, LOCKED);
+  if(!got){
+    curthread->t_waitseq = lock->nextwaitseq++;
+  }
+  while(!got){
+    if(spinlock_sleep_timeout(&lock->spin, &lock->waitq, deadline)){
+      // Out of time (and off the queue, so nobody can hand it to
+      // us now); one last try in case it was just released.
+      got = atomic_cas(&lock->locked, UNLOCKED, LOCKED);
+      break;
+    }
+    got = (lock->owner == curthread);
+  }
+  lock->waiters--;
+  spinlock_release(&lock->spin);
+
+  if(got){
+    lock->owner = curthread;
+    if(lock->waithist != NULL){
+      histogram_add(lock->waithist, timestamp_us() - start);
+    }
+  }
+  return got;
+}
+
+/*
+ * Called after a lock has been marked UNLOCKED when it had waiters.
+ * Unless somebody has grabbed the lock in the meantime, it is handed
+ * straight to whichever waiter, parked task or sleeping thread, came
+ * first (by the stamps taken as they queued), which is then made
+ * runnable. If somebody did grab it, they'll hand it on when they
+ * release it.
+ */
+static
+void
+lock_wakewaiters(struct lock *lock)
+{
+  struct task *tk;
+  struct thread *t;
+
+  spinlock_acquire(&lock->spin);
+  tk = lock->taskwaiters.tq_head;
+  t = threadlist_isempty(&lock->waitq) ? NULL
+    : lock->waitq.tl_head.tln_next->tln_self;
+  if((tk != NULL || t != NULL) &&
+     atomic_cas(&lock->locked, UNLOCKED, LOCKED)){
+    // Stamps wrap, so compare them by their difference.
+    if(tk != NULL &&
+       (t == NULL || (int)(tk->tk_waitseq - t->t_waitseq) < 0)){
+      taskqueue_remhead(&lock->taskwaiters);
+      lock->waiters--;
+      lock->taskowner = tk;
+      task_wakeup(tk);
+    }
+    else{
+      // The sleeper checks owner under the spinlock, so set it first.
+      lock->owner = t;
+      thread_wake_one(&lock->waitq);
+    }
+  }
+  spinlock_release(&lock->spin);
+}
+
+/*
+ * Mark the lock free and, if anyone is waiting, pass it on.
+ */
+static
+void
+lock_unlock(struct lock *lock)
+{
+  membar();
+  lock->locked = UNLOCKED;
+  membar();
+  // Fast path: nobody to wake.
+  if(lock->waiters > 0){
+    lock_wakewaiters(lock);
+  }
 }
 
 void
@@ -161,15 +388,54 @@ lock_release(struct lock *lock)
   // wakeup.
   assert(lock->locked == LOCKED);
   assert(lock_do_i_hold(lock) == 1);
-  // Disable interupts to prevent context switch.
-  int spl = splhigh();
-  // Set lock to not acquired and the acquirer to NULL.
-  lock->locked = UNLOCKED;
   lock->owner = NULL;
-  // Wakeup thread waiting for the lock.
-  thread_wakeup(lock);
-  // Set priority level back.
-  splx(spl);
+  lock_unlock(lock);
+}
+
+int
+lock_acquire_task(struct lock *lock, struct task *tk)
+{
+  assert(lock != NULL);
+  assert(tk != NULL);
+
+  if(atomic_cas(&lock->locked, UNLOCKED, LOCKED)){
+    lock->taskowner = tk;
+    return 1;
+  }
+
+  // As in lock_acquire, count ourselves as a waiter before retrying.
+  spinlock_acquire(&lock->spin);
+  lock->waiters++;
+  if(atomic_cas(&lock->locked, UNLOCKED, LOCKED)){
+    // Released while we were getting the spinlock.
+    lock->waiters--;
+    spinlock_release(&lock->spin);
+    lock->taskowner = tk;
+    return 1;
+  }
+  // Park the continuation; lock_wakewaiters will pass the lock to it.
+  tk->tk_waitseq = lock->nextwaitseq++;
+  taskqueue_addtail(&lock->taskwaiters, tk);
+  spinlock_release(&lock->spin);
+  return 0;
+}
+
+void
+lock_release_task(struct lock *lock, struct task *tk)
+{
+  assert(lock != NULL);
+  assert(lock->locked == LOCKED);
+  assert(lock->taskowner == tk);
+
+  lock->taskowner = NULL;
+  lock_unlock(lock);
+}
+
+void
+lock_setwaithist(struct lock *lock, struct histogram *hist)
+{
+  assert(lock != NULL);
+  lock->waithist = hist;
 }
 
 int
@@ -209,6 +475,8 @@ cv_create(const char *name)
 	}
 	
 	// add stuff here as needed
+	spinlock_init(&cv->spin);
+	threadlist_init(&cv->waitq);
 	
 	return cv;
 }
@@ -219,6 +487,8 @@ cv_destroy(struct cv *cv)
 	assert(cv != NULL);
 
 	// add stuff here as needed
+	assert(threadlist_isempty(&cv->waitq));
+	threadlist_cleanup(&cv->waitq);
 	
 	kfree(cv->name);
 	kfree(cv);
@@ -227,23 +497,41 @@ cv_destroy(struct cv *cv)
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-	// Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+  assert(cv != NULL);
+  assert(lock != NULL);
+  assert(lock_do_i_hold(lock));
+
+  /*
+   * Get on the queue before letting go of the lock, so a signal sent
+   * by whoever takes the lock next can't be missed.
+   */
+  spinlock_acquire(&cv->spin);
+  lock_release(lock);
+  spinlock_sleep(&cv->spin, &cv->waitq);
+  spinlock_release(&cv->spin);
+  lock_acquire(lock);
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-	// Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+  assert(cv != NULL);
+  assert(lock != NULL);
+  assert(lock_do_i_hold(lock));
+
+  spinlock_acquire(&cv->spin);
+  thread_wake_one(&cv->waitq);
+  spinlock_release(&cv->spin);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	// Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+  assert(cv != NULL);
+  assert(lock != NULL);
+  assert(lock_do_i_hold(lock));
+
+  spinlock_acquire(&cv->spin);
+  thread_wake_all(&cv->waitq);
+  spinlock_release(&cv->spin);
 }
@@ -7,15 +7,31 @@
 #define LOCKED 1
 #define UNLOCKED 0
 
+#include <task.h>
+#include <spinlock.h>
+#include <threadlist.h>
+#include <histogram.h>
+
 /*
  * Dijkstra-style semaphore.
  * Operations:
  *     P (proberen): decrement count. If the count is 0, block until
  *                   the count is 1 again before decrementing.
  *     V (verhogen): increment count.
+ *     tryP:         decrement count if it is above 0, without blocking.
+ *                   Returns 1 if it took a unit, 0 if not.
  * 
  * Both operations are atomic.
  *
+ * When a unit is available P takes it with a single atomic_cas, and V
+ * is an atomic increment that only takes the semaphore's spinlock to
+ * wake sleepers if the waiter count says there are any. Each V wakes
+ * one sleeper, oldest first. On a cpu with a native compare-and-swap
+ * neither fast path changes the interrupt level; on one without (the
+ * MIPS-I in System/161) atomic.h makes each atomic operation atomic
+ * with a brief splhigh/splx, so there the fast path still raises the
+ * interrupt level once, though it never takes the spinlock.
+ *
  * The name field is for easier debugging. A copy of the name is made
  * internally.
  */
@@ -23,11 +39,15 @@
 struct semaphore {
 	char *name;
 	volatile int count;
+	volatile int waiters;	// threads in (or entering) P's slow path
+	struct spinlock spin;	// orders sleeping against V's wakeup
+	struct threadlist waitq; // sleeping P's, in arrival order
 };
 
 struct semaphore *sem_create(const char *name, int initial_count);
 void              P(struct semaphore *);
 void              V(struct semaphore *);
+int               tryP(struct semaphore *);
 void              sem_destroy(struct semaphore *);
 
 
@@ -46,6 +66,16 @@ void              sem_destroy(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * An uncontended lock_acquire or lock_release is a single atomic
+ * operation on the lock word, and the spinlock is only taken when
+ * there are, or may be, waiters. As with P and V, that operation
+ * leaves the interrupt level alone only where the cpu has a native
+ * compare-and-swap; without one it is a short splhigh/splx section.
+ *
+ * Sleeping threads are queued in arrival order and the lock is handed
+ * directly to the one at the front when it is released, so once a
+ * thread has had to sleep it cannot be overtaken by later sleepers.
+ *
  * The name field is for easier debugging. A copy of the name is made
  * internally.
  */
@@ -54,8 +84,23 @@ struct lock {
 	char *name;
 	// add what you need here
 	// (don't forget to mark things volatile as needed)
-  int locked;
+  volatile int locked;
+  // Threads and tasks waiting for (or about to wait for) the lock.
+  volatile int waiters;
+  // Protects the waiter bookkeeping and the sleep/wakeup handshake.
+  struct spinlock spin;
+  // Threads asleep waiting for the lock, oldest first.
+  struct threadlist waitq;
   struct thread *owner;
+  // Stackless tasks (see task.h) parked waiting for the lock, and the
+  // task holding it, if a task holds it rather than a thread.
+  struct taskqueue taskwaiters;
+  struct task *taskowner;
+  // Stamp for the next thread or task to queue, so that a release can
+  // serve the two queues together in arrival order.
+  unsigned nextwaitseq;
+  // If set, lock_acquire records how long each acquire took here.
+  struct histogram *waithist;
 };
 
 struct lock *lock_create(const char *name);
@@ -64,6 +109,56 @@ void         lock_release(struct lock *);
 int          lock_do_i_hold(struct lock *);
 void         lock_destroy(struct lock *);
 
+/*
+ * For locks embedded in other structures (e.g. to control which cache
+ * line they sit on) rather than allocated by lock_create:
+ *    lock_init    - Set up a lock in caller-provided storage. Returns 0
+ *                   or ENOMEM.
+ *    lock_cleanup - Release what lock_init allocated. The storage
+ *                   itself is the caller's.
+ */
+int          lock_init(struct lock *, const char *name);
+void         lock_cleanup(struct lock *);
+
+/*
+ * Acquiring without waiting forever:
+ *    lock_tryacquire     - Get the lock if it is free right now. Returns
+ *                   1 if we now hold it, 0 (without blocking) if not.
+ *    lock_acquire_timeout - Like lock_acquire, but give up after USECS
+ *                   microseconds. Returns 1 if we now hold the lock, 0
+ *                   if the time ran out. Timeouts are noticed on clock
+ *                   ticks, so the wait may overrun by up to one tick.
+ */
+int          lock_tryacquire(struct lock *);
+int          lock_acquire_timeout(struct lock *, u_int32_t usecs);
+
+/*
+ *    lock_setwaithist - Record the time (in microseconds) every
+ *                   successful lock_acquire and lock_acquire_timeout
+ *                   waited into HIST, or stop recording if HIST is
+ *                   NULL. The time is recorded while holding the
+ *                   lock, so one histogram per lock needs no further
+ *                   locking. Uncontended acquires record 0.
+ */
+void         lock_setwaithist(struct lock *, struct histogram *hist);
+
+/*
+ * Lock operations for stackless tasks.
+ *    lock_acquire_task - Get the lock on behalf of task TK. Returns 1 if
+ *                   it was free. Otherwise TK is parked on the lock,
+ *                   0 is returned, and the caller's step function
+ *                   should return TASK_BLOCKED. When the lock is
+ *                   released it is handed straight to TK and TK is
+ *                   made runnable again, already holding it.
+ *    lock_release_task - Release a lock held by task TK.
+ *
+ * Parked tasks and sleeping threads are served together, in the order
+ * they queued: a release hands the lock to whichever has waited
+ * longest, so neither kind can starve the other.
+ */
+int          lock_acquire_task(struct lock *, struct task *tk);
+void         lock_release_task(struct lock *, struct task *tk);
+
 
 /*
  * Condition variable.
@@ -85,7 +180,8 @@ void         lock_destroy(struct lock *);
  * These operations must be atomic. You get to write them.
  *
  * These CVs are expected to support Mesa semantics, that is, no
- * guarantees are made about scheduling.
+ * guarantees are made about scheduling. (Waiters are, however, woken
+ * in the order they started waiting.)
  *
  * The name field is for easier debugging. A copy of the name is made
  * internally.
@@ -95,6 +191,8 @@ struct cv {
 	char *name;
 	// add what you need here
 	// (don't forget to mark things volatile as needed)
+	struct spinlock spin;		// orders sleeping against wakeups
+	struct threadlist waitq;	// waiting threads, oldest first
 };
 
 struct cv *cv_create(const char *name);
@@ -0,0 +1,413 @@
+/*
+ * Synchronization and scheduler benchmarks.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <machine/spl.h>
+#include <thread.h>
+#include <synch.h>
+#include <spinlock.h>
+#include <threadlist.h>
+#include <timestamp.h>
+#include <synchbench.h>
+
+// Default number of iterations.
+#define NBENCHITERS 10000
+
+/*
+ * Parse the optional iteration count. Returns 0 on bad input.
+ */
+static
+int
+bench_iters(int nargs, char **args)
+{
+	if (nargs < 2) {
+		return NBENCHITERS;
+	}
+	if (nargs > 2 || atoi(args[1]) <= 0) {
+		kprintf("Usage: %s [iterations]\n", args[0]);
+		return 0;
+	}
+	return atoi(args[1]);
+}
+
+/*
+ * Print COUNT operations of kind WHAT done in USECS microseconds, as
+ * a rate. Sticks to 32-bit arithmetic.
+ */
+static
+void
+bench_report(const char *what, int count, u_int32_t usecs)
+{
+	u_int32_t msecs = usecs / 1000;
+
+	if (msecs == 0) {
+		msecs = 1;
+	}
+	kprintf("%s: %d in %u.%03u ms, %u per second\n", what, count,
+		usecs / 1000, usecs % 1000,
+		(u_int32_t)count * 1000 / msecs);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Semaphore ping-pong.
+
+static struct semaphore *ping;
+static struct semaphore *pong;
+static struct semaphore *benchdone;
+
+static
+void
+ponger(void *unused, unsigned long iters)
+{
+	unsigned long i;
+
+	(void)unused;
+
+	for (i=0; i<iters; i++) {
+		P(ping);
+		V(pong);
+	}
+	V(benchdone);
+}
+
+int
+sembench(int nargs, char **args)
+{
+	u_int32_t start;
+	int i, iters, result;
+
+	iters = bench_iters(nargs, args);
+	if (iters == 0) {
+		return 1;
+	}
+
+	ping = sem_create("ping", 0);
+	pong = sem_create("pong", 0);
+	benchdone = sem_create("benchdone", 0);
+	if (ping == NULL || pong == NULL || benchdone == NULL) {
+		panic("sembench: sem_create failed\n");
+	}
+
+	/* Uncontended: every P finds the unit the V just left. */
+	start = timestamp_us();
+	for (i=0; i<iters; i++) {
+		V(ping);
+		P(ping);
+	}
+	bench_report("uncontended P/V pairs", iters, timestamp_us() - start);
+
+	/* Ping-pong: every P has to wait for the other thread's V. */
+	result = thread_fork("ponger", NULL, iters, ponger, NULL);
+	if (result) {
+		panic("sembench: thread_fork failed: %s\n", strerror(result));
+	}
+	start = timestamp_us();
+	for (i=0; i<iters; i++) {
+		V(ping);
+		P(pong);
+	}
+	bench_report("ping-pong round trips", iters, timestamp_us() - start);
+	P(benchdone);
+
+	sem_destroy(ping);
+	sem_destroy(pong);
+	sem_destroy(benchdone);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Yield storm.
+
+// Defaults for yieldbench.
+#define NYIELDTHREADS 64
+#define NYIELDS 1000
+
+/*
+ * Every thread takes a process table slot, so stay well under
+ * TABLESIZE no matter what is asked for.
+ */
+#define MAXYIELDTHREADS (TABLESIZE / 2)
+
+static struct semaphore *yieldstart;
+
+static
+void
+yielder(void *unused, unsigned long yields)
+{
+	unsigned long i;
+
+	(void)unused;
+
+	/* Don't start until everybody exists. */
+	P(yieldstart);
+	for (i=0; i<yields; i++) {
+		thread_yield();
+	}
+	V(benchdone);
+}
+
+int
+yieldbench(int nargs, char **args)
+{
+	struct thread_opts opts;
+	u_int32_t start;
+	int i, nthreads, yields, result;
+
+	nthreads = NYIELDTHREADS;
+	yields = NYIELDS;
+	if (nargs > 3 ||
+	    (nargs > 1 && (nthreads = atoi(args[1])) <= 0) ||
+	    (nargs > 2 && (yields = atoi(args[2])) <= 0)) {
+		kprintf("Usage: %s [threads [yields]]\n", args[0]);
+		return 1;
+	}
+	if (nthreads > MAXYIELDTHREADS) {
+		kprintf("%s: at most %d threads\n", args[0], MAXYIELDTHREADS);
+		return 1;
+	}
+
+	yieldstart = sem_create("yieldstart", 0);
+	benchdone = sem_create("benchdone", 0);
+	if (yieldstart == NULL || benchdone == NULL) {
+		panic("yieldbench: sem_create failed\n");
+	}
+
+	/* The yielders barely use any stack. */
+	opts.to_stackclass = TSTACK_SMALL;
+	opts.to_priority = TPRI_NORMAL;
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork_opts("yielder", NULL, yields, yielder,
+					  &opts, NULL);
+		if (result) {
+			panic("yieldbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	start = timestamp_us();
+	for (i=0; i<nthreads; i++) {
+		V(yieldstart);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(benchdone);
+	}
+	bench_report("thread_yield calls", nthreads * yields,
+		     timestamp_us() - start);
+
+	sem_destroy(yieldstart);
+	sem_destroy(benchdone);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Scheduling statistics.
+
+// Default number of threads schedstats lists.
+#define NSTATSTHREADS 10
+
+int
+schedstats(int nargs, char **args)
+{
+	int top = NSTATSTHREADS;
+
+	if (nargs > 2) {
+		goto usage;
+	}
+	if (nargs == 2) {
+		if (!strcmp(args[1], "start")) {
+			thread_stats_start();
+			return 0;
+		}
+		if (!strcmp(args[1], "stop")) {
+			thread_stats_stop();
+			return 0;
+		}
+		top = atoi(args[1]);
+		if (top <= 0) {
+			goto usage;
+		}
+	}
+	thread_stats_print(top);
+	return 0;
+
+ usage:
+	kprintf("Usage: %s [start | stop | count]\n", args[0]);
+	return 1;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Timed sleeps woken at the last moment.
+
+// Rounds of each test, and when in them things happen.
+#define NSLEEPROUNDS 10
+#define SLEEP_USECS 20000	/* from the start of a round to the deadline */
+#define SLEEP_MARGIN 500	/* wake this long before it, run this long after */
+
+static struct spinlock sleepspin;
+static struct threadlist sleepwq;
+static struct lock *sleeplock;
+static volatile u_int32_t sleepdeadline;
+static volatile int sleepresult;
+static volatile int sleepheld;
+static volatile int sleepdone;
+
+/*
+ * Spin with interrupts off until the clock reaches WHEN, so that no
+ * clock tick (and so no timeout check) can happen meanwhile.
+ */
+static
+void
+spin_until(u_int32_t when)
+{
+	while ((int32_t)(timestamp_us() - when) < 0) {
+		;
+	}
+}
+
+static
+void
+timedsleeper(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	spinlock_acquire(&sleepspin);
+	sleepresult = spinlock_sleep_timeout(&sleepspin, &sleepwq,
+					     sleepdeadline);
+	sleepdone = 1;
+	spinlock_release(&sleepspin);
+}
+
+static
+void
+timedlocker(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	sleepresult = lock_acquire_timeout(sleeplock,
+					   sleepdeadline - timestamp_us());
+	sleepheld = lock_do_i_hold(sleeplock);
+	if (sleepheld) {
+		lock_release(sleeplock);
+	}
+	sleepdone = 1;
+}
+
+/*
+ * Start FUNC in a new thread and wait until it is asleep on WQ, with
+ * the round's deadline SLEEP_USECS away.
+ */
+static
+void
+sleeptest_start(void (*func)(void *, unsigned long), struct spinlock *sl,
+		struct threadlist *wq)
+{
+	int result, asleep;
+
+	sleepdone = 0;
+	sleepresult = -1;
+	sleepheld = 0;
+	sleepdeadline = timestamp_us() + SLEEP_USECS;
+	result = thread_fork("sleeptest", NULL, 0, func, NULL);
+	if (result) {
+		panic("sleeptest: thread_fork failed: %s\n", strerror(result));
+	}
+	do {
+		thread_yield();
+		spinlock_acquire(sl);
+		asleep = thread_hassleepers(wq);
+		spinlock_release(sl);
+	} while (!asleep);
+}
+
+// Let the sleeper finish.
+static
+void
+sleeptest_finish(void)
+{
+	while (!sleepdone) {
+		thread_yield();
+	}
+}
+
+int
+sleeptest(int nargs, char **args)
+{
+	int i, spl, failed = 0;
+
+	if (nargs > 1) {
+		kprintf("Usage: %s\n", args[0]);
+		return 1;
+	}
+
+	spinlock_init(&sleepspin);
+	threadlist_init(&sleepwq);
+	sleeplock = lock_create("sleeptest");
+	if (sleeplock == NULL) {
+		panic("sleeptest: lock_create failed\n");
+	}
+
+	/*
+	 * Wake a timed sleeper just before its deadline, and don't let it
+	 * run until the deadline has passed and the timeouts have been
+	 * checked (thread_yield checks them before switching). It was
+	 * woken, so it must say it didn't time out.
+	 */
+	for (i = 0; i < NSLEEPROUNDS; i++) {
+		sleeptest_start(timedsleeper, &sleepspin, &sleepwq);
+		spl = splhigh();
+		spin_until(sleepdeadline - SLEEP_MARGIN);
+		spinlock_acquire(&sleepspin);
+		thread_wake_all(&sleepwq);
+		spinlock_release(&sleepspin);
+		spin_until(sleepdeadline + SLEEP_MARGIN);
+		splx(spl);
+		sleeptest_finish();
+		if (sleepresult != 0) {
+			kprintf("sleeptest: round %d: woken sleeper timed out\n", i);
+			failed = 1;
+		}
+	}
+
+	/*
+	 * The same with lock_acquire_timeout: the lock is handed over just
+	 * before the deadline. The waiter must report success and be the
+	 * one holding it.
+	 */
+	for (i = 0; i < NSLEEPROUNDS; i++) {
+		lock_acquire(sleeplock);
+		sleeptest_start(timedlocker, &sleeplock->spin, &sleeplock->waitq);
+		spl = splhigh();
+		spin_until(sleepdeadline - SLEEP_MARGIN);
+		lock_release(sleeplock);
+		spin_until(sleepdeadline + SLEEP_MARGIN);
+		splx(spl);
+		sleeptest_finish();
+		if (sleepresult != 1 || !sleepheld) {
+			kprintf("sleeptest: round %d: handed the lock, "
+				"lock_acquire_timeout returned %d, holding %d\n",
+				i, sleepresult, sleepheld);
+			failed = 1;
+		}
+		if (!lock_acquire_timeout(sleeplock, SLEEP_USECS)) {
+			kprintf("sleeptest: round %d: lock leaked\n", i);
+			failed = 1;
+			break;
+		}
+		lock_release(sleeplock);
+	}
+
+	threadlist_cleanup(&sleepwq);
+	if (!failed) {
+		lock_destroy(sleeplock);
+	}
+	kprintf("sleeptest: %s\n", failed ? "FAILED" : "passed");
+	return failed;
+}
@@ -0,0 +1,39 @@
+#ifndef _SYNCHBENCH_H_
+#define _SYNCHBENCH_H_
+
+/*
+ * Synchronization and scheduler benchmarks. Each prints its results
+ * and returns 0, or prints a usage message and returns 1.
+ *
+ * They take menu-style arguments but are not on the menu yet: the
+ * kernel menu (kern/main/menu.c) is not part of this tree. To run
+ * them, add to its cmdtable and test menu text:
+ *
+ *    { "sb",	sembench },
+ *    { "yb",	yieldbench },
+ *    { "ss",	schedstats },
+ *    { "st",	sleeptest },
+ *
+ *    sembench [N]  - semaphore P/V pairs per second: uncontended in
+ *                    one thread, and ping-pong between two threads.
+ *    yieldbench [T [N]] - scheduler throughput: T threads (default 64)
+ *                    each call thread_yield N times (default 1000),
+ *                    like a truck spinning at a busy intersection.
+ *    schedstats [start | stop | N] - per-thread scheduling statistics:
+ *                    start zeroes them and starts timing, stop stops
+ *                    timing, otherwise list the top N threads
+ *                    (default 10). Run e.g. the stoplight between
+ *                    start and stop to see which threads eat the CPU.
+ *    sleeptest     - timed sleeps (spinlock_sleep_timeout and
+ *                    lock_acquire_timeout) woken just before their
+ *                    deadline, and not run until after it. Prints
+ *                    "passed" and returns 0, or prints what went wrong
+ *                    and returns 1.
+ */
+
+int sembench(int nargs, char **args);
+int yieldbench(int nargs, char **args);
+int schedstats(int nargs, char **args);
+int sleeptest(int nargs, char **args);
+
+#endif /* _SYNCHBENCH_H_ */
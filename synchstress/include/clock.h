@@ -0,0 +1,18 @@
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+/* Host stand-in for the kernel's clock.h (see ../synchstress.c). */
+
+#include <time.h>
+
+static inline void
+gettime(time_t *secs, u_int32_t *nsecs)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	*secs = ts.tv_sec;
+	*nsecs = ts.tv_nsec;
+}
+
+#endif /* _CLOCK_H_ */
@@ -0,0 +1,9 @@
+#ifndef _CURTHREAD_H_
+#define _CURTHREAD_H_
+
+/* Host stand-in for curthread.h (see ../synchstress.c). */
+
+struct thread;
+extern __thread struct thread *curthread;
+
+#endif /* _CURTHREAD_H_ */
@@ -0,0 +1,8 @@
+#ifndef _KERN_ERRNO_H_
+#define _KERN_ERRNO_H_
+
+/* Host stand-in for the kernel's kern/errno.h (see ../../synchstress.c). */
+
+#include <errno.h>
+
+#endif /* _KERN_ERRNO_H_ */
@@ -0,0 +1,20 @@
+#ifndef _LIB_H_
+#define _LIB_H_
+
+/* Host stand-in for the kernel's lib.h (see ../synchstress.c). */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define kmalloc(sz)	malloc(sz)
+#define kfree(p)	free(p)
+#define kstrdup(s)	strdup(s)
+#define kprintf		printf
+#define panic(...)	(fprintf(stderr, __VA_ARGS__), abort())
+
+#define DB_KMALLOC	0
+#define DEBUG(d, ...)	((void)0)
+
+#endif /* _LIB_H_ */
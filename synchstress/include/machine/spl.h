@@ -0,0 +1,37 @@
+#ifndef _MACHINE_SPL_H_
+#define _MACHINE_SPL_H_
+
+/*
+ * Host stand-in for machine/spl.h (see ../../synchstress.c). Each
+ * pthread plays a cpu with its own interrupt level, which only the
+ * asserts look at; splraises counts how often it was raised, so the
+ * harness can check which paths change it.
+ */
+
+extern __thread int curspl;
+extern __thread unsigned long splraises;
+extern int in_interrupt;
+
+static inline int
+splx(int spl)
+{
+	int old = curspl;
+
+	curspl = spl;
+	return old;
+}
+
+static inline int
+splhigh(void)
+{
+	splraises++;
+	return splx(1);
+}
+
+static inline int
+spl0(void)
+{
+	return splx(0);
+}
+
+#endif /* _MACHINE_SPL_H_ */
@@ -0,0 +1,2 @@
+/* The kernel's own synch.h, under its name in this tree. */
+#include "../../synch (1).h"
@@ -0,0 +1,32 @@
+#ifndef _THREAD_H_
+#define _THREAD_H_
+
+/*
+ * Host stand-in for thread.h (see ../synchstress.c): a thread is a
+ * pthread, and sleeping is waiting on its own condition variable.
+ * Only the wait-queue calls that spinlock.c and synch.c use are
+ * provided.
+ */
+
+#include <pthread.h>
+#include <threadlist.h>
+
+struct spinlock;
+
+struct thread {
+	struct threadlistnode t_listnode;
+	unsigned t_waitseq;	/* arrival stamp on a lock's queue */
+	pthread_mutex_t t_mutex;
+	pthread_cond_t t_cond;
+	int t_woken;		/* set by thread_wake_one */
+	int t_id;
+};
+
+void thread_sleep_on(struct threadlist *wq, struct spinlock *sl);
+int thread_sleep_on_timeout(struct threadlist *wq, struct spinlock *sl,
+			    u_int32_t deadline);
+struct thread *thread_wake_one(struct threadlist *wq);
+void thread_wake_all(struct threadlist *wq);
+int thread_hassleepers(struct threadlist *wq);
+
+#endif /* _THREAD_H_ */
@@ -0,0 +1,9 @@
+#ifndef _TYPES_H_
+#define _TYPES_H_
+
+/* Host stand-in for the kernel's types.h (see ../synchstress.c). */
+
+#include <sys/types.h>
+#include <stddef.h>
+
+#endif /* _TYPES_H_ */
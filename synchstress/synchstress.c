@@ -0,0 +1,565 @@
+/*
+ * synchstress: stress the atomics, spinlocks, semaphores and locks on
+ * a multi-core host.
+ *
+ * This is a host program, not part of the kernel. It builds the
+ * kernel's own spinlock.c, threadlist.c and synch.c against the small
+ * stand-ins in include/, which make each pthread a "thread" (and a
+ * cpu). From the top of the tree:
+ *
+ *      cc -std=gnu99 -O2 -pthread -Isynchstress/include -I. \
+ *         -o synchstress/synchstress synchstress/synchstress.c \
+ *         spinlock.c threadlist.c "synch (1).c"
+ *      synchstress/synchstress [-t THREADS] [-n ITERATIONS]
+ *
+ * Every test has THREADS pthreads (default: twice the number of cpus,
+ * and at least 4) hammer one object ITERATIONS times each (default
+ * 100000), guarding a plain counter where the object is a mutual
+ * exclusion primitive, and then checks the total. A lost wakeup shows
+ * up as a hang, so a watchdog fails the run if it takes too long.
+ *
+ * It also checks that the uncontended fast paths of P, V, tryP,
+ * lock_acquire, lock_tryacquire and lock_release leave the interrupt
+ * level alone. That holds only because the host has a native
+ * compare-and-swap; on the MIPS-I atomic.h raises it instead.
+ *
+ * Only the atomic.h path with native instructions is exercised here:
+ * the splhigh fallback is only atomic on a uniprocessor.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <types.h>
+#include <lib.h>
+#include <machine/spl.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <curthread.h>
+#include <synch.h>
+
+#define WATCHDOG_SECS	120
+#define YIELD_EVERY	64
+
+__thread int curspl;
+__thread unsigned long splraises;
+__thread struct thread *curthread;
+int in_interrupt;
+
+static int nthreads;
+static int iterations;
+
+/* Slow-path sleeps, over all threads; shows the tests did contend. */
+static volatile int nsleeps;
+
+static int failed;
+
+////////////////////////////////////////////////////////////
+//
+// Stand-ins for the rest of the kernel.
+
+void
+thread_sleep_on(struct threadlist *wq, struct spinlock *sl)
+{
+	assert(spinlock_do_i_hold(sl));
+
+	threadlist_addtail(wq, curthread);
+	atomic_fetch_add(&nsleeps, 1);
+	spinlock_unlock(sl);
+
+	pthread_mutex_lock(&curthread->t_mutex);
+	while (!curthread->t_woken) {
+		pthread_cond_wait(&curthread->t_cond, &curthread->t_mutex);
+	}
+	curthread->t_woken = 0;
+	pthread_mutex_unlock(&curthread->t_mutex);
+}
+
+int
+thread_sleep_on_timeout(struct threadlist *wq, struct spinlock *sl,
+			u_int32_t deadline)
+{
+	(void)wq;
+	(void)sl;
+	(void)deadline;
+	panic("synchstress: timed sleeps are not exercised\n");
+	return 0;
+}
+
+struct thread *
+thread_wake_one(struct threadlist *wq)
+{
+	struct thread *t;
+
+	t = threadlist_remhead(wq);
+	if (t != NULL) {
+		pthread_mutex_lock(&t->t_mutex);
+		t->t_woken = 1;
+		pthread_cond_signal(&t->t_cond);
+		pthread_mutex_unlock(&t->t_mutex);
+	}
+	return t;
+}
+
+void
+thread_wake_all(struct threadlist *wq)
+{
+	while (thread_wake_one(wq) != NULL) {
+		;
+	}
+}
+
+int
+thread_hassleepers(struct threadlist *wq)
+{
+	return !threadlist_isempty(wq);
+}
+
+/* The tests use no tasks and no wait histograms. */
+
+void
+taskqueue_init(struct taskqueue *tq)
+{
+	tq->tq_head = tq->tq_tail = NULL;
+}
+
+int
+taskqueue_isempty(struct taskqueue *tq)
+{
+	return tq->tq_head == NULL;
+}
+
+void
+taskqueue_addtail(struct taskqueue *tq, struct task *tk)
+{
+	(void)tq;
+	(void)tk;
+	panic("synchstress: tasks are not exercised\n");
+}
+
+struct task *
+taskqueue_remhead(struct taskqueue *tq)
+{
+	(void)tq;
+	panic("synchstress: tasks are not exercised\n");
+	return NULL;
+}
+
+void
+task_wakeup(struct task *tk)
+{
+	(void)tk;
+	panic("synchstress: tasks are not exercised\n");
+}
+
+void
+histogram_add(struct histogram *h, u_int32_t value)
+{
+	(void)h;
+	(void)value;
+	panic("synchstress: wait histograms are not exercised\n");
+}
+
+static
+struct thread *
+thread_make(int id)
+{
+	struct thread *t;
+
+	t = malloc(sizeof(struct thread));
+	if (t == NULL) {
+		panic("synchstress: out of memory\n");
+	}
+	threadlistnode_init(&t->t_listnode, t);
+	pthread_mutex_init(&t->t_mutex, NULL);
+	pthread_cond_init(&t->t_cond, NULL);
+	t->t_woken = 0;
+	t->t_id = id;
+	return t;
+}
+
+static
+void
+thread_unmake(struct thread *t)
+{
+	threadlistnode_cleanup(&t->t_listnode);
+	pthread_cond_destroy(&t->t_cond);
+	pthread_mutex_destroy(&t->t_mutex);
+	free(t);
+}
+
+////////////////////////////////////////////////////////////
+//
+// The tests.
+
+/* What the tests share; reset by runtest. */
+static volatile int acounter;		/* updated atomically */
+static int counter;			/* updated under mutual exclusion */
+static volatile int inside;		/* holders of the exclusion */
+static volatile int swapword;
+static struct spinlock spin;
+static struct semaphore *sem;
+static struct semaphore *items;
+static struct lock *lock;
+
+/*
+ * The body of every critical section: check nobody else is inside
+ * and bump the plain counter with a separate load and store, so a
+ * broken exclusion loses updates even if the check misses it. With
+ * MAYYIELD set (only for the primitives that sleep) it sometimes
+ * yields the cpu in the middle, so that the slow paths get used even
+ * when there are fewer cpus than threads.
+ */
+static
+void
+critical(int mayyield)
+{
+	int c;
+
+	if (atomic_fetch_add(&inside, 1) != 0) {
+		panic("synchstress: two threads inside a critical section\n");
+	}
+	c = counter;
+	if (mayyield && c % YIELD_EVERY == 0) {
+		sched_yield();
+	}
+	counter = c + 1;
+	atomic_fetch_add(&inside, -1);
+}
+
+static
+void
+test_fetchadd(int id)
+{
+	int i;
+
+	(void)id;
+	for (i = 0; i < iterations; i++) {
+		atomic_fetch_add(&acounter, 1);
+	}
+}
+
+static
+void
+test_cas(int id)
+{
+	int i, old;
+
+	(void)id;
+	for (i = 0; i < iterations; i++) {
+		do {
+			old = acounter;
+		} while (!atomic_cas(&acounter, old, old + 1));
+	}
+}
+
+/* atomic_swap as a test-and-set lock; relies on its full barrier. */
+static
+void
+test_swap(int id)
+{
+	int i;
+
+	(void)id;
+	for (i = 0; i < iterations; i++) {
+		while (atomic_swap(&swapword, 1) != 0) {
+			;
+		}
+		critical(0);
+		membar();
+		swapword = 0;
+	}
+}
+
+static
+void
+test_spinlock(int id)
+{
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		if ((i + id) % 8 == 0) {
+			while (!spinlock_tryacquire(&spin)) {
+				;
+			}
+		}
+		else {
+			spinlock_acquire(&spin);
+		}
+		assert(spinlock_do_i_hold(&spin));
+		assert(curspl > 0);
+		critical(0);
+		spinlock_release(&spin);
+		assert(curspl == 0);
+	}
+}
+
+static
+void
+test_semmutex(int id)
+{
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		if ((i + id) % 8 == 0) {
+			while (!tryP(sem)) {
+				sched_yield();
+			}
+		}
+		else {
+			P(sem);
+		}
+		critical(1);
+		V(sem);
+	}
+}
+
+/* Even threads produce, odd threads consume, one unit at a time. */
+static
+void
+test_semcount(int id)
+{
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		if (id % 2 == 0) {
+			V(items);
+		}
+		else {
+			P(items);
+			atomic_fetch_add(&acounter, 1);
+		}
+	}
+}
+
+static
+void
+test_lock(int id)
+{
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		if ((i + id) % 8 == 0) {
+			while (!lock_tryacquire(lock)) {
+				sched_yield();
+			}
+		}
+		else {
+			lock_acquire(lock);
+		}
+		assert(lock_do_i_hold(lock));
+		critical(1);
+		lock_release(lock);
+	}
+}
+
+struct test {
+	const char *t_name;
+	void (*t_func)(int id);
+	int *t_result;		/* total to check */
+	int t_pairs;		/* one per producer/consumer pair, not thread */
+};
+
+static const struct test tests[] = {
+	{ "atomic_fetch_add", test_fetchadd, (int *)&acounter, 0 },
+	{ "atomic_cas",       test_cas,      (int *)&acounter, 0 },
+	{ "atomic_swap",      test_swap,     &counter,         0 },
+	{ "spinlock",         test_spinlock, &counter,         0 },
+	{ "P/V mutex",        test_semmutex, &counter,         0 },
+	{ "P/V count",        test_semcount, (int *)&acounter, 1 },
+	{ "lock",             test_lock,     &counter,         0 },
+	{ NULL, NULL, NULL, 0 },
+};
+
+struct worker {
+	pthread_t w_pthread;
+	int w_id;
+	const struct test *w_test;
+};
+
+static pthread_barrier_t startline;
+
+static
+void *
+worker(void *arg)
+{
+	struct worker *w = arg;
+
+	curthread = thread_make(w->w_id);
+	pthread_barrier_wait(&startline);
+	w->w_test->t_func(w->w_id);
+	assert(curspl == 0);
+	thread_unmake(curthread);
+	curthread = NULL;
+	return NULL;
+}
+
+static
+void
+runtest(const struct test *t)
+{
+	struct worker *w;
+	int i, expect, sleeps;
+
+	acounter = 0;
+	counter = 0;
+	swapword = 0;
+	sleeps = nsleeps;
+
+	w = malloc(nthreads * sizeof(struct worker));
+	if (w == NULL) {
+		panic("synchstress: out of memory\n");
+	}
+	pthread_barrier_init(&startline, NULL, nthreads);
+	for (i = 0; i < nthreads; i++) {
+		w[i].w_id = i;
+		w[i].w_test = t;
+		if (pthread_create(&w[i].w_pthread, NULL, worker, &w[i])) {
+			panic("synchstress: pthread_create failed\n");
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].w_pthread, NULL);
+	}
+	pthread_barrier_destroy(&startline);
+	free(w);
+
+	expect = (t->t_pairs ? nthreads / 2 : nthreads) * iterations;
+	printf("%-18s %10d (expected %d), %d slow-path sleeps: %s\n",
+	       t->t_name, *t->t_result, expect, nsleeps - sleeps,
+	       *t->t_result == expect ? "ok" : "FAILED");
+	if (*t->t_result != expect) {
+		failed = 1;
+	}
+}
+
+/*
+ * With nobody else around, the fast paths must not raise the
+ * interrupt level (given a native compare-and-swap).
+ */
+static
+void
+fastpaths(void)
+{
+	struct semaphore *s;
+	struct lock *l;
+	unsigned long before;
+	int ok;
+
+	curthread = thread_make(-1);
+	s = sem_create("fastpath", 1);
+	l = lock_create("fastpath");
+	if (s == NULL || l == NULL) {
+		panic("synchstress: out of memory\n");
+	}
+
+	before = splraises;
+	P(s);
+	V(s);
+	ok = tryP(s);
+	assert(ok);
+	V(s);
+	lock_acquire(l);
+	lock_release(l);
+	ok = lock_tryacquire(l);
+	assert(ok);
+	lock_release(l);
+
+#if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4)
+	ok = (splraises == before);
+#else
+	ok = 1;
+#endif
+	printf("%-18s %10lu spl raises: %s\n", "fast paths",
+	       splraises - before, ok ? "ok" : "FAILED");
+	if (!ok) {
+		failed = 1;
+	}
+
+	lock_destroy(l);
+	sem_destroy(s);
+	thread_unmake(curthread);
+	curthread = NULL;
+}
+
+static
+void
+watchdog(int sig)
+{
+	static const char msg[] =
+		"synchstress: timed out (lost wakeup or deadlock?)\n";
+
+	(void)sig;
+	write(2, msg, sizeof(msg) - 1);
+	_exit(1);
+}
+
+static
+void
+usage(void)
+{
+	fprintf(stderr, "usage: synchstress [-t THREADS] [-n ITERATIONS]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct test *t;
+	long ncpus;
+	int ch;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpus > 2 ? 2 * ncpus : 4;
+	iterations = 100000;
+
+	while ((ch = getopt(argc, argv, "t:n:")) != -1) {
+		switch (ch) {
+		    case 't': nthreads = atoi(optarg); break;
+		    case 'n': iterations = atoi(optarg); break;
+		    default: usage();
+		}
+	}
+	if (optind != argc || nthreads < 2 || nthreads % 2 != 0 ||
+	    iterations < 1) {
+		fprintf(stderr, "synchstress: THREADS must be even and at "
+			"least 2, ITERATIONS at least 1\n");
+		usage();
+	}
+
+	/* Show how far we got if the watchdog fires. */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGALRM, watchdog);
+	alarm(WATCHDOG_SECS);
+
+	printf("synchstress: %d threads on %ld cpus, %d iterations each\n",
+	       nthreads, ncpus, iterations);
+
+	fastpaths();
+
+	spinlock_init(&spin);
+	sem = sem_create("synchstress", 1);
+	items = sem_create("synchstress items", 0);
+	lock = lock_create("synchstress");
+	if (sem == NULL || items == NULL || lock == NULL) {
+		panic("synchstress: out of memory\n");
+	}
+
+	for (t = tests; t->t_name != NULL; t++) {
+		runtest(t);
+	}
+
+	lock_destroy(lock);
+	sem_destroy(items);
+	sem_destroy(sem);
+
+	printf("synchstress: %s\n", failed ? "FAILED" : "passed");
+	return failed;
+}
@@ -0,0 +1,250 @@
+/*
+ * Stackless tasks run by carrier threads.
+ * See task.h for specifications of the functions.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <thread.h>
+#include <spinlock.h>
+#include <threadlist.h>
+#include <task.h>
+
+////////////////////////////////////////////////////////////
+//
+// Task queue.
+
+void
+taskqueue_init(struct taskqueue *tq)
+{
+	tq->tq_head = NULL;
+	tq->tq_tail = NULL;
+}
+
+int
+taskqueue_isempty(struct taskqueue *tq)
+{
+	return (tq->tq_head == NULL);
+}
+
+void
+taskqueue_addtail(struct taskqueue *tq, struct task *tk)
+{
+	assert(tk->tk_next == NULL);
+
+	if (tq->tq_tail == NULL) {
+		tq->tq_head = tk;
+	}
+	else {
+		tq->tq_tail->tk_next = tk;
+	}
+	tq->tq_tail = tk;
+}
+
+struct task *
+taskqueue_remhead(struct taskqueue *tq)
+{
+	struct task *tk = tq->tq_head;
+
+	if (tk != NULL) {
+		tq->tq_head = tk->tk_next;
+		if (tq->tq_head == NULL) {
+			tq->tq_tail = NULL;
+		}
+		tk->tk_next = NULL;
+	}
+	return tk;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Task.
+
+void
+task_init(struct task *tk, task_stepfn step, void *data)
+{
+	assert(tk != NULL);
+	assert(step != NULL);
+
+	tk->tk_step = step;
+	tk->tk_data = data;
+	tk->tk_runner = NULL;
+	tk->tk_next = NULL;
+	tk->tk_waitseq = 0;
+}
+
+void
+task_wakeup(struct task *tk)
+{
+	struct taskrunner *tr = tk->tk_runner;
+
+	assert(tr != NULL);
+
+	/* One more task to run needs at most one more carrier. */
+	spinlock_acquire(&tr->tr_spin);
+	taskqueue_addtail(&tr->tr_runq, tk);
+	thread_wake_one(&tr->tr_idle);
+	spinlock_release(&tr->tr_spin);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Runner.
+
+/*
+ * Body of a carrier thread. Runs tasks off the runner's queue until
+ * told to shut down.
+ */
+static
+void
+taskrunner_carrier(void *trv, unsigned long unused)
+{
+	struct taskrunner *tr = trv;
+	struct task *tk;
+	int result;
+
+	(void)unused;
+
+	for (;;) {
+		spinlock_acquire(&tr->tr_spin);
+		while (taskqueue_isempty(&tr->tr_runq) && !tr->tr_shutdown) {
+			spinlock_sleep(&tr->tr_spin, &tr->tr_idle);
+		}
+		tk = taskqueue_remhead(&tr->tr_runq);
+		if (tk == NULL) {
+			/* Shutting down. */
+			tr->tr_ncarriers--;
+			thread_wake_all(&tr->tr_waiters);
+			spinlock_release(&tr->tr_spin);
+			return;
+		}
+		spinlock_release(&tr->tr_spin);
+
+		result = tk->tk_step(tk);
+
+		switch (result) {
+		    case TASK_DONE:
+			spinlock_acquire(&tr->tr_spin);
+			assert(tr->tr_ntasks > 0);
+			tr->tr_ntasks--;
+			if (tr->tr_ntasks == 0) {
+				thread_wake_all(&tr->tr_waiters);
+			}
+			spinlock_release(&tr->tr_spin);
+			break;
+		    case TASK_YIELD:
+			spinlock_acquire(&tr->tr_spin);
+			taskqueue_addtail(&tr->tr_runq, tk);
+			spinlock_release(&tr->tr_spin);
+			break;
+		    case TASK_BLOCKED:
+			/* Parked elsewhere; hands off. */
+			break;
+		    default:
+			panic("taskrunner %s: bad step result %d\n",
+			      tr->tr_name, result);
+		}
+	}
+}
+
+struct taskrunner *
+taskrunner_create(const char *name, int ncarriers)
+{
+	struct taskrunner *tr;
+	struct thread_opts opts;
+	int i, result;
+
+	assert(ncarriers > 0);
+
+	tr = kmalloc(sizeof(struct taskrunner));
+	if (tr == NULL) {
+		return NULL;
+	}
+
+	tr->tr_name = kstrdup(name);
+	if (tr->tr_name == NULL) {
+		kfree(tr);
+		return NULL;
+	}
+
+	spinlock_init(&tr->tr_spin);
+	taskqueue_init(&tr->tr_runq);
+	tr->tr_ntasks = 0;
+	tr->tr_ncarriers = 0;
+	tr->tr_shutdown = 0;
+	threadlist_init(&tr->tr_idle);
+	threadlist_init(&tr->tr_waiters);
+
+	/* Carriers only ever run step functions; keep their stacks small. */
+	opts.to_stackclass = TSTACK_SMALL;
+	opts.to_priority = TPRI_NORMAL;
+
+	for (i=0; i<ncarriers; i++) {
+		result = thread_fork_opts(tr->tr_name, tr, i,
+					  taskrunner_carrier, &opts, NULL);
+		if (result) {
+			break;
+		}
+		spinlock_acquire(&tr->tr_spin);
+		tr->tr_ncarriers++;
+		spinlock_release(&tr->tr_spin);
+	}
+
+	if (tr->tr_ncarriers == 0) {
+		threadlist_cleanup(&tr->tr_idle);
+		threadlist_cleanup(&tr->tr_waiters);
+		kfree(tr->tr_name);
+		kfree(tr);
+		return NULL;
+	}
+
+	return tr;
+}
+
+void
+taskrunner_submit(struct taskrunner *tr, struct task *tk)
+{
+	assert(tr != NULL);
+	assert(tk != NULL);
+	assert(tk->tk_runner == NULL);
+
+	spinlock_acquire(&tr->tr_spin);
+	assert(!tr->tr_shutdown);
+	tk->tk_runner = tr;
+	tr->tr_ntasks++;
+	spinlock_release(&tr->tr_spin);
+
+	task_wakeup(tk);
+}
+
+void
+taskrunner_wait(struct taskrunner *tr)
+{
+	assert(tr != NULL);
+
+	spinlock_acquire(&tr->tr_spin);
+	while (tr->tr_ntasks > 0) {
+		spinlock_sleep(&tr->tr_spin, &tr->tr_waiters);
+	}
+	spinlock_release(&tr->tr_spin);
+}
+
+void
+taskrunner_destroy(struct taskrunner *tr)
+{
+	assert(tr != NULL);
+
+	spinlock_acquire(&tr->tr_spin);
+	assert(tr->tr_ntasks == 0);
+	tr->tr_shutdown = 1;
+	thread_wake_all(&tr->tr_idle);
+	while (tr->tr_ncarriers > 0) {
+		spinlock_sleep(&tr->tr_spin, &tr->tr_waiters);
+	}
+	spinlock_release(&tr->tr_spin);
+
+	threadlist_cleanup(&tr->tr_idle);
+	threadlist_cleanup(&tr->tr_waiters);
+	kfree(tr->tr_name);
+	kfree(tr);
+}
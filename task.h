@@ -0,0 +1,93 @@
+#ifndef _TASK_H_
+#define _TASK_H_
+
+/*
+ * Stackless tasks.
+ *
+ * A task is a small state machine that runs on one of a few carrier
+ * threads belonging to a taskrunner. Instead of a stack, each task
+ * carries its own state; its step function is called to advance it
+ * and returns one of:
+ *
+ *    TASK_DONE    - the task is finished; the runner forgets it.
+ *    TASK_YIELD   - put the task back on the end of the run queue.
+ *    TASK_BLOCKED - the task has parked itself on some wait queue
+ *                   (e.g. with lock_acquire_task) and will be made
+ *                   runnable again by whoever owns that queue.
+ *
+ * Because a blocked task is just a queue entry, a vehicle waiting on
+ * a segment lock costs a few words instead of a whole thread.
+ *
+ * A step function that returns TASK_BLOCKED must not touch the task
+ * after parking it: another carrier may already be running it. Save
+ * the state to resume at *before* trying the operation that parks.
+ *
+ * Operations:
+ *    task_init           - set up a task with its step function.
+ *    task_wakeup         - make a parked task runnable again.
+ *    taskrunner_create   - make a runner with NCARRIERS carrier threads.
+ *    taskrunner_submit   - hand a task to a runner.
+ *    taskrunner_wait     - block until every submitted task is done.
+ *    taskrunner_destroy  - stop the carriers and free the runner. All
+ *                          tasks must be done.
+ */
+
+#include <spinlock.h>
+#include <threadlist.h>
+
+#define TASK_DONE	0
+#define TASK_YIELD	1
+#define TASK_BLOCKED	2
+
+struct task;
+struct taskrunner;
+
+typedef int (*task_stepfn)(struct task *);
+
+struct task {
+	task_stepfn tk_step;		/* continuation */
+	void *tk_data;			/* for the step function */
+	struct taskrunner *tk_runner;	/* runner the task belongs to */
+	struct task *tk_next;		/* run queue or wait queue link */
+	unsigned tk_waitseq;		/* arrival stamp on a lock's queue */
+};
+
+/*
+ * FIFO of tasks, linked through tk_next. No locking; callers hold
+ * whatever spinlock protects the queue.
+ */
+struct taskqueue {
+	struct task *tq_head;
+	struct task *tq_tail;
+};
+
+void taskqueue_init(struct taskqueue *tq);
+int taskqueue_isempty(struct taskqueue *tq);
+void taskqueue_addtail(struct taskqueue *tq, struct task *tk);
+struct task *taskqueue_remhead(struct taskqueue *tq);
+
+/*
+ * tr_spin protects everything below it, and the two wait queues are
+ * slept on with spinlock_sleep: idle carriers on tr_idle, and threads
+ * in taskrunner_wait or taskrunner_destroy on tr_waiters.
+ */
+struct taskrunner {
+	char *tr_name;
+	struct spinlock tr_spin;
+	struct taskqueue tr_runq;	/* runnable tasks */
+	int tr_ntasks;			/* submitted and not yet done */
+	int tr_ncarriers;		/* carrier threads still running */
+	int tr_shutdown;		/* set to make carriers exit */
+	struct threadlist tr_idle;	/* carriers with nothing to run */
+	struct threadlist tr_waiters;	/* for tr_ntasks or tr_ncarriers */
+};
+
+void task_init(struct task *tk, task_stepfn step, void *data);
+void task_wakeup(struct task *tk);
+
+struct taskrunner *taskrunner_create(const char *name, int ncarriers);
+void taskrunner_submit(struct taskrunner *tr, struct task *tk);
+void taskrunner_wait(struct taskrunner *tr);
+void taskrunner_destroy(struct taskrunner *tr);
+
+#endif /* _TASK_H_ */
@@ -4,14 +4,16 @@
 #include <types.h>
 #include <lib.h>
 #include <kern/errno.h>
-#include <array.h>
 #include <machine/spl.h>
 #include <machine/pcb.h>
 #include <thread.h>
+#include <threadlist.h>
+#include <spinlock.h>
 #include <curthread.h>
 #include <scheduler.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <timestamp.h>
 #include "opt-synchprobs.h"
 
 #include <synch.h>
@@ -27,17 +29,181 @@ typedef enum {
 /* Global variable for the thread currently executing at any given time. */
 struct thread *curthread;
 
-/* Table of sleeping threads. */
-static struct array *sleepers;
+/*
+ * Threads asleep in thread_sleep, hashed by sleep address into
+ * NSLEEPHASH lists so that thread_wakeup only looks at the threads
+ * that share ADDR's bucket rather than at every sleeper.
+ */
+#define NSLEEPHASH 32
+#define SLEEPHASH(addr) ((((unsigned long)(addr)) >> 4) % NSLEEPHASH)
+static struct threadlist *sleepers;
 
 /* List of dead threads to be disposed of. */
-static struct array *zombies;
+static struct threadlist *zombies;
+
+/*
+ * Sleeping threads that have a deadline, linked through
+ * t_timeoutnode. Checked by thread_timeouts on every clock tick.
+ * A thread is only on here while it is actually asleep: whatever
+ * wakes it takes it off (see thread_canceltimeout). timeoutspin
+ * protects the list; a thread's own node only changes while its
+ * t_sleeplock is held as well.
+ */
+static struct threadlist timedsleepers;
+static struct spinlock timeoutspin = SPINLOCK_INITIALIZER;
+static void thread_timeouts(void);
+static void thread_canceltimeout(struct thread *t);
+
+/* Every thread that exists, including zombies, through t_allnode. */
+static struct threadlist allthreads;
+
+/* Nonzero while thread_account is keeping times. */
+static int statstiming;
 
 /* Process table of processes */
 //struct array *process_table;
 /* Total number of outstanding threads. Does not count zombies[]. */
 static int numthreads;
 
+/*
+ * Zombie reaper. Once started, dead threads are destroyed in batches
+ * by this low-priority thread instead of inline in mi_switch, which
+ * keeps kfree off the context switch path. Once there is a zombie the
+ * reaper gives a batch of REAPER_BATCH up to REAPER_FLUSH_USECS to
+ * build up, then destroys whatever there is. reaperspin protects the
+ * zombies list, reaperwait, where the reaper sleeps, and the shutdown
+ * handshake: thread_shutdown sets reaperstop and sleeps on reaperdone
+ * until mi_switch sees the reaper itself go by as a zombie and clears
+ * reaper.
+ */
+static struct thread *reaper;
+static struct spinlock reaperspin = SPINLOCK_INITIALIZER;
+static struct threadlist reaperwait;
+static struct threadlist reaperdone;
+static int reaperstop;
+#define REAPER_BATCH 8
+#define REAPER_FLUSH_USECS 100000
+
+/* Stack size in bytes for each TSTACK_* class. */
+static const size_t stacksizes[NTSTACKCLASSES] = {
+	STACK_SIZE,		/* TSTACK_FULL */
+	STACK_SIZE/2,		/* TSTACK_SMALL */
+};
+
+/*
+ * Guard band at the bottom end of every stack: the 4-byte magic
+ * number followed by STACK_GUARD-4 bytes of fill. Stacks grow down,
+ * so an overflow tramples the fill before it reaches the magic
+ * number or whatever lies below the allocation. thread_checkstack
+ * looks at the whole band.
+ */
+#define STACK_GUARD	64
+#define STACK_FILL	0x5a
+
+/*
+ * Stacks of destroyed threads, kept per size class for reuse by
+ * thread_fork so that bursts of short-lived threads don't round-trip
+ * through kmalloc. Protected by turning interrupts off.
+ */
+#define STACKCACHE_MAX 16
+static char *stackcache[NTSTACKCLASSES][STACKCACHE_MAX];
+static int nstackcache[NTSTACKCLASSES];
+
+/*
+ * Get a stack of class CLASS, from the cache if possible. Returns
+ * NULL if out of memory.
+ */
+static
+char *
+stack_get(int class)
+{
+	char *stack = NULL;
+	int s;
+
+	s = splhigh();
+	if (nstackcache[class] > 0) {
+		stack = stackcache[class][--nstackcache[class]];
+	}
+	splx(s);
+
+	if (stack == NULL) {
+		stack = kmalloc(stacksizes[class]);
+	}
+	return stack;
+}
+
+/*
+ * Give back a stack of class CLASS. It goes in the cache if there's
+ * room, otherwise it is freed.
+ */
+static
+void
+stack_put(char *stack, int class)
+{
+	int s;
+
+	s = splhigh();
+	if (nstackcache[class] < STACKCACHE_MAX) {
+		stackcache[class][nstackcache[class]++] = stack;
+		stack = NULL;
+	}
+	splx(s);
+
+	if (stack != NULL) {
+		kfree(stack);
+	}
+}
+
+/*
+ * Put the magic number and guard fill on the bottom end of a stack.
+ */
+static
+void
+stack_setguard(char *stack)
+{
+	int i;
+
+	stack[0] = 0xae;
+	stack[1] = 0x11;
+	stack[2] = 0xda;
+	stack[3] = 0x33;
+	for (i=4; i<STACK_GUARD; i++) {
+		stack[i] = STACK_FILL;
+	}
+}
+
+/*
+ * Check the guard band we put on the bottom end of the stack in
+ * thread_fork. If this goes off, it most likely means you overflowed
+ * your stack at some point, which can cause all kinds of mysterious
+ * other things to happen. With the smaller stack classes this is
+ * worth knowing about before it happens, so any damage to the band
+ * counts, not just to the magic number.
+ */
+static
+void
+thread_checkstack(struct thread *t)
+{
+	int i;
+
+	if (t->t_stack[0] != (char)0xae ||
+	    t->t_stack[1] != (char)0x11 ||
+	    t->t_stack[2] != (char)0xda ||
+	    t->t_stack[3] != (char)0x33) {
+		panic("Stack overflow in thread %s (%lu-byte stack): "
+		      "magic number clobbered\n",
+		      t->t_name, (unsigned long)stacksizes[t->t_stackclass]);
+	}
+	for (i=4; i<STACK_GUARD; i++) {
+		if (t->t_stack[i] != (char)STACK_FILL) {
+			panic("Stack overflow in thread %s (%lu-byte stack): "
+			      "guard band clobbered %d bytes from the end\n",
+			      t->t_name,
+			      (unsigned long)stacksizes[t->t_stackclass], i);
+		}
+	}
+}
+
 /*
  * Create a thread. This is used both to create the first thread's 
  * thread structure and to create subsequent threads.
@@ -60,7 +226,18 @@ thread_create(const char *name)
 		return NULL;
 	}
 	thread->t_sleepaddr = NULL;
+	thread->t_sleepq = NULL;
+	thread->t_sleeplock = NULL;
 	thread->t_stack = NULL;
+	thread->t_stackclass = TSTACK_FULL;
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_cpu = curcpu_id();
+	thread->t_priority = TPRI_NORMAL;
+	thread->t_deadline = 0;
+	threadlistnode_init(&thread->t_timeoutnode, thread);
+	thread->t_timedout = 0;
+	threadlistnode_init(&thread->t_allnode, thread);
+	bzero(&thread->t_stats, sizeof(thread->t_stats));
 	
 	thread->t_vmspace = NULL;
 
@@ -113,6 +290,8 @@ static
 void
 thread_destroy(struct thread *thread)
 {
+	int spl;
+
 	assert(thread != curthread);
 
 	// If you add things to the thread structure, be sure to dispose of
@@ -123,8 +302,15 @@ thread_destroy(struct thread *thread)
 	assert(thread->t_cwd==NULL);
 
 	
+	spl = splhigh();
+	threadlist_removenode(&allthreads, &thread->t_allnode);
+	splx(spl);
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	threadlistnode_cleanup(&thread->t_timeoutnode);
+	threadlistnode_cleanup(&thread->t_allnode);
 	if (thread->t_stack) {
-		kfree(thread->t_stack);
+		stack_put(thread->t_stack, thread->t_stackclass);
 	}
 	kfree(thread->t_name);
 	kfree(thread);
@@ -139,18 +325,118 @@ static
 void
 exorcise(void)
 {
-	int i, result;
+	struct thread *z;
 
 	assert(curspl>0);
 	
-	for (i=0; i<array_getnum(zombies); i++) {
-		struct thread *z = array_getguy(zombies, i);
+	for (;;) {
+		spinlock_acquire(&reaperspin);
+		z = threadlist_remhead(zombies);
+		spinlock_release(&reaperspin);
+		if (z == NULL) {
+			break;
+		}
 		assert(z!=curthread);
 		thread_destroy(z);
 	}
-	result = array_setsize(zombies, 0);
-	/* Shrinking the array; not supposed to be able to fail. */
-	assert(result==0);
+}
+
+/*
+ * Body of the reaper thread. Sleeps until there are zombies, then
+ * until a batch has built up or REAPER_FLUSH_USECS have passed, so a
+ * partial batch doesn't wait for exits that may never come. Destroys
+ * them with interrupts on, one at a time, and yields before waiting
+ * for the next batch so it never monopolizes the cpu during a burst
+ * of exits. Once reaperstop is set it destroys what there is without
+ * waiting and exits.
+ */
+static
+void
+reaper_thread(void *unused1, unsigned long unused2)
+{
+	struct thread *z;
+	int stop;
+
+	(void)unused1;
+	(void)unused2;
+
+	for (;;) {
+		spinlock_acquire(&reaperspin);
+		while (threadlist_isempty(zombies) && !reaperstop) {
+			spinlock_sleep(&reaperspin, &reaperwait);
+		}
+		if (zombies->tl_count < REAPER_BATCH && !reaperstop) {
+			spinlock_sleep_timeout(&reaperspin, &reaperwait,
+					       timestamp_us() +
+					       REAPER_FLUSH_USECS);
+		}
+		stop = reaperstop;
+		spinlock_release(&reaperspin);
+
+		for (;;) {
+			spinlock_acquire(&reaperspin);
+			z = threadlist_remhead(zombies);
+			spinlock_release(&reaperspin);
+			if (z == NULL) {
+				break;
+			}
+			assert(z != curthread);
+			thread_destroy(z);
+		}
+
+		if (stop) {
+			/* mi_switch tells reaper_stop when we're gone. */
+			return;
+		}
+		thread_yield();
+	}
+}
+
+/*
+ * Start the zombie reaper, at low priority. It only ever sleeps on
+ * its own wait queue until the first thread exits, so this is safe
+ * as soon as thread_bootstrap has a curthread (the scheduler is set
+ * up before that).
+ */
+static
+void
+reaper_start(void)
+{
+	struct thread_opts opts;
+	int result;
+
+	assert(reaper == NULL);
+
+	opts.to_stackclass = TSTACK_FULL;
+	opts.to_priority = TPRI_LOW;
+	result = thread_fork_opts("<reaper>", NULL, 0, reaper_thread, &opts,
+				  &reaper);
+	if (result) {
+		panic("reaper_start: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * Stop the reaper and wait until it has exited, i.e. is itself on
+ * the zombies list. From then on mi_switch disposes of zombies inline
+ * again, as before reaper_start.
+ */
+static
+void
+reaper_stop(void)
+{
+	assert(curthread != reaper);
+
+	spinlock_acquire(&reaperspin);
+	if (reaper != NULL) {
+		reaperstop = 1;
+		thread_wake_one(&reaperwait);
+		while (reaper != NULL) {
+			spinlock_sleep(&reaperspin, &reaperdone);
+		}
+	}
+	spinlock_release(&reaperspin);
 }
 
 /*
@@ -161,32 +447,30 @@ static
 void
 thread_killall(void)
 {
-	int i, result;
+	struct thread *t;
+	int i;
 
 	assert(curspl>0);
 
 	/*
-	 * Move all sleepers to the zombie list, to be sure they don't
+	 * Take all sleepers off the sleepers lists, to be sure they don't
 	 * wake up while we're shutting down.
 	 */
 
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
-		kprintf("sleep: Dropping thread %s\n", t->t_name);
+	for (i=0; i<NSLEEPHASH; i++) {
+		while ((t = threadlist_remhead(&sleepers[i])) != NULL) {
+			kprintf("sleep: Dropping thread %s\n", t->t_name);
 
-		/*
-		 * Don't do this: because these threads haven't
-		 * been through thread_exit, thread_destroy will
-		 * get upset. Just drop the threads on the floor,
-		 * which is safer anyway during panic.
-		 *
-		 * array_add(zombies, t);
-		 */
+			/*
+			 * Don't do this: because these threads haven't
+			 * been through thread_exit, thread_destroy will
+			 * get upset. Just drop the threads on the floor,
+			 * which is safer anyway during panic.
+			 *
+			 * threadlist_addtail(zombies, t);
+			 */
+		}
 	}
-
-	result = array_setsize(sleepers, 0);
-	/* shrinking array: not supposed to fail */
-	assert(result==0);
 }
 
 /*
@@ -208,17 +492,27 @@ struct thread *
 thread_bootstrap(void)
 {
 	struct thread *me;
+	int i;
 
 	/* Create the data structures we need. */
-	sleepers = array_create();
+	sleepers = kmalloc(NSLEEPHASH * sizeof(struct threadlist));
 	if (sleepers==NULL) {
-		panic("Cannot create sleepers array\n");
+		panic("Cannot create sleepers list\n");
+	}
+	for (i=0; i<NSLEEPHASH; i++) {
+		threadlist_init(&sleepers[i]);
 	}
 
-	zombies = array_create();
+	zombies = kmalloc(sizeof(struct threadlist));
 	if (zombies==NULL) {
-		panic("Cannot create zombies array\n");
+		panic("Cannot create zombies list\n");
 	}
+	threadlist_init(zombies);
+	threadlist_init(&reaperwait);
+	threadlist_init(&reaperdone);
+
+	threadlist_init(&timedsleepers);
+	threadlist_init(&allthreads);
   /* Initiate global process table. */
   process_table = table_init(TABLESIZE);
 
@@ -249,6 +543,10 @@ thread_bootstrap(void)
 
 	/* Number of threads starts at 1 */
 	numthreads = 1;
+	threadlist_addtailnode(&allthreads, &me->t_allnode);
+
+	/* From here on exited threads go to the reaper. */
+	reaper_start();
 
 	/* Done */
 	return me;
@@ -260,9 +558,33 @@ thread_bootstrap(void)
 void
 thread_shutdown(void)
 {
-	array_destroy(sleepers);
+	int s, i;
+
+	/*
+	 * Stop the reaper, so nothing is being destroyed (and no stack
+	 * going back in the cache) behind our back, then dispose of the
+	 * zombies it didn't get to, the reaper's own thread included.
+	 */
+	reaper_stop();
+	s = splhigh();
+	exorcise();
+
+	for (i=0; i<NTSTACKCLASSES; i++) {
+		while (nstackcache[i] > 0) {
+			kfree(stackcache[i][--nstackcache[i]]);
+		}
+	}
+	splx(s);
+
+	for (i=0; i<NSLEEPHASH; i++) {
+		threadlist_cleanup(&sleepers[i]);
+	}
+	kfree(sleepers);
 	sleepers = NULL;
-	array_destroy(zombies);
+	threadlist_cleanup(&reaperwait);
+	threadlist_cleanup(&reaperdone);
+	threadlist_cleanup(zombies);
+	kfree(zombies);
 	zombies = NULL;
 	table_destroy(process_table);
 	// Don't do this - it frees our stack and we blow up
@@ -279,9 +601,35 @@ thread_fork(const char *name,
 	    void *data1, unsigned long data2,
 	    void (*func)(void *, unsigned long),
 	    struct thread **ret)
+{
+	return thread_fork_opts(name, data1, data2, func, NULL, ret);
+}
+
+/*
+ * Same as thread_fork, with options. OPTS may be NULL for defaults.
+ */
+int
+thread_fork_opts(const char *name, 
+		 void *data1, unsigned long data2,
+		 void (*func)(void *, unsigned long),
+		 const struct thread_opts *opts,
+		 struct thread **ret)
 {
 	struct thread *newguy;
 	int s, result;
+	int stackclass = TSTACK_FULL;
+	int priority = TPRI_NORMAL;
+
+	if (opts != NULL) {
+		stackclass = opts->to_stackclass;
+		if (stackclass < 0 || stackclass >= NTSTACKCLASSES) {
+			return EINVAL;
+		}
+		priority = opts->to_priority;
+		if (priority < 0 || priority >= NTPRIS) {
+			return EINVAL;
+		}
+	}
 
 	/* Allocate a thread */
 	newguy = thread_create(name);
@@ -290,18 +638,18 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
-	newguy->t_stack = kmalloc(STACK_SIZE);
+	newguy->t_stackclass = stackclass;
+	newguy->t_stack = stack_get(stackclass);
 	if (newguy->t_stack==NULL) {
 		kfree(newguy->t_name);
 		kfree(newguy);
 		return ENOMEM;
 	}
 
-	/* stick a magic number on the bottom end of the stack */
-	newguy->t_stack[0] = 0xae;
-	newguy->t_stack[1] = 0x11;
-	newguy->t_stack[2] = 0xda;
-	newguy->t_stack[3] = 0x33;
+	/* stick a guard band on the bottom end of the stack */
+	stack_setguard(newguy->t_stack);
+
+	newguy->t_priority = priority;
 
 	/* Inherit the current directory */
 	if (curthread->t_cwd != NULL) {
@@ -309,30 +657,24 @@ thread_fork(const char *name,
 		newguy->t_cwd = curthread->t_cwd;
 	}
 
-	/* Set up the pcb (this arranges for func to be called) */
-	md_initpcb(&newguy->t_pcb, newguy->t_stack, data1, data2, func);
-
-	/* Interrupts off for atomicity */
-	s = splhigh();
-
 	/*
-	 * Make sure our data structures have enough space, so we won't
-	 * run out later at an inconvenient time.
+	 * Set up the pcb (this arranges for func to be called).
+	 * md_initpcb puts the initial frame (and the kernel stack
+	 * pointer) at stack+STACK_SIZE, so for smaller classes hand it
+	 * a base shifted down such that the top lands at the real end
+	 * of our allocation. It never touches memory below the top.
 	 */
-	result = array_preallocate(sleepers, numthreads+1);
-	if (result) {
-		goto fail;
-	}
-	result = array_preallocate(zombies, numthreads+1);
-	if (result) {
-		goto fail;
-	}
+	md_initpcb(&newguy->t_pcb,
+		   newguy->t_stack + stacksizes[stackclass] - STACK_SIZE,
+		   data1, data2, func);
 
-	/* Do the same for the scheduler. */
-	result = scheduler_preallocate(numthreads+1);
-	if (result) {
-		goto fail;
-	}
+	/*
+	 * Interrupts off for atomicity. Nothing in here allocates: the
+	 * run, sleep and zombie queues all link through t_listnode, so
+	 * there is no per-fork preallocation and the interrupts-off
+	 * window is constant no matter how many threads exist.
+	 */
+	s = splhigh();
 
 	/* Make the new thread runnable */
 	result = make_runnable(newguy);
@@ -342,11 +684,11 @@ thread_fork(const char *name,
 
 	/*
 	 * Increment the thread counter. This must be done atomically
-	 * with the preallocate calls; otherwise the count can be
-	 * temporarily too low, which would obviate its reason for
-	 * existence.
+	 * with make_runnable; otherwise the count can be temporarily
+	 * too low.
 	 */
 	numthreads++;
+	threadlist_addtailnode(&allthreads, &newguy->t_allnode);
 
 	/* Assign PPID */
 	newguy -> ppid = curthread -> pid;
@@ -385,13 +727,126 @@ thread_fork(const char *name,
 	if (newguy->t_cwd != NULL) {
 		VOP_DECREF(newguy->t_cwd);
 	}
-	kfree(newguy->t_stack);
+	stack_put(newguy->t_stack, newguy->t_stackclass);
 	kfree(newguy->t_name);
 	kfree(newguy);
 
 	return result;
 }
 
+/*
+ * Add the time since T's last state change to *BUCKET (one of T's
+ * ts_*time fields) and start timing its new state. Does nothing
+ * unless timing was started, so the clock isn't read on every switch
+ * otherwise. Interrupts must be off.
+ */
+static
+void
+thread_account(struct thread *t, u_int32_t *bucket)
+{
+	u_int32_t now;
+
+	if (!statstiming) {
+		return;
+	}
+	now = timestamp_us();
+	*bucket += now - t->t_stats.ts_stamp;
+	t->t_stats.ts_stamp = now;
+}
+
+void
+thread_stats_start(void)
+{
+	struct threadlistnode *tln;
+	u_int32_t now;
+	int spl;
+
+	spl = splhigh();
+	now = timestamp_us();
+	THREADLIST_FORALL(tln, &allthreads) {
+		struct thread *t = tln->tln_self;
+		bzero(&t->t_stats, sizeof(t->t_stats));
+		t->t_stats.ts_stamp = now;
+	}
+	statstiming = 1;
+	splx(spl);
+}
+
+void
+thread_stats_stop(void)
+{
+	int spl;
+
+	spl = splhigh();
+	/* Close out the caller's run so far. */
+	thread_account(curthread, &curthread->t_stats.ts_runtime);
+	statstiming = 0;
+	splx(spl);
+}
+
+/*
+ * Sort key for thread_stats_print.
+ */
+static
+u_int32_t
+thread_stats_key(const struct thread *t)
+{
+	if (t->t_stats.ts_runtime > 0) {
+		return t->t_stats.ts_runtime;
+	}
+	return t->t_stats.ts_yields + t->t_stats.ts_sleeps +
+		t->t_stats.ts_preempts;
+}
+
+void
+thread_stats_print(int top)
+{
+	struct threadlistnode *tln;
+	struct thread **sorted;
+	int spl, n, i, j;
+
+	assert(top > 0);
+
+	/* Interrupts off so no thread goes away while we look at it. */
+	spl = splhigh();
+
+	sorted = kmalloc(allthreads.tl_count * sizeof(struct thread *));
+	if (sorted == NULL) {
+		splx(spl);
+		kprintf("thread_stats_print: out of memory\n");
+		return;
+	}
+
+	/* Insertion sort, largest first. */
+	n = 0;
+	THREADLIST_FORALL(tln, &allthreads) {
+		struct thread *t = tln->tln_self;
+		for (i = n; i > 0 && thread_stats_key(sorted[i-1]) <
+			     thread_stats_key(t); i--) {
+			sorted[i] = sorted[i-1];
+		}
+		sorted[i] = t;
+		n++;
+	}
+
+	kprintf("%-16s %8s %8s %8s %10s %10s %10s\n", "thread",
+		"yields", "sleeps", "preempts", "run ms", "ready ms",
+		"sleep ms");
+	for (j = 0; j < n && j < top; j++) {
+		const struct threadstats *ts = &sorted[j]->t_stats;
+		kprintf("%-16.16s %8u %8u %8u %10u %10u %10u\n",
+			sorted[j]->t_name, ts->ts_yields, ts->ts_sleeps,
+			ts->ts_preempts, ts->ts_runtime / 1000,
+			ts->ts_readytime / 1000, ts->ts_sleeptime / 1000);
+	}
+	if (n > top) {
+		kprintf("(%d more)\n", n - top);
+	}
+
+	kfree(sorted);
+	splx(spl);
+}
+
 /*
  * High level, machine-independent context switch code.
  */
@@ -406,17 +861,7 @@ mi_switch(threadstate_t nextstate)
 	assert(curspl>0);
 
 	if (curthread != NULL && curthread->t_stack != NULL) {
-		/*
-		 * Check the magic number we put on the bottom end of
-		 * the stack in thread_fork. If these assertions go
-		 * off, it most likely means you overflowed your stack
-		 * at some point, which can cause all kinds of
-		 * mysterious other things to happen.
-		 */
-		assert(curthread->t_stack[0] == (char)0xae);
-		assert(curthread->t_stack[1] == (char)0x11);
-		assert(curthread->t_stack[2] == (char)0xda);
-		assert(curthread->t_stack[3] == (char)0x33);
+		thread_checkstack(curthread);
 	}
 	
 	/* 
@@ -430,32 +875,65 @@ mi_switch(threadstate_t nextstate)
 	cur = curthread;
 	curthread = NULL;
 
+	/* Charge the time just spent to running, and count the switch. */
+	thread_account(cur, &cur->t_stats.ts_runtime);
+	if (nextstate==S_READY) {
+		if (in_interrupt) {
+			cur->t_stats.ts_preempts++;
+		}
+		else {
+			cur->t_stats.ts_yields++;
+		}
+	}
+	else if (nextstate==S_SLEEP) {
+		cur->t_stats.ts_sleeps++;
+	}
+
 	/*
 	 * Stash the current thread on whatever list it's supposed to go on.
-	 * Because we preallocate during thread_fork, this should not fail.
+	 * The lists link through t_listnode, so this cannot fail.
 	 */
 
 	if (nextstate==S_READY) {
 		result = make_runnable(cur);
+		assert(result==0);
 	}
 	else if (nextstate==S_SLEEP) {
-		/*
-		 * Because we preallocate sleepers[] during thread_fork,
-		 * this should never fail.
-		 */
-		result = array_add(sleepers, cur);
+		threadlist_addtail(cur->t_sleepq, cur);
+
+		/* Now a waker can find us; let it (see thread_sleep_on). */
+		if (cur->t_sleeplock != NULL) {
+			spinlock_unlock(cur->t_sleeplock);
+		}
 	}
 	else {
 		assert(nextstate==S_ZOMB);
-		result = array_add(zombies, cur);
+
+		/*
+		 * The first zombie starts the reaper's flush timeout; a
+		 * full batch cuts it short. If this is the reaper itself
+		 * exiting, it is off the cpu for good once we switch, so
+		 * reaper_stop can stop waiting.
+		 */
+		spinlock_acquire(&reaperspin);
+		threadlist_addtail(zombies, cur);
+		if (cur == reaper) {
+			reaper = NULL;
+			thread_wake_all(&reaperdone);
+		}
+		else if (zombies->tl_count == 1 ||
+			 zombies->tl_count >= REAPER_BATCH) {
+			thread_wake_one(&reaperwait);
+		}
+		spinlock_release(&reaperspin);
 	}
-	assert(result==0);
 
 	/*
-	 * Call the scheduler (must come *after* the array_adds)
+	 * Call the scheduler (must come *after* the list adds)
 	 */
 
 	next = scheduler();
+	thread_account(next, &next->t_stats.ts_readytime);
 
 	/* update curthread */
 	curthread = next;
@@ -472,9 +950,13 @@ mi_switch(threadstate_t nextstate)
 	 * or not apply to new threads.
 	 *
 	 * exorcise is skippable; as_activate is done in mi_threadstart.
+	 * Once the reaper is running it owns the zombies and we leave
+	 * them alone here.
 	 */
 
-	exorcise();
+	if (reaper == NULL) {
+		exorcise();
+	}
 
 	if (curthread->t_vmspace) {
 		as_activate(curthread->t_vmspace);
@@ -486,23 +968,13 @@ mi_switch(threadstate_t nextstate)
  *
  * We clean up the parts of the thread structure we don't actually
  * need to run right away. The rest has to wait until thread_destroy
- * gets called from exorcise().
+ * gets called from the reaper (or exorcise(), before it starts).
  */
 void
 thread_exit(void)
 {
 	if (curthread->t_stack != NULL) {
-		/*
-		 * Check the magic number we put on the bottom end of
-		 * the stack in thread_fork. If these assertions go
-		 * off, it most likely means you overflowed your stack
-		 * at some point, which can cause all kinds of
-		 * mysterious other things to happen.
-		 */
-		assert(curthread->t_stack[0] == (char)0xae);
-		assert(curthread->t_stack[1] == (char)0x11);
-		assert(curthread->t_stack[2] == (char)0xda);
-		assert(curthread->t_stack[3] == (char)0x33);
+		thread_checkstack(curthread);
 	}
 
 	splhigh();
@@ -541,6 +1013,13 @@ thread_yield(void)
 	/* Check sleepers just in case we get here after shutdown */
 	assert(sleepers != NULL);
 
+	/*
+	 * The clock interrupt yields on every tick (including while the
+	 * scheduler idles, when mi_switch below does nothing), so this
+	 * is where sleep deadlines get noticed.
+	 */
+	thread_timeouts();
+
 	mi_switch(S_READY);
 	splx(spl);
 }
@@ -555,6 +1034,10 @@ thread_yield(void)
  * Note that (1) interrupts must be off (if they aren't, you can
  * end up sleeping forever), and (2) you cannot sleep in an 
  * interrupt handler.
+ *
+ * This is the old interface, kept for code that still keys its sleeps
+ * by address; nothing in the thread system or synch.c uses it any
+ * more. Wait queues (thread_sleep_on) are cheaper and FIFO.
  */
 void
 thread_sleep(const void *addr)
@@ -563,38 +1046,185 @@ thread_sleep(const void *addr)
 	assert(in_interrupt==0);
 	
 	curthread->t_sleepaddr = addr;
+	curthread->t_sleepq = &sleepers[SLEEPHASH(addr)];
 	mi_switch(S_SLEEP);
 	curthread->t_sleepaddr = NULL;
 }
 
+/*
+ * Go to sleep on wait queue WQ, at the back. thread_wake_one on WQ
+ * wakes sleepers in the order they arrived. Like thread_sleep,
+ * interrupts must be off and this may not be called from an
+ * interrupt handler. Whatever lock protects WQ must be held (with a
+ * spinlock, use spinlock_sleep instead of calling this directly).
+ */
+void
+thread_sleep_on(struct threadlist *wq, struct spinlock *sl)
+{
+	// may not sleep in an interrupt handler
+	assert(in_interrupt==0);
+	assert(curspl>0);
+	assert(wq != NULL);
+	assert(sl == NULL || spinlock_do_i_hold(sl));
+
+	curthread->t_sleepq = wq;
+	curthread->t_sleeplock = sl;
+	mi_switch(S_SLEEP);
+	curthread->t_sleeplock = NULL;
+}
+
+/*
+ * Sleep on WQ as thread_sleep_on does, but with a deadline. See
+ * thread_timeouts for how the deadline is enforced.
+ */
+int
+thread_sleep_on_timeout(struct threadlist *wq, struct spinlock *sl,
+			u_int32_t deadline)
+{
+	// may not sleep in an interrupt handler
+	assert(in_interrupt==0);
+	assert(curspl>0);
+	assert(sl != NULL);
+
+	/*
+	 * thread_timeouts finds us through the node and goes straight
+	 * for t_sleeplock, so set that (and t_sleepq) before the node is
+	 * published; timeoutspin orders the stores for it.
+	 */
+	curthread->t_sleepq = wq;
+	curthread->t_sleeplock = sl;
+	curthread->t_deadline = deadline;
+	curthread->t_timedout = 0;
+	spinlock_acquire(&timeoutspin);
+	threadlist_addtailnode(&timedsleepers, &curthread->t_timeoutnode);
+	spinlock_release(&timeoutspin);
+
+	thread_sleep_on(wq, sl);
+
+	/* Whoever woke us already took us off the timeout list. */
+	assert(curthread->t_timeoutnode.tln_next == NULL);
+	return curthread->t_timedout;
+}
+
+/*
+ * Take T off the timeout list, if it is on it. Anything that wakes a
+ * sleeper must call this before making it runnable; otherwise a tick
+ * past the deadline would "time out" a thread that is no longer
+ * asleep, pulling it off a queue it isn't on and reporting a timeout
+ * for a wakeup that did happen. Interrupts must be off, and T's
+ * t_sleeplock (if any) held, which keeps the node from changing
+ * under the unlocked check.
+ */
+static
+void
+thread_canceltimeout(struct thread *t)
+{
+	if (t->t_timeoutnode.tln_next != NULL) {
+		spinlock_acquire(&timeoutspin);
+		threadlist_removenode(&timedsleepers, &t->t_timeoutnode);
+		spinlock_release(&timeoutspin);
+	}
+}
+
+/*
+ * Wake up every timed sleeper whose deadline has passed. Costs nothing
+ * beyond an emptiness check when nobody has a deadline.
+ * Interrupts must be off.
+ *
+ * A sleeper's wait queue belongs to whatever it sleeps on and is only
+ * touched with that object's spinlock (t_sleeplock) held. Wakers hold
+ * that spinlock when they take timeoutspin to cancel the timeout, so
+ * here, holding timeoutspin, we can only try for it. If it's busy the
+ * sleeper is being woken, or is still on its way to sleep; either way
+ * the next tick looks again.
+ */
+static
+void
+thread_timeouts(void)
+{
+	struct threadlistnode *tln, *next;
+	struct spinlock *sl;
+	u_int32_t now;
+	int result;
+
+	assert(curspl>0);
+
+	/* Unlocked peek; a sleeper added just now waits for a tick. */
+	if (threadlist_isempty(&timedsleepers)) {
+		return;
+	}
+
+	now = timestamp_us();
+	spinlock_acquire(&timeoutspin);
+	for (tln = timedsleepers.tl_head.tln_next;
+	     tln != &timedsleepers.tl_tail; tln = next) {
+		struct thread *t = tln->tln_self;
+
+		next = tln->tln_next;
+
+		/* Signed difference, so the clock wrapping is harmless. */
+		if ((int32_t)(now - t->t_deadline) < 0) {
+			continue;
+		}
+
+		sl = t->t_sleeplock;
+		assert(sl != NULL);
+		if (!spinlock_tryacquire(sl)) {
+			continue;
+		}
+
+		/* Still asleep, or it wouldn't be on the list. */
+		assert(t->t_sleepq != NULL);
+
+		threadlist_removenode(&timedsleepers, tln);
+		t->t_timedout = 1;
+		threadlist_remove(t->t_sleepq, t);
+		t->t_sleepq = NULL;
+		thread_account(t, &t->t_stats.ts_sleeptime);
+		result = make_runnable(t);
+		assert(result==0);
+		spinlock_release(sl);
+	}
+	spinlock_release(&timeoutspin);
+}
+
 /*
  * Wake up one or more threads who are sleeping on "sleep address"
- * ADDR.
+ * ADDR. Only ADDR's bucket of sleepers is searched; other addresses
+ * that hash there cost a comparison each.
  */
 void
 thread_wakeup(const void *addr)
 {
-	int i, result;
+	struct threadlist *bucket;
+	struct threadlistnode *tln, *next;
+	int result;
 	
 	// meant to be called with interrupts off
 	assert(curspl>0);
 	
-	// This is inefficient. Feel free to improve it.
-	
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
+	bucket = &sleepers[SLEEPHASH(addr)];
+	for (tln = bucket->tl_head.tln_next; tln != &bucket->tl_tail;
+	     tln = next) {
+		struct thread *t = tln->tln_self;
+
+		// Removing t unlinks tln, so step past it first.
+		next = tln->tln_next;
+
 		if (t->t_sleepaddr == addr) {
-			
-			// Remove from list
-			array_remove(sleepers, i);
-			
-			// must look at the same sleepers[i] again
-			i--;
+			threadlist_remove(bucket, t);
+			t->t_sleepq = NULL;
+			thread_canceltimeout(t);
+			thread_account(t, &t->t_stats.ts_sleeptime);
 
 			/*
-			 * Because we preallocate during thread_fork,
-			 * this should never fail.
+			 * Run it where we are: whatever it was waiting
+			 * for (a lock we just released, say) was last
+			 * touched on this CPU.
 			 */
+			t->t_cpu = curcpu_id();
+
+			/* The run queue never allocates; cannot fail. */
 			result = make_runnable(t);
 			assert(result==0);
 		}
@@ -602,24 +1232,71 @@ thread_wakeup(const void *addr)
 }
 
 /*
- * Return nonzero if there are any threads who are sleeping on "sleep address"
- * ADDR. This is meant to be used only for diagnostic purposes.
+ * Make thread T, asleep on wait queue WQ, runnable again.
  */
-int
-thread_hassleepers(const void *addr)
+static
+void
+thread_wake(struct threadlist *wq, struct thread *t)
 {
-	int i;
-	
+	int result;
+
+	assert(t->t_sleepq == wq);
+	t->t_sleepq = NULL;
+	thread_canceltimeout(t);
+	thread_account(t, &t->t_stats.ts_sleeptime);
+
+	/* As in thread_wakeup, prefer the waker's CPU. */
+	t->t_cpu = curcpu_id();
+
+	result = make_runnable(t);
+	assert(result==0);
+}
+
+/*
+ * Wake the thread that has been asleep on WQ the longest, if any.
+ * Returns the thread woken, or NULL.
+ */
+struct thread *
+thread_wake_one(struct threadlist *wq)
+{
+	struct thread *t;
+
 	// meant to be called with interrupts off
 	assert(curspl>0);
-	
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
-		if (t->t_sleepaddr == addr) {
-			return 1;
-		}
+
+	t = threadlist_remhead(wq);
+	if (t != NULL) {
+		thread_wake(wq, t);
 	}
-	return 0;
+	return t;
+}
+
+/*
+ * Wake every thread asleep on WQ, oldest first.
+ */
+void
+thread_wake_all(struct threadlist *wq)
+{
+	struct thread *t;
+
+	// meant to be called with interrupts off
+	assert(curspl>0);
+
+	while ((t = threadlist_remhead(wq)) != NULL) {
+		thread_wake(wq, t);
+	}
+}
+
+/*
+ * Return nonzero if there are any threads asleep on wait queue WQ.
+ */
+int
+thread_hassleepers(struct threadlist *wq)
+{
+	// meant to be called with interrupts off
+	assert(curspl>0);
+
+	return !threadlist_isempty(wq);
 }
 
 /*
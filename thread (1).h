@@ -8,9 +8,27 @@
 /* Get machine-dependent stuff */
 #include <machine/pcb.h>
 #include <synch.h>
+#include <threadlist.h>
 #define TABLESIZE 128
 
 struct addrspace;
+struct spinlock;
+
+/*
+ * Per-thread scheduling statistics, kept up to date by mi_switch and
+ * the wakeup functions. The switch counts are always kept; the times
+ * (microseconds, wrapping after about 71 minutes) only between
+ * thread_stats_start and thread_stats_stop.
+ */
+struct threadstats {
+	unsigned ts_yields;	/* voluntary: thread_yield */
+	unsigned ts_sleeps;	/* voluntary: went to sleep */
+	unsigned ts_preempts;	/* involuntary: clock interrupt */
+	u_int32_t ts_runtime;	/* time spent running */
+	u_int32_t ts_readytime;	/* time spent on a run queue */
+	u_int32_t ts_sleeptime;	/* time spent asleep */
+	u_int32_t ts_stamp;	/* when the current state began */
+};
 
 struct thread {
 	/**********************************************************/
@@ -19,8 +37,33 @@ struct thread {
 	
 	struct pcb t_pcb;
 	char *t_name;
-	const void *t_sleepaddr;
+	const void *t_sleepaddr;	/* thread_sleep only */
+	struct threadlist *t_sleepq;	/* wait queue we're asleep on */
+	struct spinlock *t_sleeplock;	/* spinlock protecting t_sleepq */
+	unsigned t_waitseq;	/* arrival stamp on a lock's queue */
 	char *t_stack;
+	int t_stackclass;	/* TSTACK_* size class of t_stack */
+	int t_cpu;		/* CPU whose run queue to use (a hint) */
+	int t_priority;		/* TPRI_* scheduling class */
+
+	/*
+	 * Link for whichever queue the thread is on: the run queue when
+	 * ready, t_sleepq when asleep, the zombies list when
+	 * dead. A thread is only ever in one of those states at a time.
+	 */
+	struct threadlistnode t_listnode;
+
+	/*
+	 * Timed sleeps (thread_sleep_on_timeout): the deadline, the link
+	 * for the list of threads that have one, and whether it passed.
+	 */
+	u_int32_t t_deadline;
+	struct threadlistnode t_timeoutnode;
+	int t_timedout;
+
+	/* Link on the list of all threads, and scheduling statistics. */
+	struct threadlistnode t_allnode;
+	struct threadstats t_stats;
 	
 	/**********************************************************/
 	/* Public thread members - can be used by other code      */
@@ -67,7 +110,10 @@ struct thread_supp {
 // Process Table array to store thread
 struct thread_supp **process_table;
 
-/* Call once during startup to allocate data structures. */
+/*
+ * Call once during startup, after scheduler_bootstrap, to allocate
+ * data structures. Also starts the zombie reaper thread.
+ */
 struct thread *thread_bootstrap(void);
 
 /* Call during panic to stop other threads in their tracks */
@@ -91,6 +137,45 @@ int thread_fork(const char *name,
 		void (*func)(void *, unsigned long),
 		struct thread **ret);
 
+/*
+ * Stack size classes. Threads that run short leaf functions don't
+ * need a full STACK_SIZE stack; picking a smaller class lets many more
+ * of them exist at once. The bottom of every stack carries a guard
+ * band that is checked on each context switch, so running off the
+ * end of a too-small stack panics instead of corrupting memory.
+ */
+#define TSTACK_FULL	0	/* STACK_SIZE bytes (the default) */
+#define TSTACK_SMALL	1	/* STACK_SIZE/2 bytes */
+#define NTSTACKCLASSES	2
+
+/*
+ * Scheduling classes. A low-priority thread runs when nothing normal
+ * is ready, and now and then regardless so it can't starve (see
+ * scheduler.c). For background housekeeping such as the reaper.
+ */
+#define TPRI_NORMAL	0	/* the default */
+#define TPRI_LOW	1
+#define NTPRIS		2
+
+/*
+ * Options for thread_fork_opts.
+ */
+struct thread_opts {
+	int to_stackclass;	/* one of TSTACK_* */
+	int to_priority;	/* one of TPRI_* */
+};
+
+/*
+ * Like thread_fork, but takes an options structure. OPTS may be NULL,
+ * which gives the same result as thread_fork. Returns EINVAL for a bad
+ * stack class or priority.
+ */
+int thread_fork_opts(const char *name, 
+		     void *data1, unsigned long data2, 
+		     void (*func)(void *, unsigned long),
+		     const struct thread_opts *opts,
+		     struct thread **ret);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -109,6 +194,10 @@ void thread_yield(void);
  * go to sleep until wakeup() is called on the same address. The
  * address is treated as a key and is not interpreted or dereferenced.
  * Interrupts must be disabled.
+ *
+ * Legacy: kept for code that keys its sleeps by address. Nothing in
+ * the thread system, synch.c or the task runner uses it; new code
+ * should use the wait queues below.
  */
 void thread_sleep(const void *addr);
 
@@ -119,11 +208,49 @@ void thread_sleep(const void *addr);
 void thread_wakeup(const void *addr);
 
 /*
- * Return nonzero if there are any threads sleeping on the specified
- * address. Meant only for diagnostic purposes.
+ * Wait queues. A synchronization object can embed a struct threadlist
+ * as a FIFO wait queue instead of having its waiters found by sleep
+ * address, so waking one is O(1) and waiters wake in arrival order.
+ * All of these need interrupts disabled and the lock protecting the
+ * queue held.
+ *
+ *    thread_sleep_on    - go to sleep at the back of WQ. SL is the
+ *                         spinlock protecting WQ, or NULL if having
+ *                         interrupts off is enough; it is released
+ *                         once we are on WQ (interrupts stay off) and
+ *                         is not held on return.
+ *    thread_sleep_on_timeout - the same, but also wake once the
+ *                         timestamp_us() clock reaches DEADLINE. SL
+ *                         may not be NULL: the deadline check takes
+ *                         it to pull us off WQ. Returns 0 if woken
+ *                         through WQ and nonzero if the deadline
+ *                         passed first. Deadlines are checked on every
+ *                         clock tick, so the sleep may run over by up
+ *                         to a tick.
+ *    thread_wake_one    - wake the longest sleeper on WQ. Returns
+ *                         the thread woken, or NULL if WQ was empty.
+ *    thread_wake_all    - wake everything on WQ.
+ *    thread_hassleepers - return nonzero if anything is asleep on WQ.
  */
-int thread_hassleepers(const void *addr);
+void thread_sleep_on(struct threadlist *wq, struct spinlock *sl);
+int thread_sleep_on_timeout(struct threadlist *wq, struct spinlock *sl,
+			    u_int32_t deadline);
+struct thread *thread_wake_one(struct threadlist *wq);
+void thread_wake_all(struct threadlist *wq);
+int thread_hassleepers(struct threadlist *wq);
 
+/*
+ * Scheduling statistics (see struct threadstats).
+ *    thread_stats_start - zero every thread's statistics and start
+ *                         timing.
+ *    thread_stats_stop  - stop timing. Counts keep going.
+ *    thread_stats_print - list the TOP threads that have run longest
+ *                         (or, with timing never started, switched
+ *                         most).
+ */
+void thread_stats_start(void);
+void thread_stats_stop(void);
+void thread_stats_print(int top);
 
 /*
  * Private thread functions.
@@ -0,0 +1,181 @@
+/*
+ * Intrusive thread list.
+ * See threadlist.h for specifications of the functions.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <thread.h>
+#include <threadlist.h>
+
+void
+threadlistnode_init(struct threadlistnode *tln, struct thread *self)
+{
+	assert(tln != NULL);
+	assert(self != NULL);
+
+	tln->tln_prev = NULL;
+	tln->tln_next = NULL;
+	tln->tln_self = self;
+}
+
+void
+threadlistnode_cleanup(struct threadlistnode *tln)
+{
+	assert(tln != NULL);
+
+	/* Must not still be on a list. */
+	assert(tln->tln_prev == NULL);
+	assert(tln->tln_next == NULL);
+	tln->tln_self = NULL;
+}
+
+void
+threadlist_init(struct threadlist *tl)
+{
+	assert(tl != NULL);
+
+	tl->tl_head.tln_prev = NULL;
+	tl->tl_head.tln_next = &tl->tl_tail;
+	tl->tl_head.tln_self = NULL;
+	tl->tl_tail.tln_prev = &tl->tl_head;
+	tl->tl_tail.tln_next = NULL;
+	tl->tl_tail.tln_self = NULL;
+	tl->tl_count = 0;
+}
+
+void
+threadlist_cleanup(struct threadlist *tl)
+{
+	assert(tl != NULL);
+	assert(tl->tl_head.tln_next == &tl->tl_tail);
+	assert(tl->tl_tail.tln_prev == &tl->tl_head);
+	assert(tl->tl_count == 0);
+}
+
+int
+threadlist_isempty(struct threadlist *tl)
+{
+	assert(tl != NULL);
+	return (tl->tl_count == 0);
+}
+
+/*
+ * Link NEW in between PREV and PREV->tln_next.
+ */
+static
+void
+threadlist_insertafter(struct threadlistnode *prev, struct threadlistnode *new)
+{
+	assert(new->tln_prev == NULL);
+	assert(new->tln_next == NULL);
+
+	new->tln_prev = prev;
+	new->tln_next = prev->tln_next;
+	new->tln_prev->tln_next = new;
+	new->tln_next->tln_prev = new;
+}
+
+/*
+ * Unlink TLN from whatever list it is on.
+ */
+static
+void
+threadlist_unlink(struct threadlistnode *tln)
+{
+	assert(tln->tln_prev != NULL);
+	assert(tln->tln_next != NULL);
+
+	tln->tln_prev->tln_next = tln->tln_next;
+	tln->tln_next->tln_prev = tln->tln_prev;
+	tln->tln_prev = NULL;
+	tln->tln_next = NULL;
+}
+
+void
+threadlist_addhead(struct threadlist *tl, struct thread *t)
+{
+	assert(tl != NULL);
+	assert(t != NULL);
+
+	threadlist_insertafter(&tl->tl_head, &t->t_listnode);
+	tl->tl_count++;
+}
+
+void
+threadlist_addtail(struct threadlist *tl, struct thread *t)
+{
+	assert(tl != NULL);
+	assert(t != NULL);
+
+	threadlist_insertafter(tl->tl_tail.tln_prev, &t->t_listnode);
+	tl->tl_count++;
+}
+
+struct thread *
+threadlist_remhead(struct threadlist *tl)
+{
+	struct threadlistnode *tln;
+
+	assert(tl != NULL);
+
+	tln = tl->tl_head.tln_next;
+	if (tln->tln_next == NULL) {
+		/* That was the tail sentinel; list is empty. */
+		return NULL;
+	}
+	threadlist_unlink(tln);
+	assert(tl->tl_count > 0);
+	tl->tl_count--;
+	return tln->tln_self;
+}
+
+struct thread *
+threadlist_remtail(struct threadlist *tl)
+{
+	struct threadlistnode *tln;
+
+	assert(tl != NULL);
+
+	tln = tl->tl_tail.tln_prev;
+	if (tln->tln_prev == NULL) {
+		/* That was the head sentinel; list is empty. */
+		return NULL;
+	}
+	threadlist_unlink(tln);
+	assert(tl->tl_count > 0);
+	tl->tl_count--;
+	return tln->tln_self;
+}
+
+void
+threadlist_remove(struct threadlist *tl, struct thread *t)
+{
+	assert(tl != NULL);
+	assert(t != NULL);
+
+	threadlist_unlink(&t->t_listnode);
+	assert(tl->tl_count > 0);
+	tl->tl_count--;
+}
+
+void
+threadlist_addtailnode(struct threadlist *tl, struct threadlistnode *tln)
+{
+	assert(tl != NULL);
+	assert(tln != NULL);
+
+	threadlist_insertafter(tl->tl_tail.tln_prev, tln);
+	tl->tl_count++;
+}
+
+void
+threadlist_removenode(struct threadlist *tl, struct threadlistnode *tln)
+{
+	assert(tl != NULL);
+	assert(tln != NULL);
+
+	threadlist_unlink(tln);
+	assert(tl->tl_count > 0);
+	tl->tl_count--;
+}
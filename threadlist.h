@@ -0,0 +1,78 @@
+#ifndef _THREADLIST_H_
+#define _THREADLIST_H_
+
+/*
+ * Intrusive doubly-linked list of threads.
+ *
+ * The list node lives inside struct thread (t_listnode), so putting a
+ * thread on the run queue, a sleep queue, or the zombie list never
+ * allocates memory and can therefore never fail. A thread can be on
+ * at most one list through a given node at a time.
+ *
+ * The head and tail are sentinel nodes, which keeps insertion and
+ * removal free of special cases. All operations are O(1).
+ *
+ * None of these functions do any locking; the caller is expected to
+ * have interrupts off or otherwise own the list.
+ *
+ * Operations:
+ *    threadlistnode_init    - initialize a node; SELF is the owning thread.
+ *    threadlistnode_cleanup - check that a node is not on any list.
+ *    threadlist_init        - initialize an empty list.
+ *    threadlist_cleanup     - check that a list is empty before disposal.
+ *    threadlist_isempty     - return nonzero if the list is empty.
+ *    threadlist_addhead     - insert a thread at the front.
+ *    threadlist_addtail     - insert a thread at the back.
+ *    threadlist_remhead     - remove and return the front thread, or NULL.
+ *    threadlist_remtail     - remove and return the back thread, or NULL.
+ *    threadlist_remove      - remove a specific thread from the list.
+ *
+ * The thread-based calls use t_listnode. A thread that must be on a
+ * second list at the same time (e.g. the timed-sleep list while also
+ * asleep) has another node for it, used with the node-based calls:
+ *
+ *    threadlist_addtailnode - insert a node at the back.
+ *    threadlist_removenode  - remove a node from the list.
+ */
+
+struct thread;
+
+struct threadlistnode {
+	struct threadlistnode *tln_prev;
+	struct threadlistnode *tln_next;
+	struct thread *tln_self;
+};
+
+struct threadlist {
+	struct threadlistnode tl_head;
+	struct threadlistnode tl_tail;
+	unsigned tl_count;
+};
+
+void threadlistnode_init(struct threadlistnode *tln, struct thread *self);
+void threadlistnode_cleanup(struct threadlistnode *tln);
+
+void threadlist_init(struct threadlist *tl);
+void threadlist_cleanup(struct threadlist *tl);
+int threadlist_isempty(struct threadlist *tl);
+
+void threadlist_addhead(struct threadlist *tl, struct thread *t);
+void threadlist_addtail(struct threadlist *tl, struct thread *t);
+struct thread *threadlist_remhead(struct threadlist *tl);
+struct thread *threadlist_remtail(struct threadlist *tl);
+void threadlist_remove(struct threadlist *tl, struct thread *t);
+
+void threadlist_addtailnode(struct threadlist *tl, struct threadlistnode *tln);
+void threadlist_removenode(struct threadlist *tl, struct threadlistnode *tln);
+
+/*
+ * Iterate over a list. ITER is a struct threadlistnode pointer. The
+ * loop body must not remove the current node; save tln_next first if
+ * it needs to.
+ */
+#define THREADLIST_FORALL(iter, tl) \
+	for ((iter) = (tl)->tl_head.tln_next; \
+	     (iter) != &(tl)->tl_tail; \
+	     (iter) = (iter)->tln_next)
+
+#endif /* _THREADLIST_H_ */
@@ -0,0 +1,22 @@
+#ifndef _TIMESTAMP_H_
+#define _TIMESTAMP_H_
+
+#include <clock.h>
+
+/*
+ * Microsecond timestamps from the hardware clock, folded into a
+ * u_int32_t so that an interval is a single unsigned subtraction
+ * (which stays correct across the wrap every ~71 minutes). Uses only
+ * 32-bit arithmetic.
+ */
+static inline u_int32_t
+timestamp_us(void)
+{
+	time_t secs;
+	u_int32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (u_int32_t)secs * 1000000 + nsecs / 1000;
+}
+
+#endif /* _TIMESTAMP_H_ */
@@ -0,0 +1,518 @@
+/*
+ * Traffic workloads: arrival generators and trace files.
+ * See workload.h for the specification.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <kern/unistd.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <uio.h>
+#include <workload.h>
+
+/*
+ * -ln(i/256) in 16.16 fixed point, for i = 0..256 (entry 0 unused).
+ * The kernel has no floating point, so exponential gaps are drawn
+ * from this table.
+ */
+static const u_int32_t neglog[257] = {
+	0, 363409, 317983, 291410, 272557, 257933, 245984, 235882,
+	227130, 219411, 212507, 206260, 200558, 195312, 190455, 185934,
+	181704, 177731, 173985, 170442, 167080, 163883, 160834, 157921,
+	155132, 152457, 149886, 147413, 145029, 142730, 140508, 138359,
+	136278, 134262, 132305, 130405, 128559, 126764, 125016, 123314,
+	121654, 120036, 118457, 116915, 115408, 113935, 112495, 111085,
+	109706, 108354, 107030, 105733, 104460, 103212, 101987, 100784,
+	99603, 98443, 97304, 96183, 95082, 93999, 92933, 91884,
+	90852, 89836, 88836, 87850, 86879, 85922, 84979, 84050,
+	83133, 82229, 81338, 80458, 79590, 78733, 77887, 77053,
+	76228, 75414, 74610, 73816, 73031, 72255, 71489, 70731,
+	69982, 69241, 68509, 67785, 67069, 66360, 65659, 64966,
+	64280, 63600, 62928, 62263, 61604, 60952, 60307, 59667,
+	59034, 58407, 57786, 57170, 56561, 55957, 55358, 54765,
+	54177, 53595, 53017, 52445, 51877, 51315, 50757, 50204,
+	49656, 49112, 48572, 48037, 47507, 46980, 46458, 45940,
+	45426, 44916, 44410, 43908, 43409, 42915, 42424, 41937,
+	41453, 40973, 40496, 40023, 39553, 39087, 38624, 38164,
+	37707, 37254, 36803, 36356, 35911, 35470, 35032, 34596,
+	34164, 33734, 33307, 32883, 32461, 32043, 31627, 31213,
+	30802, 30394, 29988, 29585, 29184, 28786, 28390, 27996,
+	27605, 27216, 26829, 26445, 26063, 25683, 25305, 24929,
+	24556, 24185, 23815, 23448, 23083, 22720, 22359, 22000,
+	21643, 21288, 20934, 20583, 20233, 19886, 19540, 19196,
+	18854, 18513, 18174, 17837, 17502, 17169, 16837, 16507,
+	16178, 15851, 15526, 15202, 14880, 14560, 14241, 13924,
+	13608, 13294, 12981, 12669, 12360, 12051, 11744, 11439,
+	11135, 10832, 10530, 10231, 9932, 9635, 9339, 9044,
+	8751, 8459, 8169, 7879, 7591, 7304, 7019, 6734,
+	6451, 6169, 5889, 5609, 5331, 5054, 4778, 4503,
+	4230, 3957, 3686, 3415, 3146, 2878, 2611, 2345,
+	2081, 1817, 1554, 1293, 1032, 773, 514, 257,
+	0,
+};
+
+/* xorshift32 */
+static
+u_int32_t
+wl_random(struct workload *wl)
+{
+	u_int32_t x = wl->wl_rand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	wl->wl_rand = x;
+	return x;
+}
+
+/*
+ * A draw from the exponential distribution with mean 1, in 16.16
+ * fixed point. U is uniform in 256 steps, interpolated in between
+ * with 8 more bits; U in the lowest step is ln 256 plus another draw,
+ * since the distribution is memoryless.
+ */
+static
+u_int32_t
+wl_exp(struct workload *wl)
+{
+	u_int32_t r, hi, lo, base = 0;
+
+	for (;;) {
+		r = wl_random(wl);
+		hi = (r >> 8) & 0xff;
+		lo = r & 0xff;
+		if (hi != 0) {
+			break;
+		}
+		base += neglog[1];
+	}
+	return base + neglog[hi] -
+		(neglog[hi] - neglog[hi + 1]) * (2 * lo + 1) / 512;
+}
+
+/* E (16.16 fixed point) times N, in 32 bits. */
+static
+u_int32_t
+fixmul(u_int32_t e, u_int32_t n)
+{
+	u_int32_t frac = e & 0xffff;
+
+	return (e >> 16) * n + frac * (n >> 16) +
+		((frac * (n & 0xffff)) >> 16);
+}
+
+/*
+ * The mean gap between arrivals right now, in microseconds.
+ */
+static
+u_int32_t
+wl_meangap(struct workload *wl)
+{
+	u_int32_t permille = 1000, rate, phase, dist, up;
+
+	if (wl->wl_rushusecs >= 1000 && wl->wl_rushpeak > 1) {
+		/* Triangle: 0 at the ends of the period, 1000 mid-way. */
+		phase = wl->wl_now % wl->wl_rushusecs;
+		dist = (2 * phase > wl->wl_rushusecs) ?
+			2 * phase - wl->wl_rushusecs :
+			wl->wl_rushusecs - 2 * phase;
+		up = 1000 - dist / (wl->wl_rushusecs / 1000);
+		if (up > 1000) {
+			up = 0;
+		}
+		permille += (wl->wl_rushpeak - 1) * up;
+	}
+	if (wl->wl_model == WL_BURSTY && wl->wl_inburst) {
+		permille *= wl->wl_burstfactor;
+	}
+
+	rate = wl->wl_rate / 1000 * permille + wl->wl_rate % 1000 * permille / 1000;
+	if (rate == 0) {
+		rate = 1;
+	}
+	return 1000000 / rate;
+}
+
+/* Picks a lane according to the lane weights. */
+static
+int
+wl_lane(struct workload *wl)
+{
+	u_int32_t total = 0, r;
+	int i;
+
+	for (i = 0; i < wl->wl_nlanes; i++) {
+		total += wl->wl_laneweight[i];
+	}
+	r = wl_random(wl) % total;
+	for (i = 0; i < wl->wl_nlanes - 1; i++) {
+		if (r < wl->wl_laneweight[i]) {
+			break;
+		}
+		r -= wl->wl_laneweight[i];
+	}
+	return i;
+}
+
+static
+void
+wl_generate(struct workload *wl, struct arrival *ar)
+{
+	u_int32_t gap;
+
+	while (wl->wl_model != WL_BURST) {
+		gap = fixmul(wl_exp(wl), wl_meangap(wl));
+		if (wl->wl_model != WL_BURSTY ||
+		    wl->wl_now + gap < wl->wl_phaseend) {
+			wl->wl_now += gap;
+			break;
+		}
+		/* The period ends first: switch, and draw again from there. */
+		wl->wl_now = wl->wl_phaseend;
+		wl->wl_inburst = !wl->wl_inburst;
+		wl->wl_phaseend = wl->wl_now +
+			fixmul(wl_exp(wl), wl->wl_burstusecs);
+	}
+
+	ar->ar_time = wl->wl_now;
+	ar->ar_intersection = wl_random(wl) % wl->wl_nintersections;
+	ar->ar_lane = wl_lane(wl);
+	ar->ar_turn = WL_ANYTURN;
+	ar->ar_type = (wl_random(wl) % 1000 < wl->wl_truckpermille) ? 1 : 0;
+}
+
+void
+workload_init(struct workload *wl, int nintersections, int nlanes)
+{
+	int i;
+
+	assert(nintersections > 0);
+	assert(nlanes > 0 && nlanes <= WL_MAXLANES);
+
+	wl->wl_model = WL_BURST;
+	wl->wl_rate = WL_RATE;
+	wl->wl_burstfactor = 10;
+	wl->wl_burstusecs = 100000;
+	wl->wl_rushusecs = 0;
+	wl->wl_rushpeak = 1;
+	wl->wl_truckpermille = 500;
+	for (i = 0; i < WL_MAXLANES; i++) {
+		wl->wl_laneweight[i] = 1;
+	}
+
+	wl->wl_nintersections = nintersections;
+	wl->wl_nlanes = nlanes;
+	wl->wl_now = 0;
+	wl->wl_rand = random() | 1;
+	wl->wl_inburst = 0;
+	wl->wl_phaseend = 0;
+	wl->wl_trace = NULL;
+}
+
+int
+workload_setskew(struct workload *wl, const char *spec)
+{
+	u_int32_t weights[WL_MAXLANES];
+	u_int32_t w, total = 0;
+	int i, n = 0;
+
+	for (i = 0; i < WL_MAXLANES; i++) {
+		weights[i] = 1;
+	}
+	while (*spec != 0) {
+		if (n == WL_MAXLANES || *spec < '0' || *spec > '9') {
+			return EINVAL;
+		}
+		w = 0;
+		while (*spec >= '0' && *spec <= '9' && w < 100000) {
+			w = w * 10 + (*spec++ - '0');
+		}
+		weights[n++] = w;
+		if (*spec == ':') {
+			spec++;
+		}
+		else if (*spec != 0) {
+			return EINVAL;
+		}
+	}
+	for (i = 0; i < wl->wl_nlanes; i++) {
+		total += weights[i];
+	}
+	if (total == 0) {
+		return EINVAL;
+	}
+	for (i = 0; i < WL_MAXLANES; i++) {
+		wl->wl_laneweight[i] = weights[i];
+	}
+	return 0;
+}
+
+/*
+ * Trace files.
+ */
+
+#define TRACE_MAGIC   0x534c5452	/* "SLTR" */
+#define TRACE_VERSION 1
+#define TRACE_HDRLEN  16
+#define TRACE_RECLEN  8
+#define TRACE_BUFLEN  4096		/* a multiple of TRACE_RECLEN */
+
+struct tracefile {
+	struct vnode *tf_vn;
+	off_t tf_offset;	/* file position after the buffered bytes */
+	int tf_len;		/* bytes in tf_buf */
+	int tf_pos;		/* next byte to read from tf_buf */
+	u_int32_t tf_last;	/* time of the last record read */
+	u_int8_t tf_buf[TRACE_BUFLEN];
+};
+
+static
+void
+put32(u_int8_t *p, u_int32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static
+u_int32_t
+get32(const u_int8_t *p)
+{
+	return ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) |
+		((u_int32_t)p[2] << 8) | p[3];
+}
+
+static
+int
+trace_open(const char *path, int flags, struct tracefile **ret)
+{
+	struct tracefile *tf;
+	char *copy;
+	int result;
+
+	tf = kmalloc(sizeof(struct tracefile));
+	copy = kstrdup(path);	/* vfs_open may scribble on it */
+	if (tf == NULL || copy == NULL) {
+		kfree(tf);
+		kfree(copy);
+		return ENOMEM;
+	}
+	result = vfs_open(copy, flags, &tf->tf_vn);
+	kfree(copy);
+	if (result) {
+		kfree(tf);
+		return result;
+	}
+	tf->tf_offset = 0;
+	tf->tf_len = 0;
+	tf->tf_pos = 0;
+	tf->tf_last = 0;
+	*ret = tf;
+	return 0;
+}
+
+static
+void
+trace_close(struct tracefile *tf)
+{
+	vfs_close(tf->tf_vn);
+	kfree(tf);
+}
+
+/*
+ * Make sure at least LEN bytes are buffered, reading more if needed.
+ * Returns 0, ENOENT if the file ends cleanly first, EINVAL if it ends
+ * part way through, or a read error.
+ */
+static
+int
+trace_need(struct tracefile *tf, int len)
+{
+	struct uio u;
+	int left, result;
+
+	left = tf->tf_len - tf->tf_pos;
+	if (left >= len) {
+		return 0;
+	}
+	memmove(tf->tf_buf, tf->tf_buf + tf->tf_pos, left);
+	tf->tf_len = left;
+	tf->tf_pos = 0;
+
+	while (tf->tf_len < len) {
+		mk_kuio(&u, tf->tf_buf + tf->tf_len, TRACE_BUFLEN - tf->tf_len,
+			tf->tf_offset, UIO_READ);
+		result = VOP_READ(tf->tf_vn, &u);
+		if (result) {
+			return result;
+		}
+		if (u.uio_offset == tf->tf_offset) {
+			return (tf->tf_len == 0) ? ENOENT : EINVAL;
+		}
+		tf->tf_len += u.uio_offset - tf->tf_offset;
+		tf->tf_offset = u.uio_offset;
+	}
+	return 0;
+}
+
+/* Write out whatever is buffered. */
+static
+int
+trace_flush(struct tracefile *tf)
+{
+	struct uio u;
+	int result;
+
+	while (tf->tf_len > 0) {
+		mk_kuio(&u, tf->tf_buf, tf->tf_len, tf->tf_offset, UIO_WRITE);
+		result = VOP_WRITE(tf->tf_vn, &u);
+		if (result) {
+			return result;
+		}
+		if (u.uio_offset == tf->tf_offset) {
+			return EIO;
+		}
+		memmove(tf->tf_buf, tf->tf_buf + (u.uio_offset - tf->tf_offset),
+			tf->tf_len - (u.uio_offset - tf->tf_offset));
+		tf->tf_len -= u.uio_offset - tf->tf_offset;
+		tf->tf_offset = u.uio_offset;
+	}
+	return 0;
+}
+
+/* Append LEN bytes to the trace being written. */
+static
+int
+trace_put(struct tracefile *tf, const u_int8_t *p, int len)
+{
+	int result;
+
+	if (tf->tf_len + len > TRACE_BUFLEN) {
+		result = trace_flush(tf);
+		if (result) {
+			return result;
+		}
+	}
+	memcpy(tf->tf_buf + tf->tf_len, p, len);
+	tf->tf_len += len;
+	return 0;
+}
+
+int
+workload_opentrace(struct workload *wl, const char *path)
+{
+	struct tracefile *tf;
+	const u_int8_t *hdr;
+	int result;
+
+	result = trace_open(path, O_RDONLY, &tf);
+	if (result) {
+		return result;
+	}
+	result = trace_need(tf, TRACE_HDRLEN);
+	if (result == 0) {
+		hdr = tf->tf_buf + tf->tf_pos;
+		if (get32(hdr) != TRACE_MAGIC || get32(hdr + 4) != TRACE_VERSION) {
+			result = EINVAL;
+		}
+		tf->tf_pos += TRACE_HDRLEN;
+	}
+	else if (result == ENOENT) {
+		result = EINVAL;
+	}
+	if (result) {
+		trace_close(tf);
+		return result;
+	}
+
+	if (wl->wl_trace != NULL) {
+		trace_close(wl->wl_trace);
+	}
+	wl->wl_trace = tf;
+	return 0;
+}
+
+int
+workload_next(struct workload *wl, struct arrival *ar)
+{
+	struct tracefile *tf = wl->wl_trace;
+	const u_int8_t *rec;
+	int result;
+
+	if (tf == NULL) {
+		wl_generate(wl, ar);
+		return 0;
+	}
+
+	result = trace_need(tf, TRACE_RECLEN);
+	if (result) {
+		return result;
+	}
+	rec = tf->tf_buf + tf->tf_pos;
+	tf->tf_pos += TRACE_RECLEN;
+
+	ar->ar_time = get32(rec);
+	ar->ar_intersection = (rec[4] << 8) | rec[5];
+	ar->ar_lane = rec[6];
+	ar->ar_turn = (int)(rec[7] & 7) - 1;
+	ar->ar_type = (rec[7] & TR_TRUCK) ? 1 : 0;
+	if (ar->ar_time < tf->tf_last) {
+		return EINVAL;
+	}
+	tf->tf_last = ar->ar_time;
+	return 0;
+}
+
+int
+workload_record(struct workload *wl, const char *path, int n)
+{
+	struct tracefile *tf;
+	struct arrival ar;
+	u_int8_t buf[TRACE_HDRLEN];
+	int i, result;
+
+	result = trace_open(path, O_WRONLY | O_CREAT | O_TRUNC, &tf);
+	if (result) {
+		return result;
+	}
+
+	put32(buf, TRACE_MAGIC);
+	put32(buf + 4, TRACE_VERSION);
+	put32(buf + 8, n);
+	put32(buf + 12, 0);
+	result = trace_put(tf, buf, TRACE_HDRLEN);
+
+	for (i = 0; i < n && result == 0; i++) {
+		result = workload_next(wl, &ar);
+		if (result) {
+			break;
+		}
+		put32(buf, ar.ar_time);
+		buf[4] = ar.ar_intersection >> 8;
+		buf[5] = ar.ar_intersection;
+		buf[6] = ar.ar_lane;
+		buf[7] = (ar.ar_turn + 1) & 7;
+		if (ar.ar_type) {
+			buf[7] |= TR_TRUCK;
+		}
+		result = trace_put(tf, buf, TRACE_RECLEN);
+	}
+	if (result == 0) {
+		result = trace_flush(tf);
+	}
+	trace_close(tf);
+	return result;
+}
+
+void
+workload_cleanup(struct workload *wl)
+{
+	if (wl->wl_trace != NULL) {
+		trace_close(wl->wl_trace);
+		wl->wl_trace = NULL;
+	}
+}
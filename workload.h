@@ -0,0 +1,117 @@
+#ifndef _WORKLOAD_H_
+#define _WORKLOAD_H_
+
+/*
+ * Traffic workloads: where and when vehicles arrive.
+ *
+ * A workload hands out arrivals one at a time, in time order. Each
+ * says when (in microseconds from the start of the run) a vehicle
+ * turns up, at which intersection and on which lane, what it is, and
+ * optionally which way it means to turn. Arrivals come either from a
+ * generator or from a trace file.
+ *
+ * Generators (wl_model):
+ *    WL_BURST   - everything arrives at time 0: the classic stoplight.
+ *    WL_POISSON - a Poisson process of wl_rate arrivals per second.
+ *    WL_BURSTY  - a Poisson process switching between quiet periods
+ *                 at wl_rate and bursts at wl_rate * wl_burstfactor.
+ *                 Both kinds of period last wl_burstusecs on average,
+ *                 exponentially distributed.
+ * Any of the Poisson models can also have a rush hour: with
+ * wl_rushusecs set, the rate ramps up from its usual value to
+ * wl_rushpeak times that at the middle of each wl_rushusecs period,
+ * and back down again by its end.
+ *
+ * wl_rate may be up to WL_MAXRATE, wl_burstfactor up to WL_MAXFACTOR
+ * and wl_rushpeak up to WL_MAXPEAK; the arithmetic is 32-bit fixed
+ * point and would overflow beyond them.
+ *
+ * The intersection is uniform; the lane is weighted by wl_laneweight
+ * (see workload_setskew); wl_truckpermille of vehicles are trucks; and
+ * the turn is left to the vehicle (WL_ANYTURN). Generators use their
+ * own random number state, seeded once from random(), so a workload
+ * doesn't disturb anything else's random numbers and vice versa.
+ *
+ * Trace files are a 16-byte header followed by 8-byte records, all
+ * big-endian:
+ *
+ *    header: "SLTR", version (1), record count (0 if unknown), 0
+ *    record: time (u_int32_t), intersection (u_int16_t), lane
+ *            (u_int8_t), then a byte holding the turn plus one in
+ *            bits 0-2 (0 for WL_ANYTURN) and TR_TRUCK for trucks.
+ *
+ * Times must not go backwards. Traces are read a buffer at a time
+ * through the VFS, so they can be much bigger than memory. A trace
+ * recorded with a different grid or number of lanes still replays;
+ * the consumer folds out-of-range values back into range.
+ *
+ * Operations:
+ *    workload_init      - set up workload WL for NINTERSECTIONS
+ *                         intersections of NLANES lanes, with the
+ *                         defaults: WL_BURST, WL_RATE per second, no
+ *                         skew, half trucks.
+ *    workload_setskew   - set the lane weights from a string like
+ *                         "4:2:1" (missing lanes get 1). Returns 0 or
+ *                         EINVAL.
+ *    workload_opentrace - replay the trace at PATH instead of
+ *                         generating. Returns 0 or an error code.
+ *    workload_next      - get the next arrival. Returns 0, ENOENT at
+ *                         the end of a trace, or another error code if
+ *                         the trace is bad or can't be read.
+ *    workload_record    - write the next N arrivals to a new trace at
+ *                         PATH. Returns 0 or an error code.
+ *    workload_cleanup   - close any trace.
+ */
+
+#define WL_BURST   0
+#define WL_POISSON 1
+#define WL_BURSTY  2
+
+#define WL_MAXLANES  8
+#define WL_RATE      1000
+#define WL_MAXRATE   100000
+#define WL_MAXFACTOR 100
+#define WL_MAXPEAK   20
+#define WL_ANYTURN   (-1)
+
+#define TR_TRUCK    0x80
+
+struct arrival {
+	u_int32_t ar_time;
+	int ar_intersection;
+	int ar_lane;
+	int ar_turn;
+	int ar_type;	/* 0 car, 1 truck */
+};
+
+struct tracefile;
+
+struct workload {
+	/* Settings; change after workload_init as needed. */
+	int wl_model;
+	u_int32_t wl_rate;
+	u_int32_t wl_burstfactor;
+	u_int32_t wl_burstusecs;
+	u_int32_t wl_rushusecs;
+	u_int32_t wl_rushpeak;
+	u_int32_t wl_truckpermille;
+	u_int32_t wl_laneweight[WL_MAXLANES];
+
+	/* State. */
+	int wl_nintersections;
+	int wl_nlanes;
+	u_int32_t wl_now;
+	u_int32_t wl_rand;
+	int wl_inburst;
+	u_int32_t wl_phaseend;
+	struct tracefile *wl_trace;
+};
+
+void workload_init(struct workload *wl, int nintersections, int nlanes);
+int workload_setskew(struct workload *wl, const char *spec);
+int workload_opentrace(struct workload *wl, const char *path);
+int workload_next(struct workload *wl, struct arrival *ar);
+int workload_record(struct workload *wl, const char *path, int n);
+void workload_cleanup(struct workload *wl);
+
+#endif /* _WORKLOAD_H_ */